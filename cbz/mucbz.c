@@ -318,7 +318,7 @@ cbz_open_document(fz_context *ctx, char *filename)
 	fz_stream *file;
 	cbz_document *doc;
 
-	file = fz_open_file(ctx, filename);
+	file = fz_open_mapped_file(ctx, filename);
 	if (!file)
 		fz_throw(ctx, "cannot open file '%s': %s", filename, strerror(errno));
 
@@ -605,6 +605,40 @@ fz_draw_stroke_text(fz_device *devp, fz_text *text, fz_stroke_state *stroke, fz_
 		fz_knockout_end(dev);
 }
 
+/* Add a glyph outline (in user space) to a text clip mask, for glyphs
+ * too big to go through the glyph cache. */
+static void
+fz_draw_clip_glyph_path(fz_draw_device *dev, fz_path *path, fz_stroke_state *stroke, fz_matrix ctm,
+	fz_bbox bbox, fz_pixmap *mask, fz_pixmap *shape)
+{
+	float expansion = fz_matrix_expansion(ctm);
+	float flatness = 0.3f / expansion;
+	float linewidth;
+
+	fz_reset_gel(dev->gel, bbox);
+	if (stroke)
+	{
+		linewidth = stroke->linewidth;
+		if (linewidth * expansion < 0.1f)
+			linewidth = 1 / expansion;
+		if (stroke->dash_len > 0)
+			fz_flatten_dash_path(dev->gel, path, stroke, ctm, flatness, linewidth);
+		else
+			fz_flatten_stroke_path(dev->gel, path, stroke, ctm, flatness, linewidth);
+	}
+	else
+		fz_flatten_fill_path(dev->gel, path, ctm, flatness);
+	fz_sort_gel(dev->gel);
+
+	bbox = fz_intersect_bbox(fz_bound_gel(dev->gel), bbox);
+	if (fz_is_empty_rect(bbox))
+		return;
+
+	fz_scan_convert(dev->gel, 0, bbox, mask, NULL);
+	if (shape)
+		fz_scan_convert(dev->gel, 0, bbox, shape, NULL);
+}
+
 static void
 fz_draw_clip_text(fz_device *devp, fz_text *text, fz_matrix ctm, int accumulate)
 {
@@ -693,8 +727,16 @@ fz_draw_clip_text(fz_device *devp, fz_text *text, fz_matrix ctm, int accumulate)
 			}
 			else
 			{
-				fz_warn(dev->ctx, "cannot draw glyph for clipping (unimplemented case)");
-				// TODO: outline/non-cached case
+				fz_path *path = fz_outline_glyph(dev->ctx, text->font, gid, tm);
+				if (path)
+				{
+					fz_draw_clip_glyph_path(dev, path, NULL, ctm, bbox, mask, state[1].shape);
+					fz_free_path(dev->ctx, path);
+				}
+				else
+				{
+					fz_warn(dev->ctx, "cannot draw glyph for clipping");
+				}
 			}
 		}
 	}
@@ -765,8 +807,16 @@ fz_draw_clip_stroke_text(fz_device *devp, fz_text *text, fz_stroke_state *stroke
 			}
 			else
 			{
-				fz_warn(dev->ctx, "cannot draw glyph for clipping (unimplemented case)");
-				// TODO: outline/non-cached case
+				fz_path *path = fz_outline_glyph(dev->ctx, text->font, gid, tm);
+				if (path)
+				{
+					fz_draw_clip_glyph_path(dev, path, stroke, ctm, bbox, mask, shape);
+					fz_free_path(dev->ctx, path);
+				}
+				else
+				{
+					fz_warn(dev->ctx, "cannot draw glyph for clipping");
+				}
 			}
 		}
 	}
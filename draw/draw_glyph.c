@@ -161,38 +161,32 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix ctm, fz_color
 		return val;
 	}
 
-	fz_try(ctx)
+	/* We drop the glyphcache here, and render the glyph (with
+	 * freetype, or by executing the t3 glyph code). The danger
+	 * here is that some other thread will come along, and want
+	 * the same glyph too. If it does, we may both end up rendering
+	 * pixmaps. We cope with this later on, by ensuring that only
+	 * one gets inserted into the cache. If we insert ours to find
+	 * one already there, we abandon ours, and use the one there
+	 * already.
+	 */
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+
+	if (font->ft_face)
 	{
-		if (font->ft_face)
-		{
-			val = fz_render_ft_glyph(ctx, font, gid, ctm, key.aa);
-		}
-		else if (font->t3procs)
-		{
-			/* We drop the glyphcache here, and execute the t3
-			 * glyph code. The danger here is that some other
-			 * thread will come along, and want the same glyph
-			 * too. If it does, we may both end up rendering
-			 * pixmaps. We cope with this later on, by ensuring
-			 * that only one gets inserted into the cache. If
-			 * we insert ours to find one already there, we
-			 * abandon ours, and use the one there already.
-			 */
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
-			val = fz_render_t3_glyph(ctx, font, gid, ctm, model, scissor);
-			fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-		}
-		else
-		{
-			fz_warn(ctx, "assert: uninitialized font structure");
-			val = NULL;
-		}
+		val = fz_render_ft_glyph(ctx, font, gid, ctm, key.aa);
 	}
-	fz_catch(ctx)
+	else if (font->t3procs)
 	{
-		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
-		fz_rethrow(ctx);
+		val = fz_render_t3_glyph(ctx, font, gid, ctm, model, scissor);
 	}
+	else
+	{
+		fz_warn(ctx, "assert: uninitialized font structure");
+		val = NULL;
+	}
+
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
 
 	if (val && do_cache)
 	{
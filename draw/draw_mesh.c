@@ -626,13 +626,33 @@ fz_paint_radial(fz_shade *shade, fz_matrix ctm, fz_pixmap *dest, fz_bbox bbox)
 	}
 }
 
+static int
+triangle_in_bbox(float tri[3][MAXN], fz_bbox bbox)
+{
+	float x0, y0, x1, y1;
+	int k;
+
+	x0 = x1 = tri[0][0];
+	y0 = y1 = tri[0][1];
+	for (k = 1; k < 3; k++)
+	{
+		if (tri[k][0] < x0) x0 = tri[k][0];
+		if (tri[k][0] > x1) x1 = tri[k][0];
+		if (tri[k][1] < y0) y0 = tri[k][1];
+		if (tri[k][1] > y1) y1 = tri[k][1];
+	}
+
+	/* fz_paint_triangle rounds y to the nearest scanline */
+	return x1 >= bbox.x0 && x0 <= bbox.x1 && y1 + 0.5f >= bbox.y0 && y0 - 0.5f <= bbox.y1;
+}
+
 static void
 fz_paint_mesh(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_pixmap *dest, fz_bbox bbox)
 {
 	float tri[3][MAXN];
 	fz_point p;
 	float *mesh;
-	int ntris;
+	int ntris, vsize;
 	int i, k;
 
 	mesh = shade->mesh;
@@ -642,15 +662,35 @@ fz_paint_mesh(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_pixmap *dest,
 	else
 		ntris = shade->mesh_len / ((2 + shade->colorspace->n) * 3);
 
+	vsize = shade->use_function ? 3 : 2 + shade->colorspace->n;
+
 	while (ntris--)
 	{
+		/*
+		 * Transform the corners first so that triangles which do not
+		 * touch the band being drawn can be binned away before we pay
+		 * for color conversion and polygon clipping. This keeps banded
+		 * rendering (one band per thread) proportional to the number
+		 * of triangles that actually fall in each band.
+		 */
 		for (k = 0; k < 3; k++)
 		{
-			p.x = *mesh++;
-			p.y = *mesh++;
+			p.x = mesh[k * vsize];
+			p.y = mesh[k * vsize + 1];
 			p = fz_transform_point(ctm, p);
 			tri[k][0] = p.x;
 			tri[k][1] = p.y;
+		}
+
+		if (!triangle_in_bbox(tri, bbox))
+		{
+			mesh += vsize * 3;
+			continue;
+		}
+
+		for (k = 0; k < 3; k++)
+		{
+			mesh += 2;
 			if (shade->use_function)
 				tri[k][2] = *mesh++ * 255;
 			else
@@ -665,6 +705,62 @@ fz_paint_mesh(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_pixmap *dest,
 	}
 }
 
+struct paint_tri_data
+{
+	fz_shade *shade;
+	fz_pixmap *dest;
+	fz_bbox bbox;
+};
+
+static void
+do_paint_tri(fz_context *ctx, void *arg, fz_vertex *av, fz_vertex *bv, fz_vertex *cv)
+{
+	struct paint_tri_data *ptd = (struct paint_tri_data *)arg;
+	fz_shade *shade = ptd->shade;
+	fz_pixmap *dest = ptd->dest;
+	fz_vertex *vertices[3];
+	float tri[3][MAXN];
+	int i, k;
+
+	vertices[0] = av;
+	vertices[1] = bv;
+	vertices[2] = cv;
+
+	for (k = 0; k < 3; k++)
+	{
+		tri[k][0] = vertices[k]->x;
+		tri[k][1] = vertices[k]->y;
+		if (shade->use_function)
+			tri[k][2] = vertices[k]->c[0] * 255;
+		else
+		{
+			fz_convert_color(ctx, dest->colorspace, tri[k] + 2, shade->colorspace, vertices[k]->c);
+			for (i = 0; i < dest->colorspace->n; i++)
+				tri[k][i + 2] *= 255;
+		}
+	}
+
+	fz_paint_triangle(dest, tri[0], tri[1], tri[2], 2 + dest->colorspace->n, ptd->bbox);
+}
+
+static void
+fz_paint_packed_mesh(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_pixmap *dest, fz_bbox bbox)
+{
+	struct paint_tri_data ptd;
+	fz_rect clip;
+
+	ptd.shade = shade;
+	ptd.dest = dest;
+	ptd.bbox = bbox;
+
+	clip.x0 = bbox.x0;
+	clip.y0 = bbox.y0;
+	clip.x1 = bbox.x1;
+	clip.y1 = bbox.y1;
+
+	fz_process_mesh(ctx, shade, ctm, clip, do_paint_tri, &ptd);
+}
+
 void
 fz_paint_shade(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_pixmap *dest, fz_bbox bbox)
 {
@@ -704,6 +800,10 @@ fz_paint_shade(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_pixmap *dest,
 		case FZ_LINEAR: fz_paint_linear(shade, ctm, temp, bbox); break;
 		case FZ_RADIAL: fz_paint_radial(shade, ctm, temp, bbox); break;
 		case FZ_MESH: fz_paint_mesh(ctx, shade, ctm, temp, bbox); break;
+		case FZ_MESH_TYPE4:
+		case FZ_MESH_TYPE5:
+		case FZ_MESH_TYPE6:
+		case FZ_MESH_TYPE7: fz_paint_packed_mesh(ctx, shade, ctm, temp, bbox); break;
 		}
 
 		if (shade->use_function)
@@ -91,6 +91,20 @@ fz_paint_solid_color(byte * restrict dp, int n, int w, byte *color)
 	int n1 = n - 1;
 	int sa = FZ_EXPAND(color[n1]);
 	int k;
+
+	/* Opaque fills (the common case for sharp rendering) are plain stores */
+	if (color[n1] == 255)
+	{
+		while (w--)
+		{
+			for (k = 0; k < n1; k++)
+				dp[k] = color[k];
+			dp[k] = 255;
+			dp += n;
+		}
+		return;
+	}
+
 	while (w--)
 	{
 		int ma = FZ_COMBINE(FZ_EXPAND(255), sa);
@@ -111,6 +125,19 @@ fz_paint_span_with_color_2(byte * restrict dp, byte * restrict mp, int w, byte *
 	while (w--)
 	{
 		int ma = *mp++;
+		/* Masks from sharp rendering are all 0 or 255 */
+		if (ma == 0)
+		{
+			dp += 2;
+			continue;
+		}
+		if (ma == 255 && sa == 256)
+		{
+			dp[0] = g;
+			dp[1] = 255;
+			dp += 2;
+			continue;
+		}
 		ma = FZ_COMBINE(FZ_EXPAND(ma), sa);
 		dp[0] = FZ_BLEND(g, dp[0], ma);
 		dp[1] = FZ_BLEND(255, dp[1], ma);
@@ -128,6 +155,20 @@ fz_paint_span_with_color_4(byte * restrict dp, byte * restrict mp, int w, byte *
 	while (w--)
 	{
 		int ma = *mp++;
+		if (ma == 0)
+		{
+			dp += 4;
+			continue;
+		}
+		if (ma == 255 && sa == 256)
+		{
+			dp[0] = r;
+			dp[1] = g;
+			dp[2] = b;
+			dp[3] = 255;
+			dp += 4;
+			continue;
+		}
 		ma = FZ_COMBINE(FZ_EXPAND(ma), sa);
 		dp[0] = FZ_BLEND(r, dp[0], ma);
 		dp[1] = FZ_BLEND(g, dp[1], ma);
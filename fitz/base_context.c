@@ -10,7 +10,9 @@ fz_free_context(fz_context *ctx)
 	fz_drop_glyph_cache_context(ctx);
 	fz_drop_store_context(ctx);
 	fz_free_aa_context(ctx);
+	fz_free_ft_context(ctx);
 	fz_drop_font_context(ctx);
+	fz_drop_name_context(ctx);
 
 	if (ctx->warn)
 	{
@@ -94,6 +96,7 @@ fz_new_context(fz_alloc_context *alloc, fz_locks_context *locks, unsigned int ma
 		fz_new_store_context(ctx, max_store);
 		fz_new_glyph_cache_context(ctx);
 		fz_new_font_context(ctx);
+		fz_new_name_context(ctx);
 	}
 	fz_catch(ctx)
 	{
@@ -131,5 +134,8 @@ fz_clone_context_internal(fz_context *ctx)
 	new_ctx->glyph_cache = fz_keep_glyph_cache(new_ctx);
 	new_ctx->font = ctx->font;
 	new_ctx->font = fz_keep_font_context(new_ctx);
+	new_ctx->name = ctx->name;
+	new_ctx->name = fz_keep_name_context(new_ctx);
+	fz_new_ft_context(new_ctx);
 	return new_ctx;
 }
@@ -8,16 +8,41 @@
 #include FT_FREETYPE_H
 #include FT_ADVANCES_H
 
+#define CHUNK_SIZE (16 << 10) /* text page storage is allocated in chunks of this size */
+
 typedef struct fz_text_device_s fz_text_device;
 
 struct fz_text_device_s
 {
 	fz_text_sheet *sheet;
 	fz_text_page *page;
-	fz_text_line cur_line;
-	fz_text_span cur_span;
 	fz_point point;
 	int lastchar;
+
+	/* The line being built. Characters and spans are gathered in
+	 * scratch arrays that are reused from line to line, and only
+	 * copied into the page once the line is complete. */
+	fz_text_char *chars;
+	int chars_len, chars_cap;
+	fz_text_span *spans;
+	int *span_start;
+	int spans_len, spans_cap;
+
+	/* Indices of the page blocks, ordered by the bottom of their bbox */
+	int *order;
+	int order_len, order_cap;
+
+	/* Set for streaming devices; the page then holds only the block
+	 * currently being built, which is written out once complete. */
+	FILE *out;
+	int format;
+};
+
+struct fz_text_chunk_s
+{
+	fz_text_chunk *next;
+	int len, cap;
+	double data[1];
 };
 
 fz_text_sheet *
@@ -99,109 +124,250 @@ fz_new_text_page(fz_context *ctx, fz_rect mediabox)
 	page->len = 0;
 	page->cap = 0;
 	page->blocks = NULL;
+	page->chunks = NULL;
 	return page;
 }
 
-void
-fz_free_text_page(fz_context *ctx, fz_text_page *page)
+static void
+fz_empty_text_page(fz_context *ctx, fz_text_page *page)
 {
 	fz_text_block *block;
-	fz_text_line *line;
-	fz_text_span *span;
+	fz_text_chunk *chunk;
 	for (block = page->blocks; block < page->blocks + page->len; block++)
-	{
-		for (line = block->lines; line < block->lines + block->len; line++)
-		{
-			for (span = line->spans; span < line->spans + line->len; span++)
-			{
-				fz_free(ctx, span->text);
-			}
-			fz_free(ctx, line->spans);
-		}
 		fz_free(ctx, block->lines);
-	}
 	fz_free(ctx, page->blocks);
+	page->len = 0;
+	page->cap = 0;
+	page->blocks = NULL;
+	while (page->chunks)
+	{
+		chunk = page->chunks;
+		page->chunks = chunk->next;
+		fz_free(ctx, chunk);
+	}
+}
+
+void
+fz_free_text_page(fz_context *ctx, fz_text_page *page)
+{
+	if (!page)
+		return;
+	fz_empty_text_page(ctx, page);
 	fz_free(ctx, page);
 }
 
+/* Spans and characters never change once a line is complete, so they are
+ * carved out of large chunks owned by the page rather than malloced one
+ * array at a time. */
+static void *
+fz_text_page_alloc(fz_context *ctx, fz_text_page *page, int size)
+{
+	fz_text_chunk *chunk = page->chunks;
+	void *p;
+
+	size = (size + sizeof(double) - 1) & ~(sizeof(double) - 1);
+	if (!chunk || chunk->len + size > chunk->cap)
+	{
+		int cap = fz_maxi(CHUNK_SIZE, size);
+		chunk = fz_malloc(ctx, sizeof(fz_text_chunk) + cap);
+		chunk->next = page->chunks;
+		chunk->len = 0;
+		chunk->cap = cap;
+		page->chunks = chunk;
+	}
+
+	p = (char *)chunk->data + chunk->len;
+	chunk->len += size;
+	return p;
+}
+
 static void
-append_char(fz_context *ctx, fz_text_span *span, int c, fz_rect bbox)
+append_char(fz_context *ctx, fz_text_device *dev, fz_text_style *style, int c, fz_rect bbox)
 {
-	if (span->len == span->cap)
+	fz_text_span *span;
+
+	if (dev->spans_len == 0 || dev->spans[dev->spans_len - 1].style != style)
+	{
+		if (dev->spans_len == dev->spans_cap)
+		{
+			int new_cap = fz_maxi(8, dev->spans_cap * 2);
+			dev->spans = fz_resize_array(ctx, dev->spans, new_cap, sizeof(*dev->spans));
+			dev->span_start = fz_resize_array(ctx, dev->span_start, new_cap, sizeof(*dev->span_start));
+			dev->spans_cap = new_cap;
+		}
+		span = &dev->spans[dev->spans_len];
+		span->style = style;
+		span->bbox = fz_empty_rect;
+		span->len = span->cap = 0;
+		span->text = NULL;
+		dev->span_start[dev->spans_len++] = dev->chars_len;
+	}
+
+	if (dev->chars_len == dev->chars_cap)
 	{
-		int new_cap = fz_maxi(64, span->cap * 2);
-		span->text = fz_resize_array(ctx, span->text, new_cap, sizeof(*span->text));
-		span->cap = new_cap;
+		int new_cap = fz_maxi(64, dev->chars_cap * 2);
+		dev->chars = fz_resize_array(ctx, dev->chars, new_cap, sizeof(*dev->chars));
+		dev->chars_cap = new_cap;
 	}
+
+	span = &dev->spans[dev->spans_len - 1];
 	span->bbox = fz_union_rect(span->bbox, bbox);
-	span->text[span->len].c = c;
-	span->text[span->len].bbox = bbox;
 	span->len++;
+	dev->chars[dev->chars_len].c = c;
+	dev->chars[dev->chars_len].bbox = bbox;
+	dev->chars_len++;
 }
 
 static void
-init_span(fz_context *ctx, fz_text_span *span, fz_text_style *style)
+append_line(fz_context *ctx, fz_text_block *block, fz_text_line *line)
 {
-	span->style = style;
-	span->bbox = fz_empty_rect;
-	span->len = span->cap = 0;
-	span->text = NULL;
+	if (block->len == block->cap)
+	{
+		int new_cap = fz_maxi(16, block->cap * 2);
+		block->lines = fz_resize_array(ctx, block->lines, new_cap, sizeof *block->lines);
+		block->cap = new_cap;
+	}
+	block->bbox = fz_union_rect(block->bbox, line->bbox);
+	block->lines[block->len++] = *line;
 }
 
-static void
-append_span(fz_context *ctx, fz_text_line *line, fz_text_span *span)
+/* Position of the first block in the order whose bottom is at or below y */
+static int
+find_block_order(fz_text_device *dev, float y)
 {
-	if (span->len == 0)
-		return;
-	if (line->len == line->cap)
+	fz_text_block *blocks = dev->page->blocks;
+	int l = 0;
+	int r = dev->order_len;
+	while (l < r)
 	{
-		int new_cap = fz_maxi(8, line->cap * 2);
-		line->spans = fz_resize_array(ctx, line->spans, new_cap, sizeof(*line->spans));
-		line->cap = new_cap;
+		int m = (l + r) >> 1;
+		if (blocks[dev->order[m]].bbox.y1 < y)
+			l = m + 1;
+		else
+			r = m;
 	}
-	line->bbox = fz_union_rect(line->bbox, span->bbox);
-	line->spans[line->len++] = *span;
+	return l;
 }
 
 static void
-init_line(fz_context *ctx, fz_text_line *line)
+insert_block_order(fz_context *ctx, fz_text_device *dev, int block_n)
 {
-	line->bbox = fz_empty_rect;
-	line->len = line->cap = 0;
-	line->spans = NULL;
+	int pos;
+	if (dev->order_len == dev->order_cap)
+	{
+		int new_cap = fz_maxi(16, dev->order_cap * 2);
+		dev->order = fz_resize_array(ctx, dev->order, new_cap, sizeof(*dev->order));
+		dev->order_cap = new_cap;
+	}
+	pos = find_block_order(dev, dev->page->blocks[block_n].bbox.y1);
+	memmove(dev->order + pos + 1, dev->order + pos, (dev->order_len - pos) * sizeof(*dev->order));
+	dev->order[pos] = block_n;
+	dev->order_len++;
 }
 
 static void
-append_line(fz_context *ctx, fz_text_block *block, fz_text_line *line)
+remove_block_order(fz_text_device *dev, int block_n, float y1)
 {
-	if (block->len == block->cap)
+	int pos = find_block_order(dev, y1);
+	while (pos < dev->order_len && dev->order[pos] != block_n)
+		pos++;
+	if (pos == dev->order_len)
+		return;
+	dev->order_len--;
+	memmove(dev->order + pos, dev->order + pos + 1, (dev->order_len - pos) * sizeof(*dev->order));
+}
+
+static int
+line_continues_block(fz_text_line *line, fz_text_block *block, float size)
+{
+	float w = block->bbox.x1 - block->bbox.x0;
+	float dx = line->bbox.x0 - block->bbox.x0;
+	float dy = line->bbox.y0 - block->bbox.y1;
+	if (dy > -size * 1.5f && dy < size * PARAGRAPH_DIST)
+		if (line->bbox.x0 <= block->bbox.x1 && line->bbox.x1 >= block->bbox.x0)
+			if (fz_abs(dx) < w / 2)
+				return 1;
+	return 0;
+}
+
+/*
+ * Find the first block (in page order) that the line continues. Only
+ * blocks whose bottom edge is close to the top of the line can match, so
+ * rather than testing every block on the page we binary search the blocks
+ * ordered by their bottom edge for that window.
+ */
+static int
+lookup_block_for_line(fz_context *ctx, fz_text_device *dev, fz_text_line *line)
+{
+	fz_text_page *page = dev->page;
+	float size = line->spans[0].style->size;
+	int best = -1;
+	int i;
+
+	for (i = find_block_order(dev, line->bbox.y0 - size); i < dev->order_len; i++)
 	{
-		int new_cap = fz_maxi(16, block->cap * 2);
-		block->lines = fz_resize_array(ctx, block->lines, new_cap, sizeof *block->lines);
-		block->cap = new_cap;
+		int block_n = dev->order[i];
+		if (page->blocks[block_n].bbox.y1 > line->bbox.y0 + size * 2)
+			break;
+		if ((best < 0 || block_n < best) && line_continues_block(line, &page->blocks[block_n], size))
+			best = block_n;
 	}
-	block->bbox = fz_union_rect(block->bbox, line->bbox);
-	block->lines[block->len++] = *line;
+
+	return best;
 }
 
-static fz_text_block *
-lookup_block_for_line(fz_context *ctx, fz_text_page *page, fz_text_line *line)
+static void fz_print_text_block(FILE *out, fz_text_block *block, int format);
+
+/* Move the spans and characters of a completed line into page storage */
+static void
+copy_line(fz_context *ctx, fz_text_device *dev, fz_text_line *line)
 {
-	float size = line->len > 0 && line->spans[0].len > 0 ? line->spans[0].style->size : 1;
+	fz_text_span *spans;
+	fz_text_char *chars;
 	int i;
 
-	for (i = 0; i < page->len; i++)
+	spans = fz_text_page_alloc(ctx, dev->page, dev->spans_len * sizeof(*spans));
+	chars = fz_text_page_alloc(ctx, dev->page, dev->chars_len * sizeof(*chars));
+	memcpy(spans, dev->spans, dev->spans_len * sizeof(*spans));
+	memcpy(chars, dev->chars, dev->chars_len * sizeof(*chars));
+	for (i = 0; i < dev->spans_len; i++)
+		spans[i].text = chars + dev->span_start[i];
+	line->spans = spans;
+}
+
+static void
+insert_line(fz_context *ctx, fz_text_device *dev, fz_text_line *line)
+{
+	fz_text_page *page = dev->page;
+	fz_text_block *block;
+	int block_n;
+	float y1;
+
+	block_n = lookup_block_for_line(ctx, dev, line);
+	if (block_n >= 0)
 	{
-		fz_text_block *block = page->blocks + i;
-		float w = block->bbox.x1 - block->bbox.x0;
-		float dx = line->bbox.x0 - block->bbox.x0;
-		float dy = line->bbox.y0 - block->bbox.y1;
-		if (dy > -size * 1.5f && dy < size * PARAGRAPH_DIST)
-			if (line->bbox.x0 <= block->bbox.x1 && line->bbox.x1 >= block->bbox.x0)
-				if (fz_abs(dx) < w / 2)
-					return block;
+		copy_line(ctx, dev, line);
+		block = &page->blocks[block_n];
+		y1 = block->bbox.y1;
+		append_line(ctx, block, line);
+		if (block->bbox.y1 != y1)
+		{
+			remove_block_order(dev, block_n, y1);
+			insert_block_order(ctx, dev, block_n);
+		}
+		return;
 	}
 
+	/* When streaming, a line that starts a new block completes the old one */
+	if (dev->out && page->len > 0)
+	{
+		fz_print_text_block(dev->out, &page->blocks[0], dev->format);
+		fz_empty_text_page(ctx, page);
+		dev->order_len = 0;
+	}
+
+	copy_line(ctx, dev, line);
+
 	if (page->len == page->cap)
 	{
 		int new_cap = fz_maxi(16, page->cap * 2);
@@ -209,20 +375,39 @@ lookup_block_for_line(fz_context *ctx, fz_text_page *page, fz_text_line *line)
 		page->cap = new_cap;
 	}
 
-	page->blocks[page->len].bbox = fz_empty_rect;
-	page->blocks[page->len].len = 0;
-	page->blocks[page->len].cap = 0;
-	page->blocks[page->len].lines = NULL;
+	block_n = page->len++;
+	block = &page->blocks[block_n];
+	block->bbox = fz_empty_rect;
+	block->len = 0;
+	block->cap = 0;
+	block->lines = NULL;
 
-	return &page->blocks[page->len++];
+	append_line(ctx, block, line);
+	insert_block_order(ctx, dev, block_n);
 }
 
 static void
-insert_line(fz_context *ctx, fz_text_page *page, fz_text_line *line)
+fz_flush_text_line(fz_context *ctx, fz_text_device *dev)
 {
-	if (line->len == 0)
+	fz_text_line line;
+	int i;
+
+	if (dev->spans_len == 0)
 		return;
-	append_line(ctx, lookup_block_for_line(ctx, page, line), line);
+
+	line.bbox = fz_empty_rect;
+	line.len = line.cap = dev->spans_len;
+	line.spans = dev->spans;
+	for (i = 0; i < dev->spans_len; i++)
+	{
+		dev->spans[i].cap = dev->spans[i].len;
+		line.bbox = fz_union_rect(line.bbox, dev->spans[i].bbox);
+	}
+
+	insert_line(ctx, dev, &line);
+
+	dev->spans_len = 0;
+	dev->chars_len = 0;
 }
 
 static fz_rect
@@ -235,28 +420,6 @@ fz_split_bbox(fz_rect bbox, int i, int n)
 	return bbox;
 }
 
-static void
-fz_flush_text_line(fz_context *ctx, fz_text_device *dev, fz_text_style *style)
-{
-	append_span(ctx, &dev->cur_line, &dev->cur_span);
-	insert_line(ctx, dev->page, &dev->cur_line);
-	init_span(ctx, &dev->cur_span, style);
-	init_line(ctx, &dev->cur_line);
-}
-
-static void
-fz_add_text_char_imp(fz_context *ctx, fz_text_device *dev, fz_text_style *style, int c, fz_rect bbox)
-{
-	if (!dev->cur_span.style)
-		dev->cur_span.style = style;
-	if (style != dev->cur_span.style)
-	{
-		append_span(ctx, &dev->cur_line, &dev->cur_span);
-		init_span(ctx, &dev->cur_span, style);
-	}
-	append_char(ctx, &dev->cur_span, c, bbox);
-}
-
 static void
 fz_add_text_char(fz_context *ctx, fz_text_device *dev, fz_text_style *style, int c, fz_rect bbox)
 {
@@ -265,34 +428,34 @@ fz_add_text_char(fz_context *ctx, fz_text_device *dev, fz_text_style *style, int
 	case -1: /* ignore when one unicode character maps to multiple glyphs */
 		break;
 	case 0xFB00: /* ff */
-		fz_add_text_char_imp(ctx, dev, style, 'f', fz_split_bbox(bbox, 0, 2));
-		fz_add_text_char_imp(ctx, dev, style, 'f', fz_split_bbox(bbox, 1, 2));
+		append_char(ctx, dev, style, 'f', fz_split_bbox(bbox, 0, 2));
+		append_char(ctx, dev, style, 'f', fz_split_bbox(bbox, 1, 2));
 		break;
 	case 0xFB01: /* fi */
-		fz_add_text_char_imp(ctx, dev, style, 'f', fz_split_bbox(bbox, 0, 2));
-		fz_add_text_char_imp(ctx, dev, style, 'i', fz_split_bbox(bbox, 1, 2));
+		append_char(ctx, dev, style, 'f', fz_split_bbox(bbox, 0, 2));
+		append_char(ctx, dev, style, 'i', fz_split_bbox(bbox, 1, 2));
 		break;
 	case 0xFB02: /* fl */
-		fz_add_text_char_imp(ctx, dev, style, 'f', fz_split_bbox(bbox, 0, 2));
-		fz_add_text_char_imp(ctx, dev, style, 'l', fz_split_bbox(bbox, 1, 2));
+		append_char(ctx, dev, style, 'f', fz_split_bbox(bbox, 0, 2));
+		append_char(ctx, dev, style, 'l', fz_split_bbox(bbox, 1, 2));
 		break;
 	case 0xFB03: /* ffi */
-		fz_add_text_char_imp(ctx, dev, style, 'f', fz_split_bbox(bbox, 0, 3));
-		fz_add_text_char_imp(ctx, dev, style, 'f', fz_split_bbox(bbox, 1, 3));
-		fz_add_text_char_imp(ctx, dev, style, 'i', fz_split_bbox(bbox, 2, 3));
+		append_char(ctx, dev, style, 'f', fz_split_bbox(bbox, 0, 3));
+		append_char(ctx, dev, style, 'f', fz_split_bbox(bbox, 1, 3));
+		append_char(ctx, dev, style, 'i', fz_split_bbox(bbox, 2, 3));
 		break;
 	case 0xFB04: /* ffl */
-		fz_add_text_char_imp(ctx, dev, style, 'f', fz_split_bbox(bbox, 0, 3));
-		fz_add_text_char_imp(ctx, dev, style, 'f', fz_split_bbox(bbox, 1, 3));
-		fz_add_text_char_imp(ctx, dev, style, 'l', fz_split_bbox(bbox, 2, 3));
+		append_char(ctx, dev, style, 'f', fz_split_bbox(bbox, 0, 3));
+		append_char(ctx, dev, style, 'f', fz_split_bbox(bbox, 1, 3));
+		append_char(ctx, dev, style, 'l', fz_split_bbox(bbox, 2, 3));
 		break;
 	case 0xFB05: /* long st */
 	case 0xFB06: /* st */
-		fz_add_text_char_imp(ctx, dev, style, 's', fz_split_bbox(bbox, 0, 2));
-		fz_add_text_char_imp(ctx, dev, style, 't', fz_split_bbox(bbox, 1, 2));
+		append_char(ctx, dev, style, 's', fz_split_bbox(bbox, 0, 2));
+		append_char(ctx, dev, style, 't', fz_split_bbox(bbox, 1, 2));
 		break;
 	default:
-		fz_add_text_char_imp(ctx, dev, style, c, bbox);
+		append_char(ctx, dev, style, c, bbox);
 		break;
 	}
 }
@@ -382,7 +545,7 @@ fz_text_extract(fz_context *ctx, fz_text_device *dev, fz_text *text, fz_matrix c
 
 			if (dist > size * LINE_DIST)
 			{
-				fz_flush_text_line(ctx, dev, style);
+				fz_flush_text_line(ctx, dev);
 				dev->lastchar = ' ';
 			}
 			else if (fabsf(dot) > 0.95f && dist > size * SPACE_DIST && dev->lastchar != ' ')
@@ -510,31 +673,49 @@ fz_text_free_user(fz_device *dev)
 	fz_context *ctx = dev->ctx;
 	fz_text_device *tdev = dev->user;
 
-	append_span(ctx, &tdev->cur_line, &tdev->cur_span);
-	insert_line(ctx, tdev->page, &tdev->cur_line);
+	fz_try(ctx)
+	{
+		fz_flush_text_line(ctx, tdev);
 
-	/* TODO: smart sorting of blocks in reading order */
-	/* TODO: unicode NFC normalization */
-	/* TODO: bidi logical reordering */
+		/* TODO: smart sorting of blocks in reading order */
+		/* TODO: unicode NFC normalization */
+		/* TODO: bidi logical reordering */
 
-	fz_free(dev->ctx, tdev);
+		if (tdev->out)
+		{
+			if (tdev->page->len > 0)
+				fz_print_text_block(tdev->out, &tdev->page->blocks[0], tdev->format);
+			if (tdev->format == FZ_TEXT_FORMAT_XML)
+				fprintf(tdev->out, "</page>\n");
+			else if (tdev->format == FZ_TEXT_FORMAT_HTML)
+				fprintf(tdev->out, "</div>\n");
+		}
+	}
+	fz_always(ctx)
+	{
+		if (tdev->out)
+			fz_free_text_page(ctx, tdev->page);
+		fz_free(ctx, tdev->chars);
+		fz_free(ctx, tdev->spans);
+		fz_free(ctx, tdev->span_start);
+		fz_free(ctx, tdev->order);
+		fz_free(ctx, tdev);
+	}
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "cannot finish text extraction");
+	}
 }
 
-fz_device *
-fz_new_text_device(fz_context *ctx, fz_text_sheet *sheet, fz_text_page *page)
+static fz_device *
+fz_new_text_device_imp(fz_context *ctx, fz_text_device *tdev)
 {
 	fz_device *dev;
 
-	fz_text_device *tdev = fz_malloc_struct(ctx, fz_text_device);
-	tdev->sheet = sheet;
-	tdev->page = page;
 	tdev->point.x = -1;
 	tdev->point.y = -1;
 	tdev->lastchar = ' ';
 
-	init_line(ctx, &tdev->cur_line);
-	init_span(ctx, &tdev->cur_span, NULL);
-
 	dev = fz_new_device(ctx, tdev);
 	dev->hints = FZ_IGNORE_IMAGE | FZ_IGNORE_SHADE;
 	dev->free_user = fz_text_free_user;
@@ -546,6 +727,63 @@ fz_new_text_device(fz_context *ctx, fz_text_sheet *sheet, fz_text_page *page)
 	return dev;
 }
 
+fz_device *
+fz_new_text_device(fz_context *ctx, fz_text_sheet *sheet, fz_text_page *page)
+{
+	fz_text_device *tdev = fz_malloc_struct(ctx, fz_text_device);
+	fz_device *dev = NULL;
+	int i;
+
+	fz_var(dev);
+
+	fz_try(ctx)
+	{
+		tdev->sheet = sheet;
+		tdev->page = page;
+		for (i = 0; i < page->len; i++)
+			insert_block_order(ctx, tdev, i);
+		dev = fz_new_text_device_imp(ctx, tdev);
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, tdev->order);
+		fz_free(ctx, tdev);
+		fz_rethrow(ctx);
+	}
+	return dev;
+}
+
+fz_device *
+fz_new_text_stream_device(fz_context *ctx, fz_text_sheet *sheet, FILE *out, int format)
+{
+	fz_text_device *tdev = fz_malloc_struct(ctx, fz_text_device);
+	fz_device *dev = NULL;
+
+	fz_var(dev);
+
+	fz_try(ctx)
+	{
+		tdev->sheet = sheet;
+		tdev->page = fz_new_text_page(ctx, fz_empty_rect);
+		tdev->out = out;
+		tdev->format = format;
+		dev = fz_new_text_device_imp(ctx, tdev);
+	}
+	fz_catch(ctx)
+	{
+		fz_free_text_page(ctx, tdev->page);
+		fz_free(ctx, tdev);
+		fz_rethrow(ctx);
+	}
+
+	if (format == FZ_TEXT_FORMAT_XML)
+		fprintf(out, "<page>\n");
+	else if (format == FZ_TEXT_FORMAT_HTML)
+		fprintf(out, "<div class=\"page\">\n");
+
+	return dev;
+}
+
 /* XML, HTML and plain-text output */
 
 static int font_is_bold(fz_font *font)
@@ -612,143 +850,166 @@ fz_print_text_sheet(fz_context *ctx, FILE *out, fz_text_sheet *sheet)
 		fz_print_style(out, style);
 }
 
-void
-fz_print_text_page_html(fz_context *ctx, FILE *out, fz_text_page *page)
+static void
+fz_print_text_block_html(FILE *out, fz_text_block *block)
 {
-	int block_n, line_n, span_n, ch_n;
-	fz_text_style *style = NULL;
-	fz_text_block *block;
+	int line_n, span_n, ch_n;
+	fz_text_style *style;
 	fz_text_line *line;
 	fz_text_span *span;
 
-	fprintf(out, "<div class=\"page\">\n");
-
-	for (block_n = 0; block_n < page->len; block_n++)
+	fprintf(out, "<div class=\"block\">\n");
+	for (line_n = 0; line_n < block->len; line_n++)
 	{
-		block = &page->blocks[block_n];
-		fprintf(out, "<div class=\"block\">\n");
-		for (line_n = 0; line_n < block->len; line_n++)
-		{
-			line = &block->lines[line_n];
-			fprintf(out, "<p>");
-			style = NULL;
+		line = &block->lines[line_n];
+		fprintf(out, "<p>");
+		style = NULL;
 
-			for (span_n = 0; span_n < line->len; span_n++)
+		for (span_n = 0; span_n < line->len; span_n++)
+		{
+			span = &line->spans[span_n];
+			if (style != span->style)
 			{
-				span = &line->spans[span_n];
-				if (style != span->style)
-				{
-					if (style)
-						fz_print_style_end(out, style);
-					fz_print_style_begin(out, span->style);
-					style = span->style;
-				}
+				if (style)
+					fz_print_style_end(out, style);
+				fz_print_style_begin(out, span->style);
+				style = span->style;
+			}
 
-				for (ch_n = 0; ch_n < span->len; ch_n++)
-				{
-					fz_text_char *ch = &span->text[ch_n];
-					if (ch->c == '<')
-						fprintf(out, "&lt;");
-					else if (ch->c == '>')
-						fprintf(out, "&gt;");
-					else if (ch->c == '&')
-						fprintf(out, "&amp;");
-					else if (ch->c >= 32 && ch->c <= 127)
-						fprintf(out, "%c", ch->c);
-					else
-						fprintf(out, "&#x%x;", ch->c);
-				}
+			for (ch_n = 0; ch_n < span->len; ch_n++)
+			{
+				fz_text_char *ch = &span->text[ch_n];
+				if (ch->c == '<')
+					fprintf(out, "&lt;");
+				else if (ch->c == '>')
+					fprintf(out, "&gt;");
+				else if (ch->c == '&')
+					fprintf(out, "&amp;");
+				else if (ch->c >= 32 && ch->c <= 127)
+					fprintf(out, "%c", ch->c);
+				else
+					fprintf(out, "&#x%x;", ch->c);
 			}
-			if (style)
-				fz_print_style_end(out, style);
-			fprintf(out, "</p>\n");
 		}
-		fprintf(out, "</div>\n");
+		if (style)
+			fz_print_style_end(out, style);
+		fprintf(out, "</p>\n");
 	}
-
 	fprintf(out, "</div>\n");
 }
 
 void
-fz_print_text_page_xml(fz_context *ctx, FILE *out, fz_text_page *page)
+fz_print_text_page_html(fz_context *ctx, FILE *out, fz_text_page *page)
+{
+	int block_n;
+
+	fprintf(out, "<div class=\"page\">\n");
+	for (block_n = 0; block_n < page->len; block_n++)
+		fz_print_text_block_html(out, &page->blocks[block_n]);
+	fprintf(out, "</div>\n");
+}
+
+static void
+fz_print_text_block_xml(FILE *out, fz_text_block *block)
 {
-	fz_text_block *block;
 	fz_text_line *line;
 	fz_text_span *span;
 	fz_text_char *ch;
 	char *s;
 
-	fprintf(out, "<page>\n");
-	for (block = page->blocks; block < page->blocks + page->len; block++)
+	fprintf(out, "<block bbox=\"%g %g %g %g\">\n",
+		block->bbox.x0, block->bbox.y0, block->bbox.x1, block->bbox.y1);
+	for (line = block->lines; line < block->lines + block->len; line++)
 	{
-		fprintf(out, "<block bbox=\"%g %g %g %g\">\n",
-			block->bbox.x0, block->bbox.y0, block->bbox.x1, block->bbox.y1);
-		for (line = block->lines; line < block->lines + block->len; line++)
+		fprintf(out, "<line bbox=\"%g %g %g %g\">\n",
+			line->bbox.x0, line->bbox.y0, line->bbox.x1, line->bbox.y1);
+		for (span = line->spans; span < line->spans + line->len; span++)
 		{
-			fprintf(out, "<line bbox=\"%g %g %g %g\">\n",
-				line->bbox.x0, line->bbox.y0, line->bbox.x1, line->bbox.y1);
-			for (span = line->spans; span < line->spans + line->len; span++)
+			fz_text_style *style = span->style;
+			s = strchr(style->font->name, '+');
+			s = s ? s + 1 : style->font->name;
+			fprintf(out, "<span bbox=\"%g %g %g %g\" font=\"%s\" size=\"%g\">\n",
+				span->bbox.x0, span->bbox.y0, span->bbox.x1, span->bbox.y1,
+				s, style->size);
+			for (ch = span->text; ch < span->text + span->len; ch++)
 			{
-				fz_text_style *style = span->style;
-				s = strchr(style->font->name, '+');
-				s = s ? s + 1 : style->font->name;
-				fprintf(out, "<span bbox=\"%g %g %g %g\" font=\"%s\" size=\"%g\">\n",
-					span->bbox.x0, span->bbox.y0, span->bbox.x1, span->bbox.y1,
-					s, style->size);
-				for (ch = span->text; ch < span->text + span->len; ch++)
+				fprintf(out, "<char bbox=\"%g %g %g %g\" c=\"",
+					ch->bbox.x0, ch->bbox.y0, ch->bbox.x1, ch->bbox.y1);
+				switch (ch->c)
 				{
-					fprintf(out, "<char bbox=\"%g %g %g %g\" c=\"",
-						ch->bbox.x0, ch->bbox.y0, ch->bbox.x1, ch->bbox.y1);
-					switch (ch->c)
-					{
-					case '<': fprintf(out, "&lt;"); break;
-					case '>': fprintf(out, "&gt;"); break;
-					case '&': fprintf(out, "&amp;"); break;
-					case '"': fprintf(out, "&quot;"); break;
-					case '\'': fprintf(out, "&apos;"); break;
-					default:
-						if (ch->c >= 32 && ch->c <= 127)
-							fprintf(out, "%c", ch->c);
-						else
-							fprintf(out, "&#x%x;", ch->c);
-						break;
-					}
-					fprintf(out, "\"/>\n");
-			}
-				fprintf(out, "</span>\n");
+				case '<': fprintf(out, "&lt;"); break;
+				case '>': fprintf(out, "&gt;"); break;
+				case '&': fprintf(out, "&amp;"); break;
+				case '"': fprintf(out, "&quot;"); break;
+				case '\'': fprintf(out, "&apos;"); break;
+				default:
+					if (ch->c >= 32 && ch->c <= 127)
+						fprintf(out, "%c", ch->c);
+					else
+						fprintf(out, "&#x%x;", ch->c);
+					break;
+				}
+				fprintf(out, "\"/>\n");
 			}
-			fprintf(out, "</line>\n");
+			fprintf(out, "</span>\n");
 		}
-		fprintf(out, "</block>\n");
+		fprintf(out, "</line>\n");
 	}
-	fprintf(out, "</page>\n");
+	fprintf(out, "</block>\n");
 }
 
 void
-fz_print_text_page(fz_context *ctx, FILE *out, fz_text_page *page)
+fz_print_text_page_xml(fz_context *ctx, FILE *out, fz_text_page *page)
 {
 	fz_text_block *block;
+
+	fprintf(out, "<page>\n");
+	for (block = page->blocks; block < page->blocks + page->len; block++)
+		fz_print_text_block_xml(out, block);
+	fprintf(out, "</page>\n");
+}
+
+static void
+fz_print_text_block_utf8(FILE *out, fz_text_block *block)
+{
 	fz_text_line *line;
 	fz_text_span *span;
 	fz_text_char *ch;
 	char utf[10];
 	int i, n;
 
-	for (block = page->blocks; block < page->blocks + page->len; block++)
+	for (line = block->lines; line < block->lines + block->len; line++)
 	{
-		for (line = block->lines; line < block->lines + block->len; line++)
+		for (span = line->spans; span < line->spans + line->len; span++)
 		{
-			for (span = line->spans; span < line->spans + line->len; span++)
+			for (ch = span->text; ch < span->text + span->len; ch++)
 			{
-				for (ch = span->text; ch < span->text + span->len; ch++)
-				{
-					n = fz_runetochar(utf, ch->c);
-					for (i = 0; i < n; i++)
-						putc(utf[i], out);
-				}
+				n = fz_runetochar(utf, ch->c);
+				for (i = 0; i < n; i++)
+					putc(utf[i], out);
 			}
-			fprintf(out, "\n");
 		}
 		fprintf(out, "\n");
 	}
+	fprintf(out, "\n");
+}
+
+void
+fz_print_text_page(fz_context *ctx, FILE *out, fz_text_page *page)
+{
+	fz_text_block *block;
+
+	for (block = page->blocks; block < page->blocks + page->len; block++)
+		fz_print_text_block_utf8(out, block);
+}
+
+static void
+fz_print_text_block(FILE *out, fz_text_block *block, int format)
+{
+	switch (format)
+	{
+	case FZ_TEXT_FORMAT_XML: fz_print_text_block_xml(out, block); break;
+	case FZ_TEXT_FORMAT_HTML: fz_print_text_block_html(out, block); break;
+	default: fz_print_text_block_utf8(out, block); break;
+	}
 }
@@ -0,0 +1,655 @@
+#include "fitz-internal.h"
+
+/*
+Inverted index of the words on the pages of a document.
+
+Each distinct (case folded) word maps to a list of postings: the page it
+occurs on, its position among the words of that page, and its bbox.
+Positions make phrase searches possible, and the bbox is what gets
+highlighted. Pages may be added one at a time and in any order.
+*/
+
+#define INDEX_MAGIC "MuTxtIdx"
+#define INDEX_VERSION 1
+
+/* Coordinates are stored in 1/8 point units in the index file */
+#define INDEX_SCALE 8
+
+typedef struct fz_text_posting_s fz_text_posting;
+typedef struct fz_text_word_s fz_text_word;
+
+struct fz_text_posting_s
+{
+	int page;
+	int pos;
+	fz_rect bbox;
+};
+
+struct fz_text_word_s
+{
+	char *word;
+	int len, cap;
+	int sorted;
+	fz_text_posting *postings;
+};
+
+struct fz_text_index_s
+{
+	unsigned char digest[16];
+	int page_count;
+	unsigned char *indexed;
+	int size, load;
+	fz_text_word *words;
+};
+
+static unsigned
+hash_word(char *s)
+{
+	unsigned val = 0;
+	while (*s)
+	{
+		val += (unsigned char)*s++;
+		val += (val << 10);
+		val ^= (val >> 6);
+	}
+	val += (val << 3);
+	val ^= (val >> 11);
+	val += (val << 15);
+	return val;
+}
+
+fz_text_index *
+fz_new_text_index(fz_context *ctx, unsigned char digest[16], int page_count)
+{
+	fz_text_index *index;
+
+	if (page_count < 0)
+		fz_throw(ctx, "invalid page count in text index");
+
+	index = fz_malloc_struct(ctx, fz_text_index);
+	fz_try(ctx)
+	{
+		memcpy(index->digest, digest, 16);
+		index->page_count = page_count;
+		index->indexed = fz_calloc(ctx, (page_count + 7) >> 3, 1);
+		index->size = 256;
+		index->words = fz_calloc(ctx, index->size, sizeof(fz_text_word));
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, index->indexed);
+		fz_free(ctx, index);
+		fz_rethrow(ctx);
+	}
+	return index;
+}
+
+void
+fz_free_text_index(fz_context *ctx, fz_text_index *index)
+{
+	int i;
+
+	if (!index)
+		return;
+	for (i = 0; i < index->size; i++)
+	{
+		fz_free(ctx, index->words[i].word);
+		fz_free(ctx, index->words[i].postings);
+	}
+	fz_free(ctx, index->words);
+	fz_free(ctx, index->indexed);
+	fz_free(ctx, index);
+}
+
+static fz_text_word *
+lookup_word(fz_text_index *index, char *word)
+{
+	unsigned pos = hash_word(word) % index->size;
+	while (index->words[pos].word)
+	{
+		if (!strcmp(index->words[pos].word, word))
+			return &index->words[pos];
+		pos = (pos + 1) % index->size;
+	}
+	return NULL;
+}
+
+static void
+resize_index(fz_context *ctx, fz_text_index *index)
+{
+	fz_text_word *old = index->words;
+	int old_size = index->size;
+	int i;
+
+	index->words = fz_calloc(ctx, old_size * 2, sizeof(fz_text_word));
+	index->size = old_size * 2;
+
+	for (i = 0; i < old_size; i++)
+	{
+		if (old[i].word)
+		{
+			unsigned pos = hash_word(old[i].word) % index->size;
+			while (index->words[pos].word)
+				pos = (pos + 1) % index->size;
+			index->words[pos] = old[i];
+		}
+	}
+
+	fz_free(ctx, old);
+}
+
+static fz_text_word *
+insert_word(fz_context *ctx, fz_text_index *index, char *word)
+{
+	fz_text_word *entry;
+	unsigned pos;
+
+	entry = lookup_word(index, word);
+	if (entry)
+		return entry;
+
+	if (index->load * 4 >= index->size * 3)
+		resize_index(ctx, index);
+
+	pos = hash_word(word) % index->size;
+	while (index->words[pos].word)
+		pos = (pos + 1) % index->size;
+
+	entry = &index->words[pos];
+	entry->word = fz_strdup(ctx, word);
+	entry->len = 0;
+	entry->cap = 0;
+	entry->sorted = 1;
+	entry->postings = NULL;
+	index->load++;
+	return entry;
+}
+
+static void
+add_posting(fz_context *ctx, fz_text_word *entry, int page, int pos, fz_rect bbox)
+{
+	fz_text_posting *p;
+
+	if (entry->len == entry->cap)
+	{
+		int new_cap = fz_maxi(4, entry->cap * 2);
+		entry->postings = fz_resize_array(ctx, entry->postings, new_cap, sizeof(*entry->postings));
+		entry->cap = new_cap;
+	}
+
+	if (entry->len > 0)
+	{
+		p = &entry->postings[entry->len - 1];
+		if (p->page > page || (p->page == page && p->pos > pos))
+			entry->sorted = 0;
+	}
+
+	p = &entry->postings[entry->len++];
+	p->page = page;
+	p->pos = pos;
+	p->bbox = bbox;
+}
+
+/*
+ * Characters are folded to lower case for ASCII and Latin-1. Anything
+ * that is not a letter or digit separates words, and CJK ideographs
+ * (which are not separated by spaces) are words on their own.
+ */
+
+static int
+fold_char(int c)
+{
+	if ((c >= 'A' && c <= 'Z') || (c >= 0xC0 && c <= 0xDE && c != 0xD7))
+		return c + 32;
+	return c;
+}
+
+static int
+is_word_char(int c)
+{
+	if (c < 128)
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+	if ((c >= 0xA0 && c <= 0xBF) || c == 0xD7 || c == 0xF7)
+		return 0; /* Latin-1 punctuation and symbols */
+	if ((c >= 0x2000 && c <= 0x206F) || (c >= 0x3000 && c <= 0x303F) || c == 0xFEFF)
+		return 0;
+	return 1;
+}
+
+static int
+is_cjk_char(int c)
+{
+	return (c >= 0x2E80 && c <= 0x9FFF) || (c >= 0xAC00 && c <= 0xD7AF) || (c >= 0xF900 && c <= 0xFAFF);
+}
+
+#define MAX_WORD_LEN 64 /* longer words are truncated */
+
+typedef struct word_builder_s word_builder;
+
+struct word_builder_s
+{
+	char text[MAX_WORD_LEN + 8];
+	int len;
+	fz_rect bbox;
+};
+
+static void
+add_word_char(word_builder *w, int c, fz_rect bbox)
+{
+	if (w->len == 0)
+		w->bbox = bbox;
+	else
+		w->bbox = fz_union_rect(w->bbox, bbox);
+	if (w->len < MAX_WORD_LEN)
+		w->len += fz_runetochar(w->text + w->len, fold_char(c));
+}
+
+static void
+end_word(fz_context *ctx, fz_text_index *index, word_builder *w, int page, int *pos)
+{
+	if (w->len == 0)
+		return;
+	w->text[w->len] = 0;
+	add_posting(ctx, insert_word(ctx, index, w->text), page, (*pos)++, w->bbox);
+	w->len = 0;
+}
+
+int
+fz_text_index_has_page(fz_text_index *index, int page)
+{
+	if (page < 0 || page >= index->page_count)
+		return 0;
+	return (index->indexed[page >> 3] >> (page & 7)) & 1;
+}
+
+void
+fz_text_index_add_page(fz_context *ctx, fz_text_index *index, int page, fz_text_page *text)
+{
+	fz_text_block *block;
+	fz_text_line *line;
+	fz_text_span *span;
+	fz_text_char *ch;
+	word_builder w;
+	int pos = 0;
+
+	if (page < 0 || page >= index->page_count)
+		fz_throw(ctx, "page %d out of range in text index", page);
+	if (fz_text_index_has_page(index, page))
+		return;
+
+	w.len = 0;
+	for (block = text->blocks; block < text->blocks + text->len; block++)
+	{
+		for (line = block->lines; line < block->lines + block->len; line++)
+		{
+			for (span = line->spans; span < line->spans + line->len; span++)
+			{
+				for (ch = span->text; ch < span->text + span->len; ch++)
+				{
+					if (is_cjk_char(ch->c))
+					{
+						end_word(ctx, index, &w, page, &pos);
+						add_word_char(&w, ch->c, ch->bbox);
+						end_word(ctx, index, &w, page, &pos);
+					}
+					else if (is_word_char(ch->c))
+						add_word_char(&w, ch->c, ch->bbox);
+					else
+						end_word(ctx, index, &w, page, &pos);
+				}
+			}
+			end_word(ctx, index, &w, page, &pos);
+		}
+	}
+
+	index->indexed[page >> 3] |= 1 << (page & 7);
+}
+
+/* Searching */
+
+static int
+cmp_posting(const void *a_, const void *b_)
+{
+	const fz_text_posting *a = a_;
+	const fz_text_posting *b = b_;
+	if (a->page != b->page)
+		return a->page - b->page;
+	return a->pos - b->pos;
+}
+
+static fz_text_posting *
+find_posting(fz_text_word *entry, int page, int pos)
+{
+	int l = 0;
+	int r = entry->len - 1;
+	while (l <= r)
+	{
+		int m = (l + r) >> 1;
+		fz_text_posting *p = &entry->postings[m];
+		int c = p->page != page ? p->page - page : p->pos - pos;
+		if (c < 0)
+			l = m + 1;
+		else if (c > 0)
+			r = m - 1;
+		else
+			return p;
+	}
+	return NULL;
+}
+
+/* Index of the first posting on page or later */
+static int
+first_posting(fz_text_word *entry, int page)
+{
+	int l = 0;
+	int r = entry->len;
+	while (l < r)
+	{
+		int m = (l + r) >> 1;
+		if (entry->postings[m].page < page)
+			l = m + 1;
+		else
+			r = m;
+	}
+	return l;
+}
+
+#define MAX_SEARCH_WORDS 32
+
+static int
+end_search_word(fz_text_index *index, word_builder *w, fz_text_word **words, int *n)
+{
+	if (w->len == 0 || *n == MAX_SEARCH_WORDS)
+		return 1;
+	w->text[w->len] = 0;
+	w->len = 0;
+	words[*n] = lookup_word(index, w->text);
+	return words[(*n)++] != NULL;
+}
+
+int
+fz_search_text_index(fz_context *ctx, fz_text_index *index, char *needle, int start_page, fz_text_hit *hits, int max_hits)
+{
+	fz_text_word *words[MAX_SEARCH_WORDS];
+	word_builder w;
+	int n = 0;
+	int count = 0;
+	int i, k, c;
+
+	/* Split the needle into words the same way as the pages; a word
+	 * that is not in the index means there can be no hits at all. */
+	w.len = 0;
+	while (*needle)
+	{
+		needle += fz_chartorune(&c, needle);
+		if (is_cjk_char(c))
+		{
+			if (!end_search_word(index, &w, words, &n))
+				return 0;
+			add_word_char(&w, c, fz_empty_rect);
+			if (!end_search_word(index, &w, words, &n))
+				return 0;
+		}
+		else if (is_word_char(c))
+			add_word_char(&w, c, fz_empty_rect);
+		else if (!end_search_word(index, &w, words, &n))
+			return 0;
+	}
+	if (!end_search_word(index, &w, words, &n))
+		return 0;
+	if (n == 0)
+		return 0;
+
+	for (i = 0; i < n; i++)
+	{
+		if (!words[i]->sorted)
+		{
+			qsort(words[i]->postings, words[i]->len, sizeof(fz_text_posting), cmp_posting);
+			words[i]->sorted = 1;
+		}
+	}
+
+	/* A hit is a run of postings, one per word, on consecutive positions */
+	for (i = first_posting(words[0], start_page); i < words[0]->len && count < max_hits; i++)
+	{
+		fz_text_posting *first = &words[0]->postings[i];
+
+		for (k = 1; k < n; k++)
+			if (!find_posting(words[k], first->page, first->pos + k))
+				break;
+		if (k < n)
+			continue;
+
+		for (k = 0; k < n && count < max_hits; k++)
+		{
+			fz_text_posting *p = k ? find_posting(words[k], first->page, first->pos + k) : first;
+			hits[count].page = p->page;
+			hits[count].bbox = p->bbox;
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/* Reading and writing */
+
+static void
+write_uint(FILE *fp, unsigned int v)
+{
+	while (v >= 0x80)
+	{
+		putc((v & 0x7F) | 0x80, fp);
+		v >>= 7;
+	}
+	putc(v, fp);
+}
+
+static void
+write_int(FILE *fp, int v)
+{
+	write_uint(fp, ((unsigned int)v << 1) ^ (unsigned int)(v >> 31));
+}
+
+static void
+write_coord(FILE *fp, float v)
+{
+	write_int(fp, (int)floorf(v * INDEX_SCALE + 0.5f));
+}
+
+static unsigned int
+read_uint(fz_context *ctx, fz_stream *stm)
+{
+	unsigned int v = 0;
+	int shift = 0;
+	int c;
+	do
+	{
+		c = fz_read_byte(stm);
+		if (c == EOF || shift > 28)
+			fz_throw(ctx, "premature end of text index");
+		v |= (c & 0x7F) << shift;
+		shift += 7;
+	}
+	while (c & 0x80);
+	return v;
+}
+
+static int
+read_int(fz_context *ctx, fz_stream *stm)
+{
+	unsigned int v = read_uint(ctx, stm);
+	return (int)(v >> 1) ^ -(int)(v & 1);
+}
+
+static float
+read_coord(fz_context *ctx, fz_stream *stm)
+{
+	return (float)read_int(ctx, stm) / INDEX_SCALE;
+}
+
+void
+fz_save_text_index(fz_context *ctx, fz_text_index *index, char *filename)
+{
+	FILE *fp;
+	int i, k;
+
+	fp = fopen(filename, "wb");
+	if (!fp)
+		fz_throw(ctx, "cannot open file '%s': %s", filename, strerror(errno));
+
+	fwrite(INDEX_MAGIC, 1, 8, fp);
+	write_uint(fp, INDEX_VERSION);
+	fwrite(index->digest, 1, 16, fp);
+	write_uint(fp, index->page_count);
+	fwrite(index->indexed, 1, (index->page_count + 7) >> 3, fp);
+	write_uint(fp, index->load);
+
+	for (i = 0; i < index->size; i++)
+	{
+		fz_text_word *entry = &index->words[i];
+		int page = 0, pos = 0;
+
+		if (!entry->word)
+			continue;
+
+		if (!entry->sorted)
+		{
+			qsort(entry->postings, entry->len, sizeof(fz_text_posting), cmp_posting);
+			entry->sorted = 1;
+		}
+
+		k = strlen(entry->word);
+		write_uint(fp, k);
+		fwrite(entry->word, 1, k, fp);
+		write_uint(fp, entry->len);
+
+		/* Postings are delta coded against the previous one */
+		for (k = 0; k < entry->len; k++)
+		{
+			fz_text_posting *p = &entry->postings[k];
+			write_uint(fp, p->page - page);
+			write_uint(fp, p->page == page ? p->pos - pos : p->pos);
+			write_coord(fp, p->bbox.x0);
+			write_coord(fp, p->bbox.y0);
+			write_coord(fp, p->bbox.x1 - p->bbox.x0);
+			write_coord(fp, p->bbox.y1 - p->bbox.y0);
+			page = p->page;
+			pos = p->pos;
+		}
+	}
+
+	if (fclose(fp) != 0)
+		fz_throw(ctx, "cannot write file '%s': %s", filename, strerror(errno));
+}
+
+fz_text_index *
+fz_load_text_index(fz_context *ctx, char *filename, unsigned char digest[16])
+{
+	fz_text_index *index = NULL;
+	fz_stream *stm;
+	unsigned char head[16];
+	char word[MAX_WORD_LEN + 8];
+	int i, k, n, len, page_count;
+
+	stm = fz_open_file(ctx, filename);
+
+	fz_var(index);
+
+	fz_try(ctx)
+	{
+		if (fz_read(stm, head, 8) != 8 || memcmp(head, INDEX_MAGIC, 8))
+			fz_throw(ctx, "not a text index: '%s'", filename);
+		if (read_uint(ctx, stm) != INDEX_VERSION)
+			fz_throw(ctx, "unsupported text index version: '%s'", filename);
+		if (fz_read(stm, head, 16) != 16)
+			fz_throw(ctx, "premature end of text index");
+		if (memcmp(head, digest, 16))
+			fz_throw(ctx, "text index '%s' does not match document", filename);
+
+		page_count = read_uint(ctx, stm);
+		index = fz_new_text_index(ctx, digest, page_count);
+		len = (page_count + 7) >> 3;
+		if (fz_read(stm, index->indexed, len) != len)
+			fz_throw(ctx, "premature end of text index");
+
+		n = read_uint(ctx, stm);
+		for (i = 0; i < n; i++)
+		{
+			fz_text_word *entry;
+			int page = 0, pos = 0;
+
+			len = read_uint(ctx, stm);
+			if (len <= 0 || len > MAX_WORD_LEN + 4 || fz_read(stm, (unsigned char *)word, len) != len)
+				fz_throw(ctx, "corrupt text index");
+			word[len] = 0;
+
+			/* Each word is written once, so one that is already
+			 * in the index (and owns postings) means corruption */
+			entry = insert_word(ctx, index, word);
+			if (entry->postings)
+				fz_throw(ctx, "corrupt text index");
+			k = read_uint(ctx, stm);
+			if (k < 0)
+				fz_throw(ctx, "corrupt text index");
+			entry->postings = fz_malloc_array(ctx, k, sizeof(fz_text_posting));
+			entry->cap = k;
+
+			for (; k > 0; k--)
+			{
+				fz_text_posting *p = &entry->postings[entry->len++];
+				unsigned int dpage = read_uint(ctx, stm);
+				if (dpage >= (unsigned int)(page_count - page))
+					fz_throw(ctx, "corrupt text index");
+				p->page = page + dpage;
+				p->pos = read_uint(ctx, stm) + (dpage ? 0 : pos);
+				p->bbox.x0 = read_coord(ctx, stm);
+				p->bbox.y0 = read_coord(ctx, stm);
+				p->bbox.x1 = p->bbox.x0 + read_coord(ctx, stm);
+				p->bbox.y1 = p->bbox.y0 + read_coord(ctx, stm);
+				page = p->page;
+				pos = p->pos;
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_close(stm);
+	}
+	fz_catch(ctx)
+	{
+		fz_free_text_index(ctx, index);
+		fz_rethrow(ctx);
+	}
+
+	return index;
+}
+
+void
+fz_md5_file(fz_context *ctx, char *filename, unsigned char digest[16])
+{
+	unsigned char buf[4096];
+	fz_stream *stm;
+	fz_md5 md5;
+	int n;
+
+	stm = fz_open_file(ctx, filename);
+
+	fz_md5_init(&md5);
+	fz_try(ctx)
+	{
+		while ((n = fz_read(stm, buf, sizeof buf)) > 0)
+			fz_md5_update(&md5, buf, n);
+		if (stm->error)
+			fz_throw(ctx, "cannot read file '%s'", filename);
+	}
+	fz_always(ctx)
+	{
+		fz_close(stm);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+	fz_md5_final(&md5, digest);
+}
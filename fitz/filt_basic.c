@@ -61,9 +61,22 @@ fz_open_null(fz_stream *chain, int len, int offset)
 		fz_rethrow(ctx);
 	}
 
+	fz_will_read(chain, offset, len);
+
 	return fz_new_stream(ctx, state, read_null, close_null);
 }
 
+fz_buffer *
+fz_null_filter_view(fz_stream *stm)
+{
+	struct null_filter *state;
+
+	if (stm->read != read_null || stm->rp != stm->wp || stm->pos != 0)
+		return NULL;
+	state = stm->state;
+	return fz_new_buffer_view(state->chain, state->pos, state->remain);
+}
+
 /* Concat filter concatenates several streams into one */
 
 struct concat_filter
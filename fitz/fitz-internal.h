@@ -412,14 +412,30 @@ int fz_store_scavenge(fz_context *ctx, unsigned int size, int *phase);
 void fz_print_store(fz_context *ctx, FILE *out);
 #endif
 
+typedef struct fz_mapped_file_s fz_mapped_file;
+
 struct fz_buffer_s
 {
 	int refs;
 	unsigned char *data;
 	int cap, len;
 	int unused_bits;
+	fz_mapped_file *mapped; /* set for views; data belongs to the mapping */
 };
 
+/*
+	fz_new_buffer_view: Create a buffer that shares len bytes at
+	offset in a stream opened by fz_open_mapped_file, keeping the
+	mapping alive for as long as the buffer. The data is copied out
+	of the mapping if the buffer is resized or written to.
+
+	Returns NULL if the stream is not mapped or does not hold the
+	whole range.
+*/
+fz_buffer *fz_new_buffer_view(fz_stream *stm, int offset, int len);
+
+void fz_drop_mapped_file(fz_context *ctx, fz_mapped_file *map);
+
 /*
 	fz_new_buffer: Create a new buffer.
 
@@ -497,6 +513,9 @@ void fz_fill_buffer(fz_stream *stm);
 
 void fz_read_line(fz_stream *stm, char *buf, int max);
 
+/* Hint that len bytes at offset are about to be read in order */
+void fz_will_read(fz_stream *stm, int offset, int len);
+
 static inline int fz_read_byte(fz_stream *stm)
 {
 	if (stm->rp == stm->wp)
@@ -582,6 +601,7 @@ static inline int fz_is_eof_bits(fz_stream *stm)
 
 fz_stream *fz_open_copy(fz_stream *chain);
 fz_stream *fz_open_null(fz_stream *chain, int len, int offset);
+fz_buffer *fz_null_filter_view(fz_stream *stm); /* NULL unless over a mapped file */
 fz_stream *fz_open_concat(fz_context *ctx, int max, int pad);
 void fz_concat_push(fz_stream *concat, fz_stream *chain); /* Ownership of chain is passed in */
 fz_stream *fz_open_arc4(fz_stream *chain, unsigned char *key, unsigned keylen);
@@ -615,8 +635,6 @@ struct fz_bitmap_s
 	unsigned char *samples;
 };
 
-fz_bitmap *fz_new_bitmap(fz_context *ctx, int w, int h, int n);
-
 void fz_bitmap_details(fz_bitmap *bitmap, int *w, int *h, int *n, int *stride);
 
 void fz_clear_bitmap(fz_context *ctx, fz_bitmap *bit);
@@ -730,6 +748,15 @@ void fz_convert_color(fz_context *ctx, fz_colorspace *dsts, float *dstv, fz_colo
 
 char *ft_error_string(int err);
 
+typedef struct fz_font_key_s fz_font_key;
+
+struct fz_font_key_s
+{
+	unsigned char digest[16];
+	int index;
+	int use_glyph_bbox;
+};
+
 struct fz_font_s
 {
 	int refs;
@@ -745,12 +772,28 @@ struct fz_font_s
 	char *ft_file;
 	unsigned char *ft_data;
 	int ft_size;
+	fz_buffer *ft_buffer;
+
+	/* per-context faces, created from the same data (see fz_ft_context) */
+	unsigned char *ft_face_data;
+	int ft_face_size;
+	int ft_face_index;
+	void *ft_faces;
+
+	/* set if ft_face belongs to another font, see fz_new_font_from_font */
+	fz_font *ft_base;
+
+	/* set if registered by fz_new_shared_font_from_memory */
+	int shared;
+	fz_font_key shared_key;
+	int builtin; /* ... by fz_new_builtin_font, and kept by the font context */
 
 	fz_matrix t3matrix;
 	void *t3resources;
 	fz_buffer **t3procs; /* has 256 entries if used */
 	float *t3widths; /* has 256 entries if used */
 	char *t3flags; /* has 256 entries if used */
+	fz_display_list **t3lists; /* has 256 entries if used */
 	void *t3doc; /* a pdf_document for the callback */
 	void (*t3run)(void *doc, void *resources, fz_buffer *contents, fz_device *dev, fz_matrix ctm, void *gstate);
 	void (*t3freeres)(void *doc, void *resources);
@@ -771,9 +814,53 @@ void fz_new_font_context(fz_context *ctx);
 fz_font_context *fz_keep_font_context(fz_context *ctx);
 void fz_drop_font_context(fz_context *ctx);
 
+/* The table of interned PDF name objects, see fz_new_name */
+void fz_new_name_context(fz_context *ctx);
+fz_name_context *fz_keep_name_context(fz_context *ctx);
+void fz_drop_name_context(fz_context *ctx);
+
+void fz_new_ft_context(fz_context *ctx);
+void fz_free_ft_context(fz_context *ctx);
+
 fz_font *fz_new_type3_font(fz_context *ctx, char *name, fz_matrix matrix);
 
 fz_font *fz_new_font_from_memory(fz_context *ctx, char *name, unsigned char *data, int len, int index, int use_glyph_bbox);
+
+/*
+	fz_new_shared_font_from_memory: Create a font from data in memory,
+	or return a new reference to an existing font made from the same
+	data, name and index. Fonts are shared across all documents and
+	cloned contexts.
+
+	A shared font must not be modified after creation. The caller may
+	compare font->ft_face_data with data to see whether it got a font
+	using its copy of the data (which must then live as long as the
+	font) or an existing one (in which case its copy is not needed).
+*/
+fz_font *fz_new_shared_font_from_memory(fz_context *ctx, char *name, unsigned char *data, int len, int index, int use_glyph_bbox);
+
+/*
+	fz_new_builtin_font: Create a shared font from data compiled into
+	the program, or return a new reference to the one already made from
+	the same data and index.
+
+	The data is identified by its address, so it is not read (or paged
+	in) unless the font has to be created. The name is only used when
+	the font is created; pass NULL to use the family name from the
+	font. Built-in fonts are kept until the font context is freed, so
+	each is loaded once however many documents come and go.
+*/
+fz_font *fz_new_builtin_font(fz_context *ctx, char *name, unsigned char *data, int len, int index, int use_glyph_bbox);
+
+/*
+	fz_new_font_from_font: Create a font that draws with the FreeType
+	face of another font, but has a name, style and substitute widths
+	of its own. It holds a reference to the other font.
+
+	Use this to give each use of a shared font (which must not be
+	modified) the settings that belong to that use.
+*/
+fz_font *fz_new_font_from_font(fz_context *ctx, char *name, fz_font *base);
 fz_font *fz_new_font_from_file(fz_context *ctx, char *name, char *path, int index, int use_glyph_bbox);
 
 fz_font *fz_keep_font(fz_context *ctx, fz_font *font);
@@ -943,6 +1030,10 @@ enum
 	FZ_LINEAR,
 	FZ_RADIAL,
 	FZ_MESH,
+	FZ_MESH_TYPE4, /* free-form triangles, decoded on demand */
+	FZ_MESH_TYPE5, /* lattice-form triangles, decoded on demand */
+	FZ_MESH_TYPE6, /* coons patches, decoded on demand */
+	FZ_MESH_TYPE7, /* tensor-product patches, decoded on demand */
 };
 
 typedef struct fz_shade_s fz_shade;
@@ -961,21 +1052,58 @@ struct fz_shade_s
 	int use_function;
 	float function[256][FZ_MAX_COLORS + 1];
 
-	int type; /* linear, radial, mesh */
+	int type; /* linear, radial, mesh or one of the packed mesh types */
 	int extend[2];
 
 	int mesh_len;
 	int mesh_cap;
 	float *mesh; /* [x y 0], [x y r], [x y t] or [x y c1 ... cn] */
+
+	/* packed vertex data and decoding parameters for FZ_MESH_TYPE4..7 */
+	struct
+	{
+		int vprow;
+		int bpflag;
+		int bpcoord;
+		int bpcomp;
+		float x0, x1;
+		float y0, y1;
+		float c0[FZ_MAX_COLORS];
+		float c1[FZ_MAX_COLORS];
+	} mesh_params;
+	fz_buffer *buffer;
 };
 
 fz_shade *fz_keep_shade(fz_context *ctx, fz_shade *shade);
 void fz_drop_shade(fz_context *ctx, fz_shade *shade);
 void fz_free_shade_imp(fz_context *ctx, fz_storable *shade);
+unsigned int fz_shade_size(fz_shade *shade);
 
 fz_rect fz_bound_shade(fz_context *ctx, fz_shade *shade, fz_matrix ctm);
 void fz_paint_shade(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_pixmap *dest, fz_bbox bbox);
 
+/*
+ * Packed meshes are decoded into triangles while they are being drawn.
+ * The vertices passed to the callback are in device space (ctm applied),
+ * with either the function parameter t or the colorspace components in c.
+ * Triangles and patches that fall entirely outside the clip rectangle are
+ * skipped; pass fz_infinite_rect to see all of them.
+ */
+
+typedef struct fz_vertex_s fz_vertex;
+
+struct fz_vertex_s
+{
+	float x, y;
+	float c[FZ_MAX_COLORS];
+};
+
+typedef void (fz_mesh_process_fn)(fz_context *ctx, void *arg, fz_vertex *av, fz_vertex *bv, fz_vertex *cv);
+
+void fz_process_mesh(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_rect clip,
+	fz_mesh_process_fn *process, void *process_arg);
+fz_rect fz_bound_mesh(fz_context *ctx, fz_shade *shade);
+
 #ifndef NDEBUG
 void fz_print_shade(fz_context *ctx, FILE *out, fz_shade *shade);
 #endif
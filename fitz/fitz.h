@@ -187,10 +187,12 @@ typedef struct fz_alloc_context_s fz_alloc_context;
 typedef struct fz_error_context_s fz_error_context;
 typedef struct fz_warn_context_s fz_warn_context;
 typedef struct fz_font_context_s fz_font_context;
+typedef struct fz_ft_context_s fz_ft_context;
 typedef struct fz_aa_context_s fz_aa_context;
 typedef struct fz_locks_context_s fz_locks_context;
 typedef struct fz_store_s fz_store;
 typedef struct fz_glyph_cache_s fz_glyph_cache;
+typedef struct fz_name_context_s fz_name_context;
 typedef struct fz_context_s fz_context;
 
 struct fz_alloc_context_s
@@ -278,9 +280,11 @@ struct fz_context_s
 	fz_error_context *error;
 	fz_warn_context *warn;
 	fz_font_context *font;
+	fz_ft_context *ft;
 	fz_aa_context *aa;
 	fz_store *store;
 	fz_glyph_cache *glyph_cache;
+	fz_name_context *name;
 };
 
 /*
@@ -340,6 +344,11 @@ fz_context *fz_new_context(fz_alloc_context *alloc, fz_locks_context *locks, uns
 	store, locks and lock/unlock functions. They will each have
 	their own exception stacks though.
 
+	A cloned context also gets its own FreeType faces for the fonts
+	it renders glyphs from, created from the same font data as
+	needed, so that glyph rendering in one thread does not wait for
+	another.
+
 	Does not throw exception, but may return NULL.
 */
 fz_context *fz_clone_context(fz_context *ctx);
@@ -366,6 +375,12 @@ int fz_aa_level(fz_context *ctx);
 
 	bits: The number of bits of antialiasing to use (values are clamped
 	to within the 0 to 8 range).
+
+	Level 0 selects sharp rendering: paths are scan converted with one
+	sample per pixel and glyphs are rasterized by FreeType's monochrome
+	renderer with grid fitting. This is the mode to use when the result
+	is going to be converted to a 1 bit bitmap (see fz_halftone_pixmap),
+	as every vector fill and glyph then lands as fully on or off pixels.
 */
 void fz_set_aa_level(fz_context *ctx, int bits);
 
@@ -1095,6 +1110,28 @@ fz_stream *fz_open_file_w(fz_context *ctx, const wchar_t *filename);
 */
 fz_stream *fz_open_fd(fz_context *ctx, int file);
 
+/*
+	fz_open_mapped_file: Open the named file and map it into memory
+	as a stream.
+
+	Reads and seeks within the stream are served from the mapping
+	without further system calls. Where files cannot be mapped on
+	this platform, or are too large to address, this behaves as
+	fz_open_file.
+
+	Buffers loaded from the stream may be views of the mapping
+	rather than copies, and those are kept in the store and in
+	loaded fonts after the stream is closed. The file must
+	therefore not be truncated or rewritten until the document
+	opened on it has been closed and every such cached view has
+	been dropped, which fz_empty_store and dropping the document's
+	fonts ensure; a truncated file faults on access like any
+	other mapping.
+
+	filename: Path to a file, as for fz_open_file.
+*/
+fz_stream *fz_open_mapped_file(fz_context *ctx, const char *filename);
+
 /*
 	fz_open_memory: Open a block of memory as a stream.
 
@@ -1178,6 +1215,19 @@ fz_buffer *fz_read_all(fz_stream *stm, int initial);
 */
 typedef struct fz_bitmap_s fz_bitmap;
 
+/*
+	fz_new_bitmap: Create a new bitmap.
+
+	w, h: Width and height of the bitmap in pixels.
+
+	n: Number of components per pixel (currently only 1 is
+	supported by the halftoning code).
+
+	The contents of the bitmap are uninitialised. Throws exceptions
+	in the case of failure to allocate.
+*/
+fz_bitmap *fz_new_bitmap(fz_context *ctx, int w, int h, int n);
+
 /*
 	fz_keep_bitmap: Take a reference to a bitmap.
 
@@ -1551,6 +1601,32 @@ typedef struct fz_halftone_s fz_halftone;
 */
 fz_bitmap *fz_halftone_pixmap(fz_context *ctx, fz_pixmap *pix, fz_halftone *ht);
 
+/*
+	fz_halftone_pixmap_band: Halftone a pixmap into rows of an
+	existing bitmap.
+
+	This allows a page to be rendered to a bitmap one band at a time
+	(e.g. by running a display list into a band sized pixmap), so
+	that the greyscale version of the whole page never needs to
+	exist.
+
+	pix: The band to generate from. Currently must be a single color
+	component + alpha (where the alpha is assumed to be solid). The
+	pixmap origin is used to phase the halftone, so bands rendered
+	at their position on the page line up seamlessly.
+
+	ht: The halftone to use. NULL implies the default halftone.
+
+	bit: The bitmap to write into. Must be at least as wide as the
+	pixmap.
+
+	band_y: The first row of the bitmap to write to.
+
+	Throws exceptions in the case of failure to allocate, or if the
+	band does not fit within the bitmap.
+*/
+void fz_halftone_pixmap_band(fz_context *ctx, fz_pixmap *pix, fz_halftone *ht, fz_bitmap *bit, int band_y);
+
 /*
 	An abstract font handle. Currently there are no public API functions
 	for handling these.
@@ -1629,6 +1705,7 @@ typedef struct fz_text_block_s fz_text_block;
 
 typedef struct fz_text_sheet_s fz_text_sheet;
 typedef struct fz_text_page_s fz_text_page;
+typedef struct fz_text_chunk_s fz_text_chunk;
 
 /*
 	fz_text_sheet: A text sheet contains a list of distinct text styles
@@ -1658,12 +1735,16 @@ struct fz_text_style_s
 /*
 	fz_text_page: A text page is a list of blocks of text, together with
 	an overall bounding box.
+
+	The spans and characters of all lines are allocated from storage
+	owned by the page (chunks) and freed with it.
 */
 struct fz_text_page_s
 {
 	fz_rect mediabox;
 	int len, cap;
 	fz_text_block *blocks;
+	fz_text_chunk *chunks;
 };
 
 /*
@@ -1736,6 +1817,30 @@ struct fz_text_char_s
 */
 fz_device *fz_new_text_device(fz_context *ctx, fz_text_sheet *sheet, fz_text_page *page);
 
+enum
+{
+	FZ_TEXT_FORMAT_UTF8,
+	FZ_TEXT_FORMAT_XML,
+	FZ_TEXT_FORMAT_HTML
+};
+
+/*
+	fz_new_text_stream_device: Create a device to extract the text on a
+	page straight to a file.
+
+	Works as fz_new_text_device, but rather than collecting the whole
+	page, each block of text is written out (in the same form as
+	fz_print_text_page, fz_print_text_page_xml or
+	fz_print_text_page_html, selected by format) as soon as a line is
+	found that does not continue it. Memory use is bounded by the size
+	of the largest block rather than the size of the page, at the cost
+	of only joining lines into the block immediately preceding them.
+
+	The page wrapper is written when the device is created, and closed
+	when the device is freed.
+*/
+fz_device *fz_new_text_stream_device(fz_context *ctx, fz_text_sheet *sheet, FILE *out, int format);
+
 /*
 	fz_new_text_sheet: Create an empty style sheet.
 
@@ -1775,6 +1880,105 @@ void fz_print_text_page_xml(fz_context *ctx, FILE *out, fz_text_page *page);
 */
 void fz_print_text_page(fz_context *ctx, FILE *out, fz_text_page *page);
 
+/*
+	Text search index: An inverted index of the words in a document,
+	built from the text pages of its pages, so that searching does not
+	require the text of every page to be extracted again.
+
+	Words are split at anything that is not a letter or digit, and
+	matched without regard to (ASCII and Latin-1) case. Each CJK
+	ideograph is a word of its own.
+*/
+typedef struct fz_text_index_s fz_text_index;
+typedef struct fz_text_hit_s fz_text_hit;
+
+/*
+	fz_text_hit: The page number and bounding box of one word of a
+	search match, suitable for highlighting.
+*/
+struct fz_text_hit_s
+{
+	int page;
+	fz_rect bbox;
+};
+
+/*
+	fz_new_text_index: Create an empty text index for a document.
+
+	digest: The MD5 digest of the document file (see fz_md5_file),
+	used to tell whether a saved index belongs to the document.
+
+	page_count: The number of pages in the document. Throws an
+	exception if this is negative, as well as on memory allocation
+	failure.
+*/
+fz_text_index *fz_new_text_index(fz_context *ctx, unsigned char digest[16], int page_count);
+
+/*
+	fz_free_text_index: Free a text index.
+*/
+void fz_free_text_index(fz_context *ctx, fz_text_index *index);
+
+/*
+	fz_text_index_add_page: Add the words of a page to a text index.
+
+	Pages can be added one at a time in any order, for example as they
+	are viewed. Adding a page that is already in the index does
+	nothing.
+
+	page: The page number (starting at 0).
+
+	text: The text of the page, as gathered by a text device.
+*/
+void fz_text_index_add_page(fz_context *ctx, fz_text_index *index, int page, fz_text_page *text);
+
+/*
+	fz_text_index_has_page: Returns 1 if the given page has been added
+	to the index, 0 otherwise.
+*/
+int fz_text_index_has_page(fz_text_index *index, int page);
+
+/*
+	fz_search_text_index: Search the indexed pages for a word or
+	phrase.
+
+	needle: The UTF-8 text to search for. When it contains several
+	words, they must appear consecutively on a page to match.
+
+	start_page: Only matches on this page and the pages after it
+	are returned, so that a caller can find matches beyond the
+	first max_hits by searching again from a later page.
+
+	hits: An array to be filled in with the page and bbox of each
+	word of each match, in page order.
+
+	max_hits: The size of the hits array.
+
+	Returns the number of entries filled in.
+*/
+int fz_search_text_index(fz_context *ctx, fz_text_index *index, char *needle, int start_page, fz_text_hit *hits, int max_hits);
+
+/*
+	fz_save_text_index: Write a text index to a (sidecar) file, so
+	that it can be loaded again next time the document is opened.
+*/
+void fz_save_text_index(fz_context *ctx, fz_text_index *index, char *filename);
+
+/*
+	fz_load_text_index: Load a text index written by
+	fz_save_text_index.
+
+	digest: The MD5 digest of the document file. Throws an exception
+	if the index was made for a different file, as well as if the
+	index cannot be read.
+*/
+fz_text_index *fz_load_text_index(fz_context *ctx, char *filename, unsigned char digest[16]);
+
+/*
+	fz_md5_file: Compute the MD5 digest of the contents of a file.
+*/
+void fz_md5_file(fz_context *ctx, char *filename, unsigned char digest[16]);
+
 /*
 	Cookie support - simple communication channel between app/library.
 */
@@ -6,10 +6,16 @@
 
 #define MAX_BBOX_TABLE_SIZE 4096
 
+/* Number of contexts that can have their own faces at the same time */
+#define MAX_FT_CONTEXTS 32
+
 /* 20 degrees */
 #define SHEAR 0.36397f
 
 static void fz_drop_freetype(fz_context *ctx);
+static void fz_drop_ft_faces(fz_context *ctx, fz_font *font);
+static void fz_drop_builtin_fonts(fz_context *ctx);
+static void fz_unshare_font(fz_context *ctx, fz_font *font);
 
 static fz_font *
 fz_new_font(fz_context *ctx, char *name, int use_glyph_bbox, int glyph_count)
@@ -34,12 +40,22 @@ fz_new_font(fz_context *ctx, char *name, int use_glyph_bbox, int glyph_count)
 	font->ft_file = NULL;
 	font->ft_data = NULL;
 	font->ft_size = 0;
+	font->ft_buffer = NULL;
+
+	font->ft_face_data = NULL;
+	font->ft_face_size = 0;
+	font->ft_face_index = 0;
+	font->ft_faces = NULL;
+	font->ft_base = NULL;
+	font->shared = 0;
+	font->builtin = 0;
 
 	font->t3matrix = fz_identity;
 	font->t3resources = NULL;
 	font->t3procs = NULL;
 	font->t3widths = NULL;
 	font->t3flags = NULL;
+	font->t3lists = NULL;
 	font->t3doc = NULL;
 	font->t3run = NULL;
 
@@ -89,12 +105,20 @@ fz_drop_font(fz_context *ctx, fz_font *font)
 
 	fz_lock(ctx, FZ_LOCK_ALLOC);
 	drop = (font && --font->refs == 0);
+	/* Remove it from the registry under the same lock, so that no one
+	 * can find it there once the last reference is gone. */
+	if (drop && font->shared)
+		fz_unshare_font(ctx, font);
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 	if (!drop)
 		return;
 
 	if (font->t3procs)
 	{
+		for (i = 0; i < 256; i++)
+			if (font->t3lists[i])
+				fz_free_display_list(ctx, font->t3lists[i]);
+		fz_free(ctx, font->t3lists);
 		if (font->t3resources)
 			font->t3freeres(font->t3doc, font->t3resources);
 		for (i = 0; i < 256; i++)
@@ -105,7 +129,12 @@ fz_drop_font(fz_context *ctx, fz_font *font)
 		fz_free(ctx, font->t3flags);
 	}
 
-	if (font->ft_face)
+	if (font->ft_faces)
+		fz_drop_ft_faces(ctx, font);
+
+	if (font->ft_base)
+		fz_drop_font(ctx, font->ft_base);
+	else if (font->ft_face)
 	{
 		fz_lock(ctx, FZ_LOCK_FREETYPE);
 		fterr = FT_Done_Face((FT_Face)font->ft_face);
@@ -117,6 +146,7 @@ fz_drop_font(fz_context *ctx, fz_font *font)
 
 	fz_free(ctx, font->ft_file);
 	fz_free(ctx, font->ft_data);
+	fz_drop_buffer(ctx, font->ft_buffer);
 	fz_free(ctx, font->bbox_table);
 	fz_free(ctx, font->width_table);
 	fz_free(ctx, font);
@@ -139,6 +169,38 @@ struct fz_font_context_s {
 	int ctx_refs;
 	FT_Library ftlib;
 	int ftlib_refs;
+	/* fonts shared by font data, see fz_new_shared_font_from_memory */
+	fz_hash_table *shared_fonts;
+	/* per-context face slots, see fz_ft_context */
+	int slot_used[MAX_FT_CONTEXTS];
+	int slot_gen[MAX_FT_CONTEXTS];
+};
+
+/*
+ * A cloned context renders glyphs with faces of its own, loaded from the
+ * same font data into a FreeType library of its own, so that threads do
+ * not serialize on FZ_LOCK_FREETYPE while rendering. Each such context
+ * owns a slot, and every font keeps the faces made for it by slot. When
+ * the context is freed its library (and with it all its faces) goes
+ * away, and the slot generation is bumped so that fonts know the faces
+ * they have for that slot are gone.
+ *
+ * Other contexts, and the code that reads font metrics and cmaps, keep
+ * using the shared font->ft_face.
+ */
+
+struct fz_ft_context_s {
+	int slot;
+	int gen;
+	FT_Library ftlib;
+};
+
+typedef struct fz_ft_face_s fz_ft_face;
+
+struct fz_ft_face_s {
+	FT_Face face;
+	int gen;
+	int failed;
 };
 
 #undef __FTERRORS_H__
@@ -158,6 +220,16 @@ void fz_new_font_context(fz_context *ctx)
 	ctx->font->ctx_refs = 1;
 	ctx->font->ftlib = NULL;
 	ctx->font->ftlib_refs = 0;
+	fz_try(ctx)
+	{
+		ctx->font->shared_fonts = fz_new_hash_table(ctx, 61, sizeof(fz_font_key), FZ_LOCK_ALLOC);
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, ctx->font);
+		ctx->font = NULL;
+		fz_rethrow(ctx);
+	}
 }
 
 fz_font_context *
@@ -180,7 +252,11 @@ void fz_drop_font_context(fz_context *ctx)
 	drop = --ctx->font->ctx_refs;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 	if (drop == 0)
+	{
+		fz_drop_builtin_fonts(ctx);
+		fz_free_hash(ctx, ctx->font->shared_fonts);
 		fz_free(ctx, ctx->font);
+	}
 }
 
 static const struct ft_error ft_errors[] =
@@ -199,6 +275,188 @@ char *ft_error_string(int err)
 	return "Unknown error";
 }
 
+void
+fz_new_ft_context(fz_context *ctx)
+{
+	fz_font_context *fct = ctx->font;
+	fz_ft_context *ft;
+	int i;
+
+	ft = fz_malloc_no_throw(ctx, sizeof *ft);
+	if (!ft)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	for (i = 0; i < MAX_FT_CONTEXTS; i++)
+		if (!fct->slot_used[i])
+			break;
+	if (i < MAX_FT_CONTEXTS)
+	{
+		fct->slot_used[i] = 1;
+		ft->slot = i;
+		ft->gen = fct->slot_gen[i];
+		ft->ftlib = NULL;
+		ctx->ft = ft;
+	}
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+
+	/* Out of slots; this context will use the shared faces */
+	if (!ctx->ft)
+		fz_free(ctx, ft);
+}
+
+void
+fz_free_ft_context(fz_context *ctx)
+{
+	fz_font_context *fct = ctx->font;
+	fz_ft_context *ft = ctx->ft;
+	int fterr;
+
+	if (!ft)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	if (ft->ftlib)
+	{
+		fterr = FT_Done_FreeType(ft->ftlib);
+		if (fterr)
+			fz_warn(ctx, "freetype finalizing: %s", ft_error_string(fterr));
+	}
+	fct->slot_used[ft->slot] = 0;
+	fct->slot_gen[ft->slot]++;
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+
+	fz_free(ctx, ft);
+	ctx->ft = NULL;
+}
+
+/* Called with FZ_LOCK_FREETYPE held */
+static FT_Face
+fz_new_ft_face(fz_context *ctx, fz_font *font)
+{
+	fz_ft_context *ft = ctx->ft;
+	fz_ft_face *faces = font->ft_faces;
+	FT_Face face;
+	int fterr;
+
+	/* Don't try again if we fail */
+	faces[ft->slot].face = NULL;
+	faces[ft->slot].gen = ft->gen;
+	faces[ft->slot].failed = 1;
+
+	if (!ft->ftlib)
+	{
+		fterr = FT_Init_FreeType(&ft->ftlib);
+		if (fterr)
+		{
+			fz_warn(ctx, "cannot init freetype: %s", ft_error_string(fterr));
+			ft->ftlib = NULL;
+			return NULL;
+		}
+	}
+
+	if (font->ft_file)
+		fterr = FT_New_Face(ft->ftlib, font->ft_file, font->ft_face_index, &face);
+	else
+		fterr = FT_New_Memory_Face(ft->ftlib, font->ft_face_data, font->ft_face_size, font->ft_face_index, &face);
+	if (fterr)
+	{
+		fz_warn(ctx, "freetype: cannot load font: %s", ft_error_string(fterr));
+		return NULL;
+	}
+
+	faces[ft->slot].face = face;
+	faces[ft->slot].failed = 0;
+	return face;
+}
+
+/*
+ * Get a face to render glyphs with. If the context has a face of its
+ * own for the font it is used without locking, otherwise the shared
+ * face is returned with FZ_LOCK_FREETYPE taken. Release it with
+ * fz_unlock_ft_face.
+ *
+ * The face slots are looked up and filled in under the lock, as other
+ * contexts install slot arrays, claim freed slots and drop fonts.
+ */
+static FT_Face
+fz_lock_ft_face(fz_context *ctx, fz_font *font)
+{
+	fz_ft_context *ft = ctx->ft;
+	fz_ft_face *faces, *spare;
+	FT_Face face;
+
+	/* Faces are made for (and belong to) the font that owns the data */
+	if (font->ft_base)
+		font = font->ft_base;
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	if (!ft || !(font->ft_file || font->ft_face_data))
+		return font->ft_face;
+
+	if (!font->ft_faces)
+	{
+		/* Allocating under the lock would take FZ_LOCK_ALLOC out of
+		 * order, so allocate outside it and check again. */
+		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		spare = fz_calloc_no_throw(ctx, MAX_FT_CONTEXTS, sizeof(fz_ft_face));
+		fz_lock(ctx, FZ_LOCK_FREETYPE);
+		if (!font->ft_faces)
+			font->ft_faces = spare;
+		else if (spare)
+		{
+			fz_unlock(ctx, FZ_LOCK_FREETYPE);
+			fz_free(ctx, spare);
+			fz_lock(ctx, FZ_LOCK_FREETYPE);
+		}
+		if (!font->ft_faces)
+			return font->ft_face;
+	}
+
+	faces = font->ft_faces;
+	if (faces[ft->slot].gen == ft->gen && (faces[ft->slot].face || faces[ft->slot].failed))
+		face = faces[ft->slot].face;
+	else
+		face = fz_new_ft_face(ctx, font);
+
+	if (!face)
+		return font->ft_face;
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	return face;
+}
+
+static void
+fz_unlock_ft_face(fz_context *ctx, fz_font *font, FT_Face face)
+{
+	if (face == font->ft_face)
+		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+}
+
+static void
+fz_drop_ft_faces(fz_context *ctx, fz_font *font)
+{
+	fz_font_context *fct = ctx->font;
+	fz_ft_face *faces = font->ft_faces;
+	int fterr;
+	int i;
+
+	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	for (i = 0; i < MAX_FT_CONTEXTS; i++)
+	{
+		/* Faces of freed contexts went with their library */
+		if (faces[i].face && fct->slot_used[i] && faces[i].gen == fct->slot_gen[i])
+		{
+			fterr = FT_Done_Face(faces[i].face);
+			if (fterr)
+				fz_warn(ctx, "freetype finalizing face: %s", ft_error_string(fterr));
+		}
+	}
+	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+
+	fz_free(ctx, faces);
+	font->ft_faces = NULL;
+}
+
 static void
 fz_keep_freetype(fz_context *ctx)
 {
@@ -276,6 +534,8 @@ fz_new_font_from_file(fz_context *ctx, char *name, char *path, int index, int us
 
 	font = fz_new_font(ctx, name, use_glyph_bbox, face->num_glyphs);
 	font->ft_face = face;
+	font->ft_face_index = index;
+	font->ft_file = fz_strdup_no_throw(ctx, path);
 	font->bbox.x0 = (float) face->bbox.xMin / face->units_per_EM;
 	font->bbox.y0 = (float) face->bbox.yMin / face->units_per_EM;
 	font->bbox.x1 = (float) face->bbox.xMax / face->units_per_EM;
@@ -307,6 +567,9 @@ fz_new_font_from_memory(fz_context *ctx, char *name, unsigned char *data, int le
 
 	font = fz_new_font(ctx, name, use_glyph_bbox, face->num_glyphs);
 	font->ft_face = face;
+	font->ft_face_index = index;
+	font->ft_face_data = data;
+	font->ft_face_size = len;
 	font->bbox.x0 = (float) face->bbox.xMin / face->units_per_EM;
 	font->bbox.y0 = (float) face->bbox.yMin / face->units_per_EM;
 	font->bbox.x1 = (float) face->bbox.xMax / face->units_per_EM;
@@ -315,8 +578,138 @@ fz_new_font_from_memory(fz_context *ctx, char *name, unsigned char *data, int le
 	return font;
 }
 
+static fz_font *
+fz_new_shared_font(fz_context *ctx, fz_font_key *key, char *name, unsigned char *data, int len, int index, int use_glyph_bbox, int builtin)
+{
+	fz_hash_table *table = ctx->font->shared_fonts;
+	fz_font *font, *other;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	font = fz_hash_find(ctx, table, key);
+	if (font)
+		font->refs++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (font)
+		return font;
+
+	font = fz_new_font_from_memory(ctx, name, data, len, index, use_glyph_bbox);
+
+	/* Another thread may have made the same font in the meantime, in
+	 * which case we keep ours to ourselves. */
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_try(ctx)
+	{
+		other = fz_hash_find(ctx, table, key);
+		if (!other)
+		{
+			fz_hash_insert(ctx, table, key, font);
+			font->shared_key = *key;
+			font->shared = 1;
+			if (builtin)
+			{
+				/* dropped by fz_drop_builtin_fonts */
+				font->builtin = 1;
+				font->refs++;
+			}
+		}
+	}
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "cannot share font '%s'", font->name);
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return font;
+}
+
+fz_font *
+fz_new_shared_font_from_memory(fz_context *ctx, char *name, unsigned char *data, int len, int index, int use_glyph_bbox)
+{
+	fz_font_key key;
+	fz_md5 md5;
+
+	memset(&key, 0, sizeof key);
+	fz_md5_init(&md5);
+	fz_md5_update(&md5, (unsigned char *)name, strlen(name) + 1);
+	fz_md5_update(&md5, data, len);
+	fz_md5_final(&md5, key.digest);
+	key.index = index;
+	key.use_glyph_bbox = use_glyph_bbox;
+
+	return fz_new_shared_font(ctx, &key, name, data, len, index, use_glyph_bbox, 0);
+}
+
+fz_font *
+fz_new_builtin_font(fz_context *ctx, char *name, unsigned char *data, int len, int index, int use_glyph_bbox)
+{
+	fz_font_key key;
+	fz_md5 md5;
+
+	memset(&key, 0, sizeof key);
+	fz_md5_init(&md5);
+	fz_md5_update(&md5, (unsigned char *)"builtin", 8);
+	fz_md5_update(&md5, (unsigned char *)&data, sizeof data);
+	fz_md5_update(&md5, (unsigned char *)&len, sizeof len);
+	fz_md5_final(&md5, key.digest);
+	key.index = index;
+	key.use_glyph_bbox = use_glyph_bbox;
+
+	return fz_new_shared_font(ctx, &key, name, data, len, index, use_glyph_bbox, 1);
+}
+
+fz_font *
+fz_new_font_from_font(fz_context *ctx, char *name, fz_font *base)
+{
+	fz_font *font;
+
+	font = fz_new_font(ctx, name, base->use_glyph_bbox, base->bbox_count);
+	font->ft_base = fz_keep_font(ctx, base);
+	font->ft_face = base->ft_face;
+	font->ft_hint = base->ft_hint;
+	font->bbox = base->bbox;
+
+	return font;
+}
+
+/* Called when the last reference to the font context goes */
+static void
+fz_drop_builtin_fonts(fz_context *ctx)
+{
+	fz_hash_table *table = ctx->font->shared_fonts;
+	fz_font *font;
+	int i, n;
+
+	/* Dropping a font removes it from the table, so rescan after each */
+	do
+	{
+		font = NULL;
+		n = fz_hash_len(ctx, table);
+		for (i = 0; i < n && !font; i++)
+		{
+			font = fz_hash_get_val(ctx, table, i);
+			if (font && !font->builtin)
+				font = NULL;
+		}
+		if (font)
+		{
+			font->builtin = 0;
+			fz_drop_font(ctx, font);
+		}
+	}
+	while (font);
+}
+
+/* Called with FZ_LOCK_ALLOC held */
+static void
+fz_unshare_font(fz_context *ctx, fz_font *font)
+{
+	fz_hash_remove(ctx, ctx->font->shared_fonts, &font->shared_key);
+	font->shared = 0;
+}
+
+/* Called with the face from fz_lock_ft_face */
 static fz_matrix
-fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
+fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, FT_Face face, int gid, fz_matrix trm)
 {
 	/* Fudge the font matrix to stretch the glyph if we've substituted the font. */
 	if (font->ft_substitute && font->width_table && gid < font->width_count)
@@ -326,19 +719,17 @@ fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 		int realw;
 		float scale;
 
-		fz_lock(ctx, FZ_LOCK_FREETYPE);
 		/* TODO: use FT_Get_Advance */
-		fterr = FT_Set_Char_Size(font->ft_face, 1000, 1000, 72, 72);
+		fterr = FT_Set_Char_Size(face, 1000, 1000, 72, 72);
 		if (fterr)
 			fz_warn(ctx, "freetype setting character size: %s", ft_error_string(fterr));
 
-		fterr = FT_Load_Glyph(font->ft_face, gid,
+		fterr = FT_Load_Glyph(face, gid,
 			FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP | FT_LOAD_IGNORE_TRANSFORM);
 		if (fterr)
 			fz_warn(ctx, "freetype failed to load glyph: %s", ft_error_string(fterr));
 
-		realw = ((FT_Face)font->ft_face)->glyph->metrics.horiAdvance;
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		realw = face->glyph->metrics.horiAdvance;
 		subw = font->width_table[gid];
 		if (realw)
 			scale = (float) subw / realw;
@@ -369,15 +760,24 @@ fz_copy_ft_bitmap(fz_context *ctx, int left, int top, FT_Bitmap *bitmap)
 			unsigned char *in = bitmap->buffer + (unsigned int)((pixmap->h - y - 1) * bitmap->pitch);
 			unsigned char bit = 0x80;
 			int w = pixmap->w;
+			while (w >= 8)
+			{
+				int b = *in++;
+				out[0] = (b & 0x80) ? 255 : 0;
+				out[1] = (b & 0x40) ? 255 : 0;
+				out[2] = (b & 0x20) ? 255 : 0;
+				out[3] = (b & 0x10) ? 255 : 0;
+				out[4] = (b & 0x08) ? 255 : 0;
+				out[5] = (b & 0x04) ? 255 : 0;
+				out[6] = (b & 0x02) ? 255 : 0;
+				out[7] = (b & 0x01) ? 255 : 0;
+				out += 8;
+				w -= 8;
+			}
 			while (w--)
 			{
 				*out++ = (*in & bit) ? 255 : 0;
 				bit >>= 1;
-				if (bit == 0)
-				{
-					bit = 0x80;
-					in++;
-				}
 			}
 		}
 	}
@@ -394,11 +794,10 @@ fz_copy_ft_bitmap(fz_context *ctx, int left, int top, FT_Bitmap *bitmap)
 	return pixmap;
 }
 
-/* The glyph cache lock is always taken when this is called. */
 fz_pixmap *
 fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, int aa)
 {
-	FT_Face face = font->ft_face;
+	FT_Face face;
 	FT_Matrix m;
 	FT_Vector v;
 	FT_Error fterr;
@@ -406,7 +805,9 @@ fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, int a
 
 	float strength = fz_matrix_expansion(trm) * 0.02f;
 
-	trm = fz_adjust_ft_glyph_width(ctx, font, gid, trm);
+	face = fz_lock_ft_face(ctx, font);
+
+	trm = fz_adjust_ft_glyph_width(ctx, font, face, gid, trm);
 
 	if (font->ft_italic)
 		trm = fz_concat(fz_shear(SHEAR, 0), trm);
@@ -426,7 +827,6 @@ fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, int a
 	v.x = trm.e * 64;
 	v.y = trm.f * 64;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
 	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
 	if (fterr)
 		fz_warn(ctx, "freetype setting character size: %s", ft_error_string(fterr));
@@ -475,7 +875,7 @@ retry_unhinted:
 		if (fterr)
 		{
 			fz_warn(ctx, "freetype load glyph (gid %d): %s", gid, ft_error_string(fterr));
-			fz_unlock(ctx, FZ_LOCK_FREETYPE);
+			fz_unlock_ft_face(ctx, font, face);
 			return NULL;
 		}
 	}
@@ -490,19 +890,19 @@ retry_unhinted:
 	if (fterr)
 	{
 		fz_warn(ctx, "freetype render glyph (gid %d): %s", gid, ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
 	result = fz_copy_ft_bitmap(ctx, face->glyph->bitmap_left, face->glyph->bitmap_top, &face->glyph->bitmap);
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	fz_unlock_ft_face(ctx, font, face);
 	return result;
 }
 
 fz_pixmap *
 fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, fz_matrix ctm, fz_stroke_state *state)
 {
-	FT_Face face = font->ft_face;
+	FT_Face face;
 	float expansion = fz_matrix_expansion(ctm);
 	int linewidth = state->linewidth * expansion * 64 / 2;
 	FT_Matrix m;
@@ -514,7 +914,9 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	fz_pixmap *pixmap;
 	FT_Stroker_LineJoin line_join;
 
-	trm = fz_adjust_ft_glyph_width(ctx, font, gid, trm);
+	face = fz_lock_ft_face(ctx, font);
+
+	trm = fz_adjust_ft_glyph_width(ctx, font, face, gid, trm);
 
 	if (font->ft_italic)
 		trm = fz_concat(fz_shear(SHEAR, 0), trm);
@@ -526,12 +928,11 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	v.x = trm.e * 64;
 	v.y = trm.f * 64;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
 	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
 	if (fterr)
 	{
 		fz_warn(ctx, "FT_Set_Char_Size: %s", ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
@@ -541,15 +942,15 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	if (fterr)
 	{
 		fz_warn(ctx, "FT_Load_Glyph(gid %d): %s", gid, ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
-	fterr = FT_Stroker_New(ctx->font->ftlib, &stroker);
+	fterr = FT_Stroker_New(face->glyph->library, &stroker);
 	if (fterr)
 	{
 		fz_warn(ctx, "FT_Stroker_New: %s", ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
@@ -575,7 +976,7 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	{
 		fz_warn(ctx, "FT_Get_Glyph: %s", ft_error_string(fterr));
 		FT_Stroker_Done(stroker);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
@@ -585,7 +986,7 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 		fz_warn(ctx, "FT_Glyph_Stroke: %s", ft_error_string(fterr));
 		FT_Done_Glyph(glyph);
 		FT_Stroker_Done(stroker);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
@@ -596,14 +997,14 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 	{
 		fz_warn(ctx, "FT_Glyph_To_Bitmap: %s", ft_error_string(fterr));
 		FT_Done_Glyph(glyph);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
 	bitmap = (FT_BitmapGlyph)glyph;
 	pixmap = fz_copy_ft_bitmap(ctx, bitmap->left, bitmap->top, &bitmap->bitmap);
 	FT_Done_Glyph(glyph);
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	fz_unlock_ft_face(ctx, font, face);
 
 	return pixmap;
 }
@@ -611,7 +1012,7 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix tr
 static fz_rect
 fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 {
-	FT_Face face = font->ft_face;
+	FT_Face face;
 	FT_Error fterr;
 	FT_BBox cbox;
 	FT_Matrix m;
@@ -623,7 +1024,9 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 
 	float strength = fz_matrix_expansion(trm) * 0.02f;
 
-	trm = fz_adjust_ft_glyph_width(ctx, font, gid, trm);
+	face = fz_lock_ft_face(ctx, font);
+
+	trm = fz_adjust_ft_glyph_width(ctx, font, face, gid, trm);
 
 	if (font->ft_italic)
 		trm = fz_concat(fz_shear(SHEAR, 0), trm);
@@ -635,7 +1038,6 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 	v.x = trm.e * 64;
 	v.y = trm.f * 64;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
 	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
 	if (fterr)
 		fz_warn(ctx, "freetype setting character size: %s", ft_error_string(fterr));
@@ -645,7 +1047,7 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 	if (fterr)
 	{
 		fz_warn(ctx, "freetype load glyph (gid %d): %s", gid, ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		bounds.x0 = bounds.x1 = trm.e;
 		bounds.y0 = bounds.y1 = trm.f;
 		return bounds;
@@ -658,7 +1060,7 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 	}
 
 	FT_Outline_Get_CBox(&face->glyph->outline, &cbox);
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	fz_unlock_ft_face(ctx, font, face);
 	bounds.x0 = cbox.xMin / 64.0f;
 	bounds.y0 = cbox.yMin / 64.0f;
 	bounds.x1 = cbox.xMax / 64.0f;
@@ -736,18 +1138,225 @@ static const FT_Outline_Funcs outline_funcs = {
 	move_to, line_to, conic_to, cubic_to, 0, 0
 };
 
+/*
+ * Unscaled glyph outlines are kept in the store, keyed on font and
+ * glyph, so that glyphs too big for the glyph cache (and text used as
+ * a clip) are only decomposed once. The cached path is in font units
+ * divided by 64, to share the decomposition callbacks above; each use
+ * gets a transformed copy.
+ */
+
+typedef struct fz_glyph_outline_s fz_glyph_outline;
+typedef struct fz_glyph_outline_key_s fz_glyph_outline_key;
+
+struct fz_glyph_outline_s
+{
+	fz_storable storable;
+	fz_path *path;
+};
+
+struct fz_glyph_outline_key_s
+{
+	int refs;
+	fz_font *font;
+	int gid;
+};
+
+static void
+fz_free_glyph_outline_imp(fz_context *ctx, fz_storable *outline_)
+{
+	fz_glyph_outline *outline = (fz_glyph_outline *)outline_;
+
+	fz_free_path(ctx, outline->path);
+	fz_free(ctx, outline);
+}
+
+static int
+fz_make_hash_glyph_outline_key(fz_store_hash *hash, void *key_)
+{
+	fz_glyph_outline_key *key = (fz_glyph_outline_key *)key_;
+
+	hash->u.pi.ptr = key->font;
+	hash->u.pi.i = key->gid;
+	return 1;
+}
+
+static void *
+fz_keep_glyph_outline_key(fz_context *ctx, void *key_)
+{
+	fz_glyph_outline_key *key = (fz_glyph_outline_key *)key_;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	key->refs++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return (void *)key;
+}
+
+static void
+fz_drop_glyph_outline_key(fz_context *ctx, void *key_)
+{
+	fz_glyph_outline_key *key = (fz_glyph_outline_key *)key_;
+	int drop;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	drop = --key->refs;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (drop == 0)
+	{
+		fz_drop_font(ctx, key->font);
+		fz_free(ctx, key);
+	}
+}
+
+static int
+fz_cmp_glyph_outline_key(void *k0_, void *k1_)
+{
+	fz_glyph_outline_key *k0 = (fz_glyph_outline_key *)k0_;
+	fz_glyph_outline_key *k1 = (fz_glyph_outline_key *)k1_;
+
+	return k0->font != k1->font || k0->gid != k1->gid;
+}
+
+#ifndef NDEBUG
+static void
+fz_debug_glyph_outline_key(void *key_)
+{
+	fz_glyph_outline_key *key = (fz_glyph_outline_key *)key_;
+
+	printf("(glyph outline '%s' %d) ", key->font->name, key->gid);
+}
+#endif
+
+static fz_store_type fz_glyph_outline_store_type =
+{
+	fz_make_hash_glyph_outline_key,
+	fz_keep_glyph_outline_key,
+	fz_drop_glyph_outline_key,
+	fz_cmp_glyph_outline_key,
+#ifndef NDEBUG
+	fz_debug_glyph_outline_key
+#endif
+};
+
+static fz_glyph_outline *
+fz_load_glyph_outline(fz_context *ctx, fz_font *font, int gid)
+{
+	fz_glyph_outline_key *key;
+	fz_glyph_outline *outline, *existing;
+	struct closure cc;
+	FT_Face face;
+	int fterr;
+
+	key = fz_malloc_struct(ctx, fz_glyph_outline_key);
+	key->refs = 1;
+	key->font = fz_keep_font(ctx, font);
+	key->gid = gid;
+
+	outline = fz_find_item(ctx, fz_free_glyph_outline_imp, key, &fz_glyph_outline_store_type);
+	if (outline)
+	{
+		fz_drop_glyph_outline_key(ctx, key);
+		return outline;
+	}
+
+	face = fz_lock_ft_face(ctx, font);
+	fterr = FT_Load_Glyph(face, gid, FT_LOAD_NO_SCALE | FT_LOAD_IGNORE_TRANSFORM);
+	if (fterr || face->glyph->format != FT_GLYPH_FORMAT_OUTLINE)
+	{
+		fz_unlock_ft_face(ctx, font, face);
+		fz_drop_glyph_outline_key(ctx, key);
+		return NULL;
+	}
+
+	cc.ctx = ctx;
+	cc.path = NULL;
+	cc.x = 0;
+	cc.y = 0;
+	outline = NULL;
+	fz_try(ctx)
+	{
+		cc.path = fz_new_path(ctx);
+		fz_moveto(ctx, cc.path, 0, 0);
+		FT_Outline_Decompose(&face->glyph->outline, &outline_funcs, &cc);
+		fz_closepath(ctx, cc.path);
+		outline = fz_malloc_struct(ctx, fz_glyph_outline);
+		FZ_INIT_STORABLE(outline, 1, fz_free_glyph_outline_imp);
+		outline->path = cc.path;
+	}
+	fz_catch(ctx)
+	{
+		if (cc.path)
+			fz_free_path(ctx, cc.path);
+		fz_unlock_ft_face(ctx, font, face);
+		fz_drop_glyph_outline_key(ctx, key);
+		return NULL;
+	}
+	fz_unlock_ft_face(ctx, font, face);
+
+	existing = fz_store_item(ctx, key, outline, sizeof(fz_glyph_outline) + sizeof(fz_path) + cc.path->cap * sizeof(fz_path_item), &fz_glyph_outline_store_type);
+	if (existing)
+	{
+		fz_drop_storable(ctx, &outline->storable);
+		outline = existing;
+	}
+	fz_drop_glyph_outline_key(ctx, key);
+
+	return outline;
+}
+
 fz_path *
 fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 {
 	struct closure cc;
-	FT_Face face = font->ft_face;
+	FT_Face face;
 	FT_Matrix m;
 	FT_Vector v;
+	fz_glyph_outline *outline;
+	fz_path *path;
+	float scale;
 	int fterr;
 
 	float strength = fz_matrix_expansion(trm) * 0.02f;
 
-	trm = fz_adjust_ft_glyph_width(ctx, font, gid, trm);
+	/* Synthetic emboldening is done in device space, so is not cached */
+	if (!font->ft_bold && ((FT_Face)font->ft_face)->units_per_EM > 0)
+	{
+		outline = fz_load_glyph_outline(ctx, font, gid);
+		if (outline)
+		{
+			path = NULL;
+			fz_try(ctx)
+			{
+				path = fz_clone_path(ctx, outline->path);
+			}
+			fz_always(ctx)
+			{
+				fz_drop_storable(ctx, &outline->storable);
+			}
+			fz_catch(ctx)
+			{
+				fz_warn(ctx, "cannot copy glyph outline");
+				return NULL;
+			}
+
+			if (font->ft_substitute && font->width_table)
+			{
+				face = fz_lock_ft_face(ctx, font);
+				trm = fz_adjust_ft_glyph_width(ctx, font, face, gid, trm);
+				fz_unlock_ft_face(ctx, font, face);
+			}
+			if (font->ft_italic)
+				trm = fz_concat(fz_shear(SHEAR, 0), trm);
+			scale = 64.0f / ((FT_Face)font->ft_face)->units_per_EM;
+			fz_transform_path(ctx, path, fz_concat(fz_scale(scale, scale), trm));
+			return path;
+		}
+	}
+
+	face = fz_lock_ft_face(ctx, font);
+
+	trm = fz_adjust_ft_glyph_width(ctx, font, face, gid, trm);
 
 	if (font->ft_italic)
 		trm = fz_concat(fz_shear(SHEAR, 0), trm);
@@ -759,8 +1368,6 @@ fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 	v.x = 0;
 	v.y = 0;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
-
 	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
 	if (fterr)
 		fz_warn(ctx, "freetype setting character size: %s", ft_error_string(fterr));
@@ -770,7 +1377,7 @@ fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 	if (fterr)
 	{
 		fz_warn(ctx, "freetype load glyph (gid %d): %s", gid, ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
@@ -794,11 +1401,11 @@ fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 	{
 		fz_warn(ctx, "freetype cannot decompose outline");
 		fz_free(ctx, cc.path);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font, face);
 		return NULL;
 	}
 
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	fz_unlock_ft_face(ctx, font, face);
 
 	return cc.path;
 }
@@ -817,6 +1424,7 @@ fz_new_type3_font(fz_context *ctx, char *name, fz_matrix matrix)
 	font->t3procs = fz_malloc_array(ctx, 256, sizeof(fz_buffer*));
 	font->t3widths = fz_malloc_array(ctx, 256, sizeof(float));
 	font->t3flags = fz_malloc_array(ctx, 256, sizeof(char));
+	font->t3lists = fz_malloc_array(ctx, 256, sizeof(fz_display_list*));
 
 	font->t3matrix = matrix;
 	for (i = 0; i < 256; i++)
@@ -824,36 +1432,82 @@ fz_new_type3_font(fz_context *ctx, char *name, fz_matrix matrix)
 		font->t3procs[i] = NULL;
 		font->t3widths[i] = 0;
 		font->t3flags[i] = 0;
+		font->t3lists[i] = NULL;
 	}
 
 	return font;
 }
 
+/*
+ * Each glyph procedure is interpreted once, in glyph space, into a
+ * display list that is replayed for bounding and rendering at any size.
+ * The device flags the interpreter leaves behind (masked or coloured,
+ * and whether the glyph depends on the graphics state) are saved at the
+ * same time. Glyphs that depend on the graphics state are still run
+ * directly by fz_render_t3_glyph_direct.
+ *
+ * Sharing one list across sizes is not optional: the list holds the
+ * untransformed glyph and replay applies the size (including to the
+ * group, mask and clip areas), so a list recorded per size would hold
+ * exactly the same nodes.
+ */
+static fz_display_list *
+fz_load_t3_glyph_list(fz_context *ctx, fz_font *font, int gid)
+{
+	fz_display_list *list;
+	fz_device *dev;
+
+	if (font->t3lists[gid])
+		return font->t3lists[gid];
+
+	list = fz_new_display_list(ctx);
+	dev = NULL;
+	fz_var(dev);
+	fz_try(ctx)
+	{
+		dev = fz_new_list_device(ctx, list);
+		dev->flags = FZ_DEVFLAG_FILLCOLOR_UNDEFINED |
+				FZ_DEVFLAG_STROKECOLOR_UNDEFINED |
+				FZ_DEVFLAG_STARTCAP_UNDEFINED |
+				FZ_DEVFLAG_DASHCAP_UNDEFINED |
+				FZ_DEVFLAG_ENDCAP_UNDEFINED |
+				FZ_DEVFLAG_LINEJOIN_UNDEFINED |
+				FZ_DEVFLAG_MITERLIMIT_UNDEFINED |
+				FZ_DEVFLAG_LINEWIDTH_UNDEFINED;
+		font->t3run(font->t3doc, font->t3resources, font->t3procs[gid], dev, fz_identity, NULL);
+		font->t3flags[gid] = dev->flags;
+	}
+	fz_always(ctx)
+	{
+		fz_free_device(dev);
+	}
+	fz_catch(ctx)
+	{
+		fz_free_display_list(ctx, list);
+		fz_rethrow(ctx);
+	}
+
+	font->t3lists[gid] = list;
+	return list;
+}
+
 static fz_rect
 fz_bound_t3_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm)
 {
 	fz_matrix ctm;
-	void *contents;
+	fz_display_list *list;
 	fz_rect bounds;
 	fz_bbox bbox;
 	fz_device *dev;
 
-	contents = font->t3procs[gid];
-	if (!contents)
+	if (!font->t3procs[gid])
 		return fz_transform_rect(trm, fz_empty_rect);
 
+	list = fz_load_t3_glyph_list(ctx, font, gid);
+
 	ctm = fz_concat(font->t3matrix, trm);
 	dev = fz_new_bbox_device(ctx, &bbox);
-	dev->flags = FZ_DEVFLAG_FILLCOLOR_UNDEFINED |
-			FZ_DEVFLAG_STROKECOLOR_UNDEFINED |
-			FZ_DEVFLAG_STARTCAP_UNDEFINED |
-			FZ_DEVFLAG_DASHCAP_UNDEFINED |
-			FZ_DEVFLAG_ENDCAP_UNDEFINED |
-			FZ_DEVFLAG_LINEJOIN_UNDEFINED |
-			FZ_DEVFLAG_MITERLIMIT_UNDEFINED |
-			FZ_DEVFLAG_LINEWIDTH_UNDEFINED;
-	font->t3run(font->t3doc, font->t3resources, contents, dev, ctm, NULL);
-	font->t3flags[gid] = dev->flags;
+	fz_run_display_list(list, dev, ctm, fz_infinite_bbox, NULL);
 	fz_free_device(dev);
 
 	bounds.x0 = bbox.x0;
@@ -867,7 +1521,7 @@ fz_pixmap *
 fz_render_t3_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, fz_colorspace *model, fz_bbox scissor)
 {
 	fz_matrix ctm;
-	void *contents;
+	fz_display_list *list;
 	fz_bbox bbox;
 	fz_device *dev;
 	fz_pixmap *glyph;
@@ -876,10 +1530,11 @@ fz_render_t3_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, fz_co
 	if (gid < 0 || gid > 255)
 		return NULL;
 
-	contents = font->t3procs[gid];
-	if (!contents)
+	if (!font->t3procs[gid])
 		return NULL;
 
+	list = fz_load_t3_glyph_list(ctx, font, gid);
+
 	if (font->t3flags[gid] & FZ_DEVFLAG_MASK)
 	{
 		if (font->t3flags[gid] & FZ_DEVFLAG_COLOR)
@@ -910,7 +1565,7 @@ fz_render_t3_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm, fz_co
 
 	ctm = fz_concat(font->t3matrix, trm);
 	dev = fz_new_draw_device_type3(ctx, glyph);
-	font->t3run(font->t3doc, font->t3resources, contents, dev, ctm, NULL);
+	fz_run_display_list(list, dev, ctm, fz_infinite_bbox, NULL);
 	fz_free_device(dev);
 
 	if (!model)
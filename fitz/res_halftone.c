@@ -71,10 +71,6 @@ fz_halftone *fz_default_halftone(fz_context *ctx, int num_comps)
 /* Finally, code to actually perform halftoning. */
 static void make_ht_line(unsigned char *buf, fz_halftone *ht, int x, int y, int w)
 {
-	/* FIXME: There is a potential optimisation here; in the case where
-	 * the LCM of the halftone tile widths is smaller than w, we could
-	 * form just one 'LCM' run, then copy it repeatedly.
-	 */
 	int k, n;
 	n = ht->n;
 	for (k = 0; k < n; k++)
@@ -113,16 +109,28 @@ static void make_ht_line(unsigned char *buf, fz_halftone *ht, int x, int y, int
 
 		/* Centre section - complete copies */
 		w2 -= tw;
-		while (w2 >= 0)
+		if (n == 1)
 		{
-			len = tw;
-			t = tbase;
-			while (len--)
+			while (w2 >= 0)
 			{
-				*b = *t++;
-				b += n;
+				memcpy(b, tbase, tw);
+				b += tw;
+				w2 -= tw;
+			}
+		}
+		else
+		{
+			while (w2 >= 0)
+			{
+				len = tw;
+				t = tbase;
+				while (len--)
+				{
+					*b = *t++;
+					b += n;
+				}
+				w2 -= tw;
 			}
-			w2 -= tw;
 		}
 		w2 += tw;
 
@@ -136,67 +144,121 @@ static void make_ht_line(unsigned char *buf, fz_halftone *ht, int x, int y, int
 	}
 }
 
-/* Inner mono thresholding code */
+/* Inner mono thresholding code. Eight pixels are compared at a time
+ * without branches so that the compiler can turn the loop into vector
+ * compares; only the final partial byte is done pixel by pixel. */
 static void do_threshold_1(unsigned char *ht_line, unsigned char *pixmap, unsigned char *out, int w)
 {
 	int bit = 0x80;
 	int h = 0;
 
+	while (w >= 8)
+	{
+		*out++ =
+			((pixmap[0] < ht_line[0]) << 7) |
+			((pixmap[2] < ht_line[1]) << 6) |
+			((pixmap[4] < ht_line[2]) << 5) |
+			((pixmap[6] < ht_line[3]) << 4) |
+			((pixmap[8] < ht_line[4]) << 3) |
+			((pixmap[10] < ht_line[5]) << 2) |
+			((pixmap[12] < ht_line[6]) << 1) |
+			(pixmap[14] < ht_line[7]);
+		pixmap += 16; /* Skip the alpha */
+		ht_line += 8;
+		w -= 8;
+	}
+
+	if (w == 0)
+		return;
+
 	do
 	{
 		if (*pixmap < *ht_line++)
 			h |= bit;
 		pixmap += 2; /* Skip the alpha */
 		bit >>= 1;
-		if (bit == 0)
+	}
+	while (--w);
+	*out = h;
+}
+
+void fz_halftone_pixmap_band(fz_context *ctx, fz_pixmap *pix, fz_halftone *ht, fz_bitmap *out, int band_y)
+{
+	unsigned char *ht_lines = NULL;
+	unsigned char *o, *p;
+	int w, h, x, y, n, k, th, pstride, ostride;
+	fz_halftone *ht_orig = ht;
+
+	if (!pix || !out)
+		return;
+
+	assert(pix->n == 2); /* Mono + Alpha */
+
+	n = pix->n-1; /* Remove alpha */
+	if (band_y < 0 || pix->w > out->w || band_y + pix->h > out->h || n != out->n)
+		fz_throw(ctx, "halftone band does not fit in bitmap");
+
+	fz_var(ht_lines);
+	fz_var(ht);
+
+	fz_try(ctx)
+	{
+		if (ht == NULL)
+			ht = fz_default_halftone(ctx, n);
+
+		/* The threshold rows repeat with the height of the halftone
+		 * tile, so build each of them once rather than once per row. */
+		th = ht->comp[0]->h;
+		ht_lines = fz_malloc_array(ctx, th, pix->w * n);
+
+		h = pix->h;
+		x = pix->x;
+		y = pix->y;
+		w = pix->w;
+		for (k = 0; k < th && k < h; k++)
+			make_ht_line(ht_lines + k * w * n, ht, x, y + k, w);
+
+		ostride = out->stride;
+		pstride = pix->w * pix->n;
+		o = out->samples + (unsigned int)(band_y * ostride);
+		p = pix->samples;
+		for (y = 0; y < h; y++)
 		{
-			*out++ = h;
-			h = 0;
-			bit = 0x80;
+			do_threshold_1(ht_lines + (y % th) * w * n, p, o, w);
+			o += ostride;
+			p += pstride;
 		}
-
 	}
-	while (--w);
-	if (bit != 0x80)
-		*out++ = h;
+	fz_always(ctx)
+	{
+		fz_free(ctx, ht_lines);
+		if (!ht_orig)
+			fz_drop_halftone(ctx, ht);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
 }
 
 fz_bitmap *fz_halftone_pixmap(fz_context *ctx, fz_pixmap *pix, fz_halftone *ht)
 {
 	fz_bitmap *out;
-	unsigned char *ht_line, *o, *p;
-	int w, h, x, y, n, pstride, ostride;
-	fz_halftone *ht_orig = ht;
 
 	if (!pix)
 		return NULL;
 
 	assert(pix->n == 2); /* Mono + Alpha */
 
-	n = pix->n-1; /* Remove alpha */
-	if (ht == NULL)
+	out = fz_new_bitmap(ctx, pix->w, pix->h, pix->n - 1);
+	fz_try(ctx)
 	{
-		ht = fz_default_halftone(ctx, n);
+		fz_halftone_pixmap_band(ctx, pix, ht, out, 0);
 	}
-	ht_line = fz_malloc(ctx, pix->w * n);
-	out = fz_new_bitmap(ctx, pix->w, pix->h, n);
-	o = out->samples;
-	p = pix->samples;
-
-	h = pix->h;
-	x = pix->x;
-	y = pix->y;
-	w = pix->w;
-	ostride = out->stride;
-	pstride = pix->w * pix->n;
-	while (h--)
+	fz_catch(ctx)
 	{
-		make_ht_line(ht_line, ht, x, y++, w);
-		do_threshold_1(ht_line, p, o, w);
-		o += ostride;
-		p += pstride;
+		fz_drop_bitmap(ctx, out);
+		fz_rethrow(ctx);
 	}
-	if (!ht_orig)
-		fz_drop_halftone(ctx, ht);
 	return out;
 }
@@ -1,5 +1,689 @@
 #include "fitz-internal.h"
 
+#define MAXSUBDIV 6 /* maximum number of levels to subdivide patches */
+#define PATCHSIZE 8 /* target size of subdivided patches in device space */
+
+typedef struct fz_mesh_processor_s fz_mesh_processor;
+
+struct fz_mesh_processor_s
+{
+	fz_context *ctx;
+	fz_shade *shade;
+	fz_matrix ctm;
+	fz_rect clip;
+	fz_rect *bounds;
+	fz_mesh_process_fn *process;
+	void *process_arg;
+	int ncomp;
+};
+
+static inline void
+add_point_to_rect(fz_rect *r, float x, float y)
+{
+	if (x < r->x0) r->x0 = x;
+	if (y < r->y0) r->y0 = y;
+	if (x > r->x1) r->x1 = x;
+	if (y > r->y1) r->y1 = y;
+}
+
+static inline int
+rect_outside_clip(fz_rect *clip, float x0, float y0, float x1, float y1)
+{
+	if (fz_is_infinite_rect(*clip))
+		return 0;
+	return x1 < clip->x0 || x0 > clip->x1 || y1 < clip->y0 || y0 > clip->y1;
+}
+
+static void
+paint_tri(fz_mesh_processor *painter, fz_vertex *v0, fz_vertex *v1, fz_vertex *v2)
+{
+	float x0, y0, x1, y1;
+
+	if (painter->bounds)
+	{
+		add_point_to_rect(painter->bounds, v0->x, v0->y);
+		add_point_to_rect(painter->bounds, v1->x, v1->y);
+		add_point_to_rect(painter->bounds, v2->x, v2->y);
+		return;
+	}
+
+	x0 = fz_min(fz_min(v0->x, v1->x), v2->x);
+	y0 = fz_min(fz_min(v0->y, v1->y), v2->y);
+	x1 = fz_max(fz_max(v0->x, v1->x), v2->x);
+	y1 = fz_max(fz_max(v0->y, v1->y), v2->y);
+	if (rect_outside_clip(&painter->clip, x0, y0, x1, y1))
+		return;
+
+	painter->process(painter->ctx, painter->process_arg, v0, v1, v2);
+}
+
+static void
+paint_quad(fz_mesh_processor *painter, fz_vertex *v0, fz_vertex *v1, fz_vertex *v2, fz_vertex *v3)
+{
+	paint_tri(painter, v0, v1, v3);
+	paint_tri(painter, v1, v3, v2);
+}
+
+static inline void
+transform_vertex(fz_mesh_processor *painter, fz_vertex *v)
+{
+	fz_point p;
+	p.x = v->x;
+	p.y = v->y;
+	p = fz_transform_point(painter->ctm, p);
+	v->x = p.x;
+	v->y = p.y;
+}
+
+/* Subdivide and tessellate tensor-patches */
+
+typedef struct fz_tensor_patch_s fz_tensor_patch;
+
+struct fz_tensor_patch_s
+{
+	fz_point pole[4][4];
+	float color[4][FZ_MAX_COLORS];
+};
+
+static void
+triangulate_patch(fz_mesh_processor *painter, fz_tensor_patch *p)
+{
+	fz_vertex v0, v1, v2, v3;
+
+	v0.x = p->pole[0][0].x;
+	v0.y = p->pole[0][0].y;
+	memcpy(v0.c, p->color[0], painter->ncomp * sizeof(float));
+
+	v1.x = p->pole[0][3].x;
+	v1.y = p->pole[0][3].y;
+	memcpy(v1.c, p->color[1], painter->ncomp * sizeof(float));
+
+	v2.x = p->pole[3][3].x;
+	v2.y = p->pole[3][3].y;
+	memcpy(v2.c, p->color[2], painter->ncomp * sizeof(float));
+
+	v3.x = p->pole[3][0].x;
+	v3.y = p->pole[3][0].y;
+	memcpy(v3.c, p->color[3], painter->ncomp * sizeof(float));
+
+	paint_quad(painter, &v0, &v1, &v2, &v3);
+}
+
+static inline void midcolor(float *c, float *c1, float *c2, int n)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		c[i] = (c1[i] + c2[i]) * 0.5f;
+}
+
+static void
+split_curve(fz_point *pole, fz_point *q0, fz_point *q1, int polestep)
+{
+	/*
+	split bezier curve given by control points pole[0]..pole[3]
+	using de casteljau algo at midpoint and build two new
+	bezier curves q0[0]..q0[3] and q1[0]..q1[3]. all indices
+	should be multiplies by polestep == 1 for vertical bezier
+	curves in patch and == 4 for horizontal bezier curves due
+	to C's multi-dimensional matrix memory layout.
+	*/
+
+	float x12 = (pole[1 * polestep].x + pole[2 * polestep].x) * 0.5f;
+	float y12 = (pole[1 * polestep].y + pole[2 * polestep].y) * 0.5f;
+
+	q0[1 * polestep].x = (pole[0 * polestep].x + pole[1 * polestep].x) * 0.5f;
+	q0[1 * polestep].y = (pole[0 * polestep].y + pole[1 * polestep].y) * 0.5f;
+	q1[2 * polestep].x = (pole[2 * polestep].x + pole[3 * polestep].x) * 0.5f;
+	q1[2 * polestep].y = (pole[2 * polestep].y + pole[3 * polestep].y) * 0.5f;
+
+	q0[2 * polestep].x = (q0[1 * polestep].x + x12) * 0.5f;
+	q0[2 * polestep].y = (q0[1 * polestep].y + y12) * 0.5f;
+	q1[1 * polestep].x = (x12 + q1[2 * polestep].x) * 0.5f;
+	q1[1 * polestep].y = (y12 + q1[2 * polestep].y) * 0.5f;
+
+	q0[3 * polestep].x = (q0[2 * polestep].x + q1[1 * polestep].x) * 0.5f;
+	q0[3 * polestep].y = (q0[2 * polestep].y + q1[1 * polestep].y) * 0.5f;
+	q1[0 * polestep].x = (q0[2 * polestep].x + q1[1 * polestep].x) * 0.5f;
+	q1[0 * polestep].y = (q0[2 * polestep].y + q1[1 * polestep].y) * 0.5f;
+
+	q0[0 * polestep].x = pole[0 * polestep].x;
+	q0[0 * polestep].y = pole[0 * polestep].y;
+	q1[3 * polestep].x = pole[3 * polestep].x;
+	q1[3 * polestep].y = pole[3 * polestep].y;
+}
+
+static void
+split_stripe(fz_tensor_patch *p, fz_tensor_patch *s0, fz_tensor_patch *s1, int n)
+{
+	/*
+	split all horizontal bezier curves in patch,
+	creating two new patches with half the width.
+	*/
+	split_curve(&p->pole[0][0], &s0->pole[0][0], &s1->pole[0][0], 4);
+	split_curve(&p->pole[0][1], &s0->pole[0][1], &s1->pole[0][1], 4);
+	split_curve(&p->pole[0][2], &s0->pole[0][2], &s1->pole[0][2], 4);
+	split_curve(&p->pole[0][3], &s0->pole[0][3], &s1->pole[0][3], 4);
+
+	/* interpolate the colors for the two new patches. */
+	memcpy(s0->color[0], p->color[0], n * sizeof(float));
+	memcpy(s0->color[1], p->color[1], n * sizeof(float));
+	midcolor(s0->color[2], p->color[1], p->color[2], n);
+	midcolor(s0->color[3], p->color[0], p->color[3], n);
+
+	memcpy(s1->color[0], s0->color[3], n * sizeof(float));
+	memcpy(s1->color[1], s0->color[2], n * sizeof(float));
+	memcpy(s1->color[2], p->color[2], n * sizeof(float));
+	memcpy(s1->color[3], p->color[3], n * sizeof(float));
+}
+
+static void
+draw_stripe(fz_mesh_processor *painter, fz_tensor_patch *p, int depth)
+{
+	fz_tensor_patch s0, s1;
+
+	/* split patch into two half-height patches */
+	split_stripe(p, &s0, &s1, painter->ncomp);
+
+	depth--;
+	if (depth == 0)
+	{
+		/* if no more subdividing, draw two new patches... */
+		triangulate_patch(painter, &s1);
+		triangulate_patch(painter, &s0);
+	}
+	else
+	{
+		/* ...otherwise, continue subdividing. */
+		draw_stripe(painter, &s1, depth);
+		draw_stripe(painter, &s0, depth);
+	}
+}
+
+static void
+split_patch(fz_tensor_patch *p, fz_tensor_patch *s0, fz_tensor_patch *s1, int n)
+{
+	/*
+	split all vertical bezier curves in patch,
+	creating two new patches with half the height.
+	*/
+	split_curve(p->pole[0], s0->pole[0], s1->pole[0], 1);
+	split_curve(p->pole[1], s0->pole[1], s1->pole[1], 1);
+	split_curve(p->pole[2], s0->pole[2], s1->pole[2], 1);
+	split_curve(p->pole[3], s0->pole[3], s1->pole[3], 1);
+
+	/* interpolate the colors for the two new patches. */
+	memcpy(s0->color[0], p->color[0], n * sizeof(float));
+	midcolor(s0->color[1], p->color[0], p->color[1], n);
+	midcolor(s0->color[2], p->color[2], p->color[3], n);
+	memcpy(s0->color[3], p->color[3], n * sizeof(float));
+
+	memcpy(s1->color[0], s0->color[1], n * sizeof(float));
+	memcpy(s1->color[1], p->color[1], n * sizeof(float));
+	memcpy(s1->color[2], p->color[2], n * sizeof(float));
+	memcpy(s1->color[3], s0->color[2], n * sizeof(float));
+}
+
+static void
+draw_patch(fz_mesh_processor *painter, fz_tensor_patch *p, int depth, int origdepth)
+{
+	fz_tensor_patch s0, s1;
+
+	/* split patch into two half-width patches */
+	split_patch(p, &s0, &s1, painter->ncomp);
+
+	depth--;
+	if (depth == 0)
+	{
+		/* if no more subdividing, draw two new patches... */
+		draw_stripe(painter, &s0, origdepth);
+		draw_stripe(painter, &s1, origdepth);
+	}
+	else
+	{
+		/* ...otherwise, continue subdividing. */
+		draw_patch(painter, &s0, depth, origdepth);
+		draw_patch(painter, &s1, depth, origdepth);
+	}
+}
+
+/*
+ * The poles have already been transformed to device space, so the number
+ * of levels to subdivide can follow how large the patch ends up on the
+ * output. Tiny patches (as found in dense scientific meshes) become a
+ * couple of triangles each, while large patches get smooth curved edges.
+ * Patches whose control hull misses the clip are skipped entirely.
+ */
+static void
+paint_patch(fz_mesh_processor *painter, fz_tensor_patch *p)
+{
+	float x0, y0, x1, y1, size;
+	int depth, i, k;
+
+	x0 = x1 = p->pole[0][0].x;
+	y0 = y1 = p->pole[0][0].y;
+	for (i = 0; i < 4; i++)
+	{
+		for (k = 0; k < 4; k++)
+		{
+			if (p->pole[i][k].x < x0) x0 = p->pole[i][k].x;
+			if (p->pole[i][k].x > x1) x1 = p->pole[i][k].x;
+			if (p->pole[i][k].y < y0) y0 = p->pole[i][k].y;
+			if (p->pole[i][k].y > y1) y1 = p->pole[i][k].y;
+		}
+	}
+
+	if (painter->bounds)
+	{
+		add_point_to_rect(painter->bounds, x0, y0);
+		add_point_to_rect(painter->bounds, x1, y1);
+		return;
+	}
+
+	if (rect_outside_clip(&painter->clip, x0, y0, x1, y1))
+		return;
+
+	size = fz_max(x1 - x0, y1 - y0) / 2;
+	depth = 1;
+	while (size > PATCHSIZE && depth < MAXSUBDIV)
+	{
+		size /= 2;
+		depth++;
+	}
+
+	draw_patch(painter, p, depth, depth);
+}
+
+static fz_point
+compute_tensor_interior(
+	fz_point a, fz_point b, fz_point c, fz_point d,
+	fz_point e, fz_point f, fz_point g, fz_point h)
+{
+	fz_point pt;
+
+	/* see equations at page 330 in pdf 1.7 */
+
+	pt.x = -4 * a.x;
+	pt.x += 6 * (b.x + c.x);
+	pt.x += -2 * (d.x + e.x);
+	pt.x += 3 * (f.x + g.x);
+	pt.x += -1 * h.x;
+	pt.x /= 9;
+
+	pt.y = -4 * a.y;
+	pt.y += 6 * (b.y + c.y);
+	pt.y += -2 * (d.y + e.y);
+	pt.y += 3 * (f.y + g.y);
+	pt.y += -1 * h.y;
+	pt.y /= 9;
+
+	return pt;
+}
+
+static void
+make_tensor_patch(fz_tensor_patch *p, int type, fz_point *pt)
+{
+	if (type == 6)
+	{
+		/* see control point stream order at page 325 in pdf 1.7 */
+
+		p->pole[0][0] = pt[0];
+		p->pole[0][1] = pt[1];
+		p->pole[0][2] = pt[2];
+		p->pole[0][3] = pt[3];
+		p->pole[1][3] = pt[4];
+		p->pole[2][3] = pt[5];
+		p->pole[3][3] = pt[6];
+		p->pole[3][2] = pt[7];
+		p->pole[3][1] = pt[8];
+		p->pole[3][0] = pt[9];
+		p->pole[2][0] = pt[10];
+		p->pole[1][0] = pt[11];
+
+		/* see equations at page 330 in pdf 1.7 */
+
+		p->pole[1][1] = compute_tensor_interior(
+			p->pole[0][0], p->pole[0][1], p->pole[1][0], p->pole[0][3],
+			p->pole[3][0], p->pole[3][1], p->pole[1][3], p->pole[3][3]);
+
+		p->pole[1][2] = compute_tensor_interior(
+			p->pole[0][3], p->pole[0][2], p->pole[1][3], p->pole[0][0],
+			p->pole[3][3], p->pole[3][2], p->pole[1][0], p->pole[3][0]);
+
+		p->pole[2][1] = compute_tensor_interior(
+			p->pole[3][0], p->pole[3][1], p->pole[2][0], p->pole[3][3],
+			p->pole[0][0], p->pole[0][1], p->pole[2][3], p->pole[0][3]);
+
+		p->pole[2][2] = compute_tensor_interior(
+			p->pole[3][3], p->pole[3][2], p->pole[2][3], p->pole[3][0],
+			p->pole[0][3], p->pole[0][2], p->pole[2][0], p->pole[0][0]);
+	}
+	else if (type == 7)
+	{
+		/* see control point stream order at page 330 in pdf 1.7 */
+
+		p->pole[0][0] = pt[0];
+		p->pole[0][1] = pt[1];
+		p->pole[0][2] = pt[2];
+		p->pole[0][3] = pt[3];
+		p->pole[1][3] = pt[4];
+		p->pole[2][3] = pt[5];
+		p->pole[3][3] = pt[6];
+		p->pole[3][2] = pt[7];
+		p->pole[3][1] = pt[8];
+		p->pole[3][0] = pt[9];
+		p->pole[2][0] = pt[10];
+		p->pole[1][0] = pt[11];
+		p->pole[1][1] = pt[12];
+		p->pole[1][2] = pt[13];
+		p->pole[2][2] = pt[14];
+		p->pole[2][1] = pt[15];
+	}
+}
+
+/* Decode the packed vertex data of type 4-7 meshes */
+
+static inline float read_sample(fz_stream *stream, int bits, float min, float max)
+{
+	/* we use pow(2,x) because (1<<x) would overflow the math on 32-bit samples */
+	float bitscale = 1 / (powf(2, bits) - 1);
+	return min + fz_read_bits(stream, bits) * (max - min) * bitscale;
+}
+
+static void
+read_vertex(fz_mesh_processor *painter, fz_stream *stream, fz_vertex *v)
+{
+	fz_shade *shade = painter->shade;
+	int i;
+
+	v->x = read_sample(stream, shade->mesh_params.bpcoord, shade->mesh_params.x0, shade->mesh_params.x1);
+	v->y = read_sample(stream, shade->mesh_params.bpcoord, shade->mesh_params.y0, shade->mesh_params.y1);
+	for (i = 0; i < painter->ncomp; i++)
+		v->c[i] = read_sample(stream, shade->mesh_params.bpcomp, shade->mesh_params.c0[i], shade->mesh_params.c1[i]);
+	transform_vertex(painter, v);
+}
+
+static void
+fz_process_mesh_type4(fz_mesh_processor *painter, fz_stream *stream)
+{
+	int bpflag = painter->shade->mesh_params.bpflag;
+	fz_vertex va, vb, vc, vd;
+	int flag;
+
+	while (!fz_is_eof_bits(stream))
+	{
+		flag = fz_read_bits(stream, bpflag);
+		read_vertex(painter, stream, &vd);
+
+		switch (flag)
+		{
+		case 0: /* start new triangle */
+			va = vd;
+
+			fz_read_bits(stream, bpflag);
+			read_vertex(painter, stream, &vb);
+
+			fz_read_bits(stream, bpflag);
+			read_vertex(painter, stream, &vc);
+
+			paint_tri(painter, &va, &vb, &vc);
+			break;
+
+		case 1: /* Vb, Vc, Vd */
+			va = vb;
+			vb = vc;
+			vc = vd;
+			paint_tri(painter, &va, &vb, &vc);
+			break;
+
+		case 2: /* Va, Vc, Vd */
+			vb = vc;
+			vc = vd;
+			paint_tri(painter, &va, &vb, &vc);
+			break;
+		}
+	}
+}
+
+static void
+fz_process_mesh_type5(fz_mesh_processor *painter, fz_stream *stream)
+{
+	fz_context *ctx = painter->ctx;
+	int vprow = painter->shade->mesh_params.vprow;
+	fz_vertex *buf = NULL;
+	fz_vertex *ref = NULL;
+	fz_vertex *tmp;
+	int first;
+	int i;
+
+	fz_var(buf);
+	fz_var(ref);
+
+	fz_try(ctx)
+	{
+		ref = fz_malloc_array(ctx, vprow, sizeof(fz_vertex));
+		buf = fz_malloc_array(ctx, vprow, sizeof(fz_vertex));
+		first = 1;
+
+		while (!fz_is_eof_bits(stream))
+		{
+			for (i = 0; i < vprow; i++)
+				read_vertex(painter, stream, &buf[i]);
+
+			if (!first)
+				for (i = 0; i < vprow - 1; i++)
+					paint_quad(painter, &ref[i], &ref[i+1], &buf[i+1], &buf[i]);
+
+			tmp = ref;
+			ref = buf;
+			buf = tmp;
+			first = 0;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, ref);
+		fz_free(ctx, buf);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+/* Types 6 and 7 only differ in the number of control points in the stream */
+
+static void
+fz_process_mesh_type6_or_7(fz_mesh_processor *painter, fz_stream *stream, int type)
+{
+	fz_shade *shade = painter->shade;
+	int npoles = type == 6 ? 12 : 16;
+	int ncomp = painter->ncomp;
+	int haspatch, hasprevpatch;
+	float prevc[4][FZ_MAX_COLORS];
+	fz_point prevp[16];
+	int i, k;
+
+	hasprevpatch = 0;
+
+	while (!fz_is_eof_bits(stream))
+	{
+		float c[4][FZ_MAX_COLORS];
+		fz_point v[16];
+		int startcolor;
+		int startpt;
+		int flag;
+
+		flag = fz_read_bits(stream, shade->mesh_params.bpflag);
+
+		if (flag == 0)
+		{
+			startpt = 0;
+			startcolor = 0;
+		}
+		else
+		{
+			startpt = 4;
+			startcolor = 2;
+		}
+
+		for (i = startpt; i < npoles; i++)
+		{
+			v[i].x = read_sample(stream, shade->mesh_params.bpcoord, shade->mesh_params.x0, shade->mesh_params.x1);
+			v[i].y = read_sample(stream, shade->mesh_params.bpcoord, shade->mesh_params.y0, shade->mesh_params.y1);
+			v[i] = fz_transform_point(painter->ctm, v[i]);
+		}
+
+		for (i = startcolor; i < 4; i++)
+		{
+			for (k = 0; k < ncomp; k++)
+				c[i][k] = read_sample(stream, shade->mesh_params.bpcomp, shade->mesh_params.c0[k], shade->mesh_params.c1[k]);
+		}
+
+		haspatch = 0;
+
+		if (flag == 0)
+		{
+			haspatch = 1;
+		}
+		else if (flag == 1 && hasprevpatch)
+		{
+			v[0] = prevp[3];
+			v[1] = prevp[4];
+			v[2] = prevp[5];
+			v[3] = prevp[6];
+			memcpy(c[0], prevc[1], ncomp * sizeof(float));
+			memcpy(c[1], prevc[2], ncomp * sizeof(float));
+
+			haspatch = 1;
+		}
+		else if (flag == 2 && hasprevpatch)
+		{
+			v[0] = prevp[6];
+			v[1] = prevp[7];
+			v[2] = prevp[8];
+			v[3] = prevp[9];
+			memcpy(c[0], prevc[2], ncomp * sizeof(float));
+			memcpy(c[1], prevc[3], ncomp * sizeof(float));
+
+			haspatch = 1;
+		}
+		else if (flag == 3 && hasprevpatch)
+		{
+			v[0] = prevp[ 9];
+			v[1] = prevp[10];
+			v[2] = prevp[11];
+			v[3] = prevp[ 0];
+			memcpy(c[0], prevc[3], ncomp * sizeof(float));
+			memcpy(c[1], prevc[0], ncomp * sizeof(float));
+
+			haspatch = 1;
+		}
+
+		if (haspatch)
+		{
+			fz_tensor_patch patch;
+
+			make_tensor_patch(&patch, type, v);
+
+			for (i = 0; i < 4; i++)
+				memcpy(patch.color[i], c[i], ncomp * sizeof(float));
+
+			paint_patch(painter, &patch);
+
+			for (i = 0; i < npoles; i++)
+				prevp[i] = v[i];
+
+			for (i = 0; i < 4; i++)
+				memcpy(prevc[i], c[i], ncomp * sizeof(float));
+
+			hasprevpatch = 1;
+		}
+	}
+}
+
+static void
+fz_process_mesh_imp(fz_mesh_processor *painter)
+{
+	fz_context *ctx = painter->ctx;
+	fz_shade *shade = painter->shade;
+	fz_stream *stream;
+
+	stream = fz_open_buffer(ctx, shade->buffer);
+
+	fz_try(ctx)
+	{
+		switch (shade->type)
+		{
+		case FZ_MESH_TYPE4: fz_process_mesh_type4(painter, stream); break;
+		case FZ_MESH_TYPE5: fz_process_mesh_type5(painter, stream); break;
+		case FZ_MESH_TYPE6: fz_process_mesh_type6_or_7(painter, stream, 6); break;
+		case FZ_MESH_TYPE7: fz_process_mesh_type6_or_7(painter, stream, 7); break;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_close(stream);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+void
+fz_process_mesh(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_rect clip,
+	fz_mesh_process_fn *process, void *process_arg)
+{
+	fz_mesh_processor painter;
+
+	if (shade->type < FZ_MESH_TYPE4 || shade->buffer == NULL)
+		return;
+
+	painter.ctx = ctx;
+	painter.shade = shade;
+	painter.ctm = ctm;
+	painter.clip = clip;
+	painter.bounds = NULL;
+	painter.process = process;
+	painter.process_arg = process_arg;
+	painter.ncomp = shade->use_function ? 1 : shade->colorspace->n;
+
+	fz_process_mesh_imp(&painter);
+}
+
+/*
+ * Bounds of the vertices and patch control points of a packed mesh in
+ * shading space. Since patches lie within the convex hull of their control
+ * points this is never smaller than what gets drawn.
+ */
+fz_rect
+fz_bound_mesh(fz_context *ctx, fz_shade *shade)
+{
+	fz_mesh_processor painter;
+	fz_rect bounds;
+
+	if (shade->type < FZ_MESH_TYPE4 || shade->buffer == NULL)
+		return fz_empty_rect;
+
+	bounds.x0 = bounds.y0 = FLT_MAX;
+	bounds.x1 = bounds.y1 = -FLT_MAX;
+
+	painter.ctx = ctx;
+	painter.shade = shade;
+	painter.ctm = fz_identity;
+	painter.clip = fz_infinite_rect;
+	painter.bounds = &bounds;
+	painter.process = NULL;
+	painter.process_arg = NULL;
+	painter.ncomp = shade->use_function ? 1 : shade->colorspace->n;
+
+	fz_process_mesh_imp(&painter);
+
+	if (bounds.x0 > bounds.x1 || bounds.y0 > bounds.y1)
+		return fz_empty_rect;
+	return bounds;
+}
+
 fz_shade *
 fz_keep_shade(fz_context *ctx, fz_shade *shade)
 {
@@ -14,6 +698,7 @@ fz_free_shade_imp(fz_context *ctx, fz_storable *shade_)
 	if (shade->colorspace)
 		fz_drop_colorspace(ctx, shade->colorspace);
 	fz_free(ctx, shade->mesh);
+	fz_drop_buffer(ctx, shade->buffer);
 	fz_free(ctx, shade);
 }
 
@@ -23,6 +708,18 @@ fz_drop_shade(fz_context *ctx, fz_shade *shade)
 	fz_drop_storable(ctx, &shade->storable);
 }
 
+unsigned int
+fz_shade_size(fz_shade *s)
+{
+	unsigned int size;
+	if (s == NULL)
+		return 0;
+	size = sizeof(*s) + s->mesh_cap * sizeof(*s->mesh) + s->colorspace->size;
+	if (s->buffer)
+		size += s->buffer->cap;
+	return size;
+}
+
 fz_rect
 fz_bound_shade(fz_context *ctx, fz_shade *shade, fz_matrix ctm)
 {
@@ -42,6 +739,10 @@ fz_bound_shade(fz_context *ctx, fz_shade *shade, fz_matrix ctm)
 	if (shade->type == FZ_RADIAL)
 		return fz_intersect_rect(s, fz_infinite_rect);
 
+	/* packed meshes have their vertex bounds folded into bbox when loaded */
+	if (shade->type >= FZ_MESH_TYPE4)
+		return s;
+
 	if (nvert == 0)
 		return fz_empty_rect;
 
@@ -82,6 +783,10 @@ fz_print_shade(fz_context *ctx, FILE *out, fz_shade *shade)
 	case FZ_LINEAR: fprintf(out, "\ttype linear\n"); break;
 	case FZ_RADIAL: fprintf(out, "\ttype radial\n"); break;
 	case FZ_MESH: fprintf(out, "\ttype mesh\n"); break;
+	case FZ_MESH_TYPE4: fprintf(out, "\ttype free-form triangle mesh\n"); break;
+	case FZ_MESH_TYPE5: fprintf(out, "\ttype lattice-form triangle mesh\n"); break;
+	case FZ_MESH_TYPE6: fprintf(out, "\ttype coons patch mesh\n"); break;
+	case FZ_MESH_TYPE7: fprintf(out, "\ttype tensor-product patch mesh\n"); break;
 	}
 
 	fprintf(out, "\tbbox [%g %g %g %g]\n",
@@ -110,6 +815,9 @@ fz_print_shade(fz_context *ctx, FILE *out, fz_shade *shade)
 	else
 		n = 2 + shade->colorspace->n;
 
+	if (shade->buffer)
+		fprintf(out, "\tpacked mesh data: %d bytes\n", shade->buffer->len);
+
 	fprintf(out, "\tvertices: %d\n", shade->mesh_len);
 
 	vertex = shade->mesh;
@@ -21,6 +21,7 @@ fz_new_buffer(fz_context *ctx, int size)
 	b->cap = size;
 	b->len = 0;
 	b->unused_bits = 0;
+	b->mapped = NULL;
 
 	return b;
 }
@@ -45,7 +46,10 @@ fz_drop_buffer(fz_context *ctx, fz_buffer *buf)
 		return;
 	if (--buf->refs == 0)
 	{
-		fz_free(ctx, buf->data);
+		if (buf->mapped)
+			fz_drop_mapped_file(ctx, buf->mapped);
+		else
+			fz_free(ctx, buf->data);
 		fz_free(ctx, buf);
 	}
 }
@@ -53,7 +57,17 @@ fz_drop_buffer(fz_context *ctx, fz_buffer *buf)
 void
 fz_resize_buffer(fz_context *ctx, fz_buffer *buf, int size)
 {
-	buf->data = fz_resize_array(ctx, buf->data, size, 1);
+	if (buf->mapped)
+	{
+		/* Copy a view out of its mapping before changing it */
+		unsigned char *data = fz_malloc(ctx, size);
+		memcpy(data, buf->data, fz_mini(buf->len, size));
+		fz_drop_mapped_file(ctx, buf->mapped);
+		buf->mapped = NULL;
+		buf->data = data;
+	}
+	else
+		buf->data = fz_resize_array(ctx, buf->data, size, 1);
 	buf->cap = size;
 	if (buf->len > buf->cap)
 		buf->len = buf->cap;
@@ -102,7 +116,7 @@ void fz_write_buffer(fz_context *ctx, fz_buffer *buf, unsigned char *data, int l
 
 void fz_write_buffer_byte(fz_context *ctx, fz_buffer *buf, int val)
 {
-	if (buf->len > buf->cap)
+	if (buf->len >= buf->cap)
 		fz_grow_buffer(ctx, buf);
 	buf->data[buf->len++] = val;
 	buf->unused_bits = 0;
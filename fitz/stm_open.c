@@ -1,5 +1,14 @@
 #include "fitz-internal.h"
 
+#if !defined(HAVE_MMAP) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define HAVE_MMAP
+#endif
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 fz_stream *
 fz_new_stream(fz_context *ctx, void *state,
 	int(*read)(fz_stream *stm, unsigned char *buf, int len),
@@ -207,3 +216,147 @@ fz_open_memory(fz_context *ctx, unsigned char *data, int len)
 
 	return stm;
 }
+
+/* Memory mapped file stream */
+
+#ifdef HAVE_MMAP
+
+#define MAPPED_PREFETCH (256 << 10)
+
+/* Shared by the stream and any buffer views of it */
+struct fz_mapped_file_s
+{
+	int refs;
+	unsigned char *data;
+	size_t len;
+};
+
+static void close_mapped(fz_context *ctx, void *state)
+{
+	fz_drop_mapped_file(ctx, state);
+}
+
+#endif
+
+void
+fz_drop_mapped_file(fz_context *ctx, fz_mapped_file *map)
+{
+#ifdef HAVE_MMAP
+	int drop;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	drop = --map->refs == 0;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (!drop)
+		return;
+	if (munmap(map->data, map->len) < 0)
+		fz_warn(ctx, "munmap error: %s", strerror(errno));
+	fz_free(ctx, map);
+#endif
+}
+
+fz_buffer *
+fz_new_buffer_view(fz_stream *stm, int offset, int len)
+{
+#ifdef HAVE_MMAP
+	fz_context *ctx = stm->ctx;
+	fz_mapped_file *map;
+	fz_buffer *buf;
+
+	if (stm->close != close_mapped || offset < 0 || len <= 0)
+		return NULL;
+	map = stm->state;
+	if ((size_t)offset > map->len || (size_t)len > map->len - offset)
+		return NULL;
+
+	buf = fz_malloc_struct(ctx, fz_buffer);
+	buf->refs = 1;
+	buf->data = map->data + offset;
+	buf->cap = len;
+	buf->len = len;
+	buf->unused_bits = 0;
+	buf->mapped = map;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	map->refs++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return buf;
+#else
+	return NULL;
+#endif
+}
+
+fz_stream *
+fz_open_mapped_file(fz_context *ctx, const char *name)
+{
+#ifdef HAVE_MMAP
+	fz_mapped_file *state;
+	struct stat st;
+	fz_stream *stm;
+	void *data;
+	int fd;
+
+	fd = open(name, O_BINARY | O_RDONLY, 0);
+	if (fd == -1)
+		fz_throw(ctx, "cannot open %s", name);
+
+	/* Read files we cannot map, or that are too large to address */
+	if (fstat(fd, &st) < 0 || st.st_size <= 0 || st.st_size > INT_MAX)
+		return fz_open_fd(ctx, fd);
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return fz_open_fd(ctx, fd);
+	close(fd);
+
+	fz_try(ctx)
+	{
+		state = fz_malloc_struct(ctx, fz_mapped_file);
+	}
+	fz_catch(ctx)
+	{
+		munmap(data, st.st_size);
+		fz_rethrow(ctx);
+	}
+	state->refs = 1;
+	state->data = data;
+	state->len = st.st_size;
+
+	stm = fz_new_stream(ctx, state, read_buffer, close_mapped);
+	stm->seek = seek_buffer;
+
+	stm->bp = state->data;
+	stm->rp = state->data;
+	stm->wp = state->data + state->len;
+	stm->ep = state->data + state->len;
+
+	stm->pos = state->len;
+
+	return stm;
+#else
+	return fz_open_file(ctx, name);
+#endif
+}
+
+void
+fz_will_read(fz_stream *stm, int offset, int len)
+{
+#ifdef HAVE_MMAP
+	fz_mapped_file *state;
+	size_t start, end, page;
+
+	if (stm->close != close_mapped || offset < 0 || len <= 0)
+		return;
+	state = stm->state;
+	if ((size_t)offset >= state->len)
+		return;
+
+	page = sysconf(_SC_PAGESIZE);
+	start = offset & ~(page - 1);
+	end = fz_mini(len, state->len - offset) + offset;
+	madvise(state->data + start, end - start, MADV_SEQUENTIAL);
+	if (end - start > MAPPED_PREFETCH)
+		end = start + MAPPED_PREFETCH;
+	madvise(state->data + start, end - start, MADV_WILLNEED);
+#endif
+}
@@ -180,6 +180,16 @@ struct pdf_ocg_descriptor_s
 	pdf_obj *intent;
 };
 
+typedef struct pdf_page_node_s pdf_page_node;
+
+struct pdf_page_node_s
+{
+	pdf_obj *node;
+	int first;
+	int count;
+	int leaves; /* leading kids checked to be pages, or -1 once one is not */
+};
+
 struct pdf_document_s
 {
 	fz_document super;
@@ -202,6 +212,11 @@ struct pdf_document_s
 	pdf_obj **page_objs;
 	pdf_obj **page_refs;
 
+	/* last path taken down the page tree; page_path[0] is the root */
+	int page_depth;
+	int page_path_cap;
+	pdf_page_node *page_path;
+
 	pdf_lexbuf_large lexbuf;
 };
 
@@ -210,6 +225,8 @@ pdf_document *pdf_open_document_no_run_with_stream(fz_stream *file);
 
 void pdf_cache_object(pdf_document *doc, int num, int gen);
 
+void pdf_drop_page_tree(pdf_document *doc);
+
 fz_stream *pdf_open_inline_stream(pdf_document *doc, pdf_obj *stmobj, int length, fz_stream *chain, pdf_image_params *params);
 fz_buffer *pdf_load_image_stream(pdf_document *doc, int num, int gen, int orig_num, int orig_gen, pdf_image_params *params);
 fz_stream *pdf_open_image_stream(pdf_document *doc, int num, int gen, int orig_num, int orig_gen, pdf_image_params *params);
@@ -360,6 +377,19 @@ struct pdf_cmap_s
 
 	int tlen, tcap;
 	unsigned short *table;
+
+	/* Lookup accelerators built by pdf_sort_cmap and pdf_set_usecmap.
+	 * decode_len gives the code length for each leading byte (0 if it
+	 * depends on the following bytes). flat is a two-level table for
+	 * 16-bit codes with usecmap folded in: 256 page indices followed by
+	 * pages of 256 entries, page 0 being unmapped (0xffff). */
+	unsigned char decode_len[256];
+	int identity;
+	int flen;
+	unsigned short *flat;
+
+	/* Binary cmaps point ranges and table into this buffer */
+	fz_buffer *data;
 };
 
 pdf_cmap *pdf_new_cmap(fz_context *ctx);
@@ -388,6 +418,21 @@ pdf_cmap *pdf_load_system_cmap(fz_context *ctx, char *name);
 pdf_cmap *pdf_load_builtin_cmap(fz_context *ctx, char *name);
 pdf_cmap *pdf_load_embedded_cmap(pdf_document *doc, pdf_obj *ref);
 
+/*
+	pdf_new_binary_cmap: Serialise a sorted cmap into the binary cmap
+	format: a fixed header followed by the ranges and table arrays,
+	exactly as they are laid out in memory (native byte order).
+*/
+fz_buffer *pdf_new_binary_cmap(fz_context *ctx, pdf_cmap *cmap);
+
+/*
+	pdf_load_binary_cmap: Create a cmap from a buffer written by
+	pdf_new_binary_cmap. The ranges and table are used in place; the
+	cmap takes a reference to the buffer, which must not be changed
+	afterwards. The returned cmap is read only.
+*/
+pdf_cmap *pdf_load_binary_cmap(fz_context *ctx, fz_buffer *buf);
+
 #ifndef NDEBUG
 void pdf_print_cmap(fz_context *ctx, pdf_cmap *cmap);
 #endif
@@ -424,6 +469,7 @@ extern const char * const pdf_standard[256];
 typedef struct pdf_font_desc_s pdf_font_desc;
 typedef struct pdf_hmtx_s pdf_hmtx;
 typedef struct pdf_vmtx_s pdf_vmtx;
+typedef struct pdf_cid_block_s pdf_cid_block;
 
 struct pdf_hmtx_s
 {
@@ -441,6 +487,12 @@ struct pdf_vmtx_s
 	short w;
 };
 
+struct pdf_cid_block_s
+{
+	unsigned short gid[256];
+	short w[256];
+};
+
 struct pdf_font_desc_s
 {
 	fz_storable storable;
@@ -479,6 +531,11 @@ struct pdf_font_desc_s
 	pdf_vmtx dvmtx;
 	pdf_vmtx *vmtx;
 
+	/* Gids and horizontal advances of the low cids, in blocks of 256
+	 * that are filled in when one of their cids is first shown */
+	int cid_table_len;
+	pdf_cid_block **cid_table;
+
 	int is_embedded;
 };
 
@@ -490,11 +547,13 @@ void pdf_add_vmtx(fz_context *ctx, pdf_font_desc *font, int lo, int hi, int x, i
 void pdf_end_hmtx(fz_context *ctx, pdf_font_desc *font);
 void pdf_end_vmtx(fz_context *ctx, pdf_font_desc *font);
 pdf_hmtx pdf_lookup_hmtx(fz_context *ctx, pdf_font_desc *font, int cid);
+pdf_hmtx pdf_search_hmtx(fz_context *ctx, pdf_font_desc *font, int cid);
 pdf_vmtx pdf_lookup_vmtx(fz_context *ctx, pdf_font_desc *font, int cid);
 
 void pdf_load_to_unicode(pdf_document *doc, pdf_font_desc *font, char **strings, char *collection, pdf_obj *cmapstm);
 
 int pdf_font_cid_to_gid(fz_context *ctx, pdf_font_desc *fontdesc, int cid);
+pdf_cid_block *pdf_load_cid_block(fz_context *ctx, pdf_font_desc *fontdesc, int cid);
 
 unsigned char *pdf_lookup_builtin_font(char *name, unsigned int *len);
 unsigned char *pdf_lookup_substitute_font(int mono, int serif, int bold, int italic, unsigned int *len);
@@ -26,6 +26,11 @@
 #define pdf_range_set_flags(r, f) \
 	((r)->extent_flags = (((r)->extent_flags & ~3) | f))
 
+/* Largest number of 256 entry pages we allow in a flat lookup table */
+#define PDF_CMAP_FLAT_PAGES 64
+
+static void pdf_compile_cmap(fz_context *ctx, pdf_cmap *cmap);
+
 /*
  * Allocate, destroy and simple parameters.
  */
@@ -36,8 +41,14 @@ pdf_free_cmap_imp(fz_context *ctx, fz_storable *cmap_)
 	pdf_cmap *cmap = (pdf_cmap *)cmap_;
 	if (cmap->usecmap)
 		pdf_drop_cmap(ctx, cmap->usecmap);
-	fz_free(ctx, cmap->ranges);
-	fz_free(ctx, cmap->table);
+	if (cmap->data)
+		fz_drop_buffer(ctx, cmap->data);
+	else
+	{
+		fz_free(ctx, cmap->ranges);
+		fz_free(ctx, cmap->table);
+	}
+	fz_free(ctx, cmap->flat);
 	fz_free(ctx, cmap);
 }
 
@@ -63,6 +74,12 @@ pdf_new_cmap(fz_context *ctx)
 	cmap->tcap = 0;
 	cmap->table = NULL;
 
+	cmap->identity = 0;
+	cmap->flen = 0;
+	cmap->flat = NULL;
+
+	cmap->data = NULL;
+
 	return cmap;
 }
 
@@ -95,6 +112,8 @@ pdf_set_usecmap(fz_context *ctx, pdf_cmap *cmap, pdf_cmap *usecmap)
 		for (i = 0; i < usecmap->codespace_len; i++)
 			cmap->codespace[i] = usecmap->codespace[i];
 	}
+
+	pdf_compile_cmap(ctx, cmap);
 }
 
 int
@@ -317,6 +336,7 @@ pdf_sort_cmap(fz_context *ctx, pdf_cmap *cmap)
 	if (cmap->tlen >= USHRT_MAX + 1)
 	{
 		fz_warn(ctx, "cmap table is full; will not combine ranges");
+		pdf_compile_cmap(ctx, cmap);
 		return;
 	}
 
@@ -402,6 +422,254 @@ pdf_sort_cmap(fz_context *ctx, pdf_cmap *cmap)
 	}
 
 	cmap->rlen = a - cmap->ranges + 1;
+
+	pdf_compile_cmap(ctx, cmap);
+}
+
+/*
+ * Build the lookup accelerators once the ranges are final.
+ *
+ * Codes whose length is fixed by their leading byte get an entry in
+ * decode_len. Cmaps that map all 16-bit codes to themselves are flagged
+ * as identity. Other cmaps whose mappings (including those inherited
+ * from the usecmap chain) fit in a few pages of the 16-bit code space
+ * get a direct lookup table; the table stores exactly what the binary
+ * search would return, so one-to-many entries stay unmapped there.
+ *
+ * Builtin cmaps are static and shared, so they are left alone.
+ */
+static void
+pdf_compile_cmap(fz_context *ctx, pdf_cmap *cmap)
+{
+	unsigned char used[256];
+	unsigned short *flat;
+	pdf_cmap *c;
+	pdf_range *r;
+	int i, k, n, lo, hi, v;
+
+	if (cmap->storable.refs < 0)
+		return;
+
+	fz_free(ctx, cmap->flat);
+	cmap->flat = NULL;
+	cmap->flen = 0;
+	cmap->identity = 0;
+
+	for (i = 0; i < 256; i++)
+	{
+		cmap->decode_len[i] = 0;
+		for (k = 0; k < cmap->codespace_len; k++)
+		{
+			if (cmap->codespace[k].n == 1 && i >= cmap->codespace[k].low && i <= cmap->codespace[k].high)
+			{
+				cmap->decode_len[i] = 1;
+				break;
+			}
+		}
+		if (cmap->decode_len[i])
+			continue;
+		for (k = 0; k < cmap->codespace_len; k++)
+		{
+			if (cmap->codespace[k].n == 2 && (i << 8) >= cmap->codespace[k].low && ((i << 8) | 0xff) <= cmap->codespace[k].high)
+			{
+				cmap->decode_len[i] = 2;
+				break;
+			}
+		}
+	}
+
+	if (!cmap->usecmap && cmap->rlen > 0 && cmap->ranges[0].low == 0)
+	{
+		hi = -1;
+		for (i = 0; i < cmap->rlen; i++)
+		{
+			r = &cmap->ranges[i];
+			if (pdf_range_flags(r) != PDF_CMAP_SINGLE && pdf_range_flags(r) != PDF_CMAP_RANGE)
+				break;
+			if (r->offset != r->low || r->low > hi + 1)
+				break;
+			if (pdf_range_high(r) > hi)
+				hi = pdf_range_high(r);
+		}
+		if (i == cmap->rlen && hi >= 0xffff)
+		{
+			cmap->identity = 1;
+			return;
+		}
+	}
+
+	memset(used, 0, sizeof used);
+	n = 0;
+	for (c = cmap; c; c = c->usecmap)
+	{
+		for (i = 0; i < c->rlen; i++)
+		{
+			lo = c->ranges[i].low >> 8;
+			hi = fz_mini(pdf_range_high(&c->ranges[i]), 0xffff) >> 8;
+			for (k = lo; k <= hi; k++)
+			{
+				if (!used[k])
+				{
+					if (++n > PDF_CMAP_FLAT_PAGES)
+						return;
+					used[k] = 1;
+				}
+			}
+		}
+	}
+	if (n == 0)
+		return;
+
+	/* Fill from the binary search before installing the table */
+	flat = fz_malloc_array_no_throw(ctx, 256 + (n + 1) * 256, sizeof(unsigned short));
+	if (!flat)
+		return;
+
+	for (i = 0; i < 256; i++)
+		flat[256 + i] = 0xffff;
+	n = 0;
+	for (k = 0; k < 256; k++)
+	{
+		if (!used[k])
+		{
+			flat[k] = 0;
+			continue;
+		}
+		flat[k] = ++n;
+		for (i = 0; i < 256; i++)
+		{
+			v = pdf_lookup_cmap(cmap, (k << 8) | i);
+			if (v >= 0xffff)
+			{
+				fz_free(ctx, flat);
+				return;
+			}
+			flat[256 + (n << 8) + i] = v < 0 ? 0xffff : v;
+		}
+	}
+	cmap->flat = flat;
+	cmap->flen = 256 + (n + 1) * 256;
+}
+
+/*
+ * Binary cmaps.
+ *
+ * The header holds an 8 byte magic, the cmap and usecmap names (32 bytes
+ * each), five native ints (byte order mark, wmode, codespace_len, rlen
+ * and tlen) and the 40 codespace entries. The sorted ranges and the
+ * table follow as arrays of unsigned shorts.
+ */
+
+#define BINARY_MAGIC "MuCMap01"
+#define BINARY_BOM 0x01020304
+#define BINARY_INTS 72
+#define BINARY_CODESPACE (BINARY_INTS + 5 * sizeof(int))
+#define BINARY_HEADER (BINARY_CODESPACE + 40 * 3 * sizeof(unsigned short))
+
+fz_buffer *
+pdf_new_binary_cmap(fz_context *ctx, pdf_cmap *cmap)
+{
+	fz_buffer *buf;
+	unsigned char *p;
+	unsigned short cs[40 * 3];
+	int hdr[5];
+	int i, len;
+
+	len = BINARY_HEADER + cmap->rlen * sizeof(pdf_range) + cmap->tlen * sizeof(unsigned short);
+	buf = fz_new_buffer(ctx, len);
+	p = buf->data;
+	memset(p, 0, BINARY_HEADER);
+
+	memcpy(p, BINARY_MAGIC, 8);
+	memcpy(p + 8, cmap->cmap_name, sizeof cmap->cmap_name);
+	memcpy(p + 40, cmap->usecmap_name, sizeof cmap->usecmap_name);
+
+	hdr[0] = BINARY_BOM;
+	hdr[1] = cmap->wmode;
+	hdr[2] = cmap->codespace_len;
+	hdr[3] = cmap->rlen;
+	hdr[4] = cmap->tlen;
+	memcpy(p + BINARY_INTS, hdr, sizeof hdr);
+
+	memset(cs, 0, sizeof cs);
+	for (i = 0; i < cmap->codespace_len; i++)
+	{
+		cs[i * 3] = cmap->codespace[i].n;
+		cs[i * 3 + 1] = cmap->codespace[i].low;
+		cs[i * 3 + 2] = cmap->codespace[i].high;
+	}
+	memcpy(p + BINARY_CODESPACE, cs, sizeof cs);
+
+	p += BINARY_HEADER;
+	if (cmap->rlen)
+		memcpy(p, cmap->ranges, cmap->rlen * sizeof(pdf_range));
+	p += cmap->rlen * sizeof(pdf_range);
+	if (cmap->tlen)
+		memcpy(p, cmap->table, cmap->tlen * sizeof(unsigned short));
+
+	buf->len = len;
+	return buf;
+}
+
+pdf_cmap *
+pdf_load_binary_cmap(fz_context *ctx, fz_buffer *buf)
+{
+	pdf_cmap *cmap;
+	pdf_range *ranges, *r;
+	unsigned short *table;
+	unsigned short cs[40 * 3];
+	int hdr[5];
+	int i;
+
+	if (buf->len < BINARY_HEADER || memcmp(buf->data, BINARY_MAGIC, 8))
+		fz_throw(ctx, "not a binary cmap");
+	memcpy(hdr, buf->data + BINARY_INTS, sizeof hdr);
+	if (hdr[0] != BINARY_BOM)
+		fz_throw(ctx, "binary cmap has wrong byte order");
+	if (hdr[2] < 0 || hdr[2] > 40 || hdr[3] < 0 || hdr[4] < 0 || hdr[4] > USHRT_MAX + 1 ||
+		hdr[3] > (buf->len - BINARY_HEADER) / (int)sizeof(pdf_range) ||
+		buf->len - BINARY_HEADER - hdr[3] * (int)sizeof(pdf_range) < hdr[4] * (int)sizeof(unsigned short))
+		fz_throw(ctx, "binary cmap is truncated");
+
+	/* Make sure keeping the buffer cannot move its data */
+	fz_trim_buffer(ctx, buf);
+	ranges = (pdf_range *)(buf->data + BINARY_HEADER);
+	table = (unsigned short *)(ranges + hdr[3]);
+
+	for (i = 0; i < hdr[3]; i++)
+	{
+		r = &ranges[i];
+		if (pdf_range_flags(r) == PDF_CMAP_TABLE && r->offset + (r->extent_flags >> 2) >= hdr[4])
+			fz_throw(ctx, "binary cmap table range out of bounds");
+		if (pdf_range_flags(r) == PDF_CMAP_MULTI && (r->offset >= hdr[4] || r->offset + table[r->offset] >= hdr[4]))
+			fz_throw(ctx, "binary cmap multiple mapping out of bounds");
+	}
+
+	cmap = pdf_new_cmap(ctx);
+	memcpy(cmap->cmap_name, buf->data + 8, sizeof cmap->cmap_name);
+	cmap->cmap_name[sizeof cmap->cmap_name - 1] = 0;
+	memcpy(cmap->usecmap_name, buf->data + 40, sizeof cmap->usecmap_name);
+	cmap->usecmap_name[sizeof cmap->usecmap_name - 1] = 0;
+	cmap->wmode = hdr[1];
+
+	memcpy(cs, buf->data + BINARY_CODESPACE, sizeof cs);
+	cmap->codespace_len = hdr[2];
+	for (i = 0; i < cmap->codespace_len; i++)
+	{
+		cmap->codespace[i].n = cs[i * 3];
+		cmap->codespace[i].low = cs[i * 3 + 1];
+		cmap->codespace[i].high = cs[i * 3 + 2];
+	}
+
+	cmap->data = fz_keep_buffer(ctx, buf);
+	cmap->rlen = hdr[3];
+	cmap->ranges = ranges;
+	cmap->tlen = hdr[4];
+	cmap->table = table;
+
+	pdf_compile_cmap(ctx, cmap);
+
+	return cmap;
 }
 
 /*
@@ -414,6 +682,17 @@ pdf_lookup_cmap(pdf_cmap *cmap, int cpt)
 	int r = cmap->rlen - 1;
 	int m;
 
+	if (cpt >= 0 && cpt <= 0xffff)
+	{
+		if (cmap->identity)
+			return cpt;
+		if (cmap->flat)
+		{
+			m = cmap->flat[256 + (cmap->flat[cpt >> 8] << 8) + (cpt & 0xff)];
+			return m == 0xffff ? -1 : m;
+		}
+	}
+
 	while (l <= r)
 	{
 		m = (l + r) >> 1;
@@ -446,6 +725,25 @@ pdf_lookup_cmap_full(pdf_cmap *cmap, int cpt, int *out)
 	int r = cmap->rlen - 1;
 	int m;
 
+	/* One-to-many mappings are not in the flat table; search for those */
+	if (cpt >= 0 && cpt <= 0xffff)
+	{
+		if (cmap->identity)
+		{
+			out[0] = cpt;
+			return 1;
+		}
+		if (cmap->flat)
+		{
+			k = cmap->flat[256 + (cmap->flat[cpt >> 8] << 8) + (cpt & 0xff)];
+			if (k != 0xffff)
+			{
+				out[0] = k;
+				return 1;
+			}
+		}
+	}
+
 	while (l <= r)
 	{
 		m = (l + r) >> 1;
@@ -491,6 +789,16 @@ pdf_decode_cmap(pdf_cmap *cmap, unsigned char *buf, int *cpt)
 {
 	int k, n, c;
 
+	switch (cmap->decode_len[buf[0]])
+	{
+	case 1:
+		*cpt = buf[0];
+		return 1;
+	case 2:
+		*cpt = (buf[0] << 8) | buf[1];
+		return 2;
+	}
+
 	c = 0;
 	for (n = 0; n < 4; n++)
 	{
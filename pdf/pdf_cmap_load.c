@@ -9,9 +9,93 @@ pdf_cmap_size(fz_context *ctx, pdf_cmap *cmap)
 	if (cmap->storable.refs < 0)
 		return 0;
 
-	return cmap->rcap * sizeof(pdf_range) + cmap->tcap * sizeof(short) + pdf_cmap_size(ctx, cmap->usecmap);
+	/* A binary cmap's ranges and table live in its data buffer */
+	return cmap->rcap * sizeof(pdf_range) + cmap->tcap * sizeof(short) + cmap->flen * sizeof(short) + (cmap->data ? cmap->data->cap : 0) + pdf_cmap_size(ctx, cmap->usecmap);
 }
 
+/*
+ * Embedded CMaps are also stored keyed by a digest of their contents
+ * (and the WMode and UseCMap name from the stream dictionary), in the
+ * binary cmap format, so that the same CMap embedded in many fonts or
+ * documents is only parsed once.
+ */
+
+typedef struct pdf_cmap_key_s pdf_cmap_key;
+
+struct pdf_cmap_key_s
+{
+	int refs;
+	unsigned char digest[16];
+};
+
+static int
+pdf_make_hash_cmap_key(fz_store_hash *hash, void *key_)
+{
+	pdf_cmap_key *key = (pdf_cmap_key *)key_;
+
+	memcpy(&hash->u.i, key->digest, sizeof hash->u.i);
+	return 1;
+}
+
+static void *
+pdf_keep_cmap_key(fz_context *ctx, void *key_)
+{
+	pdf_cmap_key *key = (pdf_cmap_key *)key_;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	key->refs++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return (void *)key;
+}
+
+static void
+pdf_drop_cmap_key(fz_context *ctx, void *key_)
+{
+	pdf_cmap_key *key = (pdf_cmap_key *)key_;
+	int drop;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	drop = --key->refs;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (drop == 0)
+		fz_free(ctx, key);
+}
+
+static int
+pdf_cmp_cmap_key(void *k0_, void *k1_)
+{
+	pdf_cmap_key *k0 = (pdf_cmap_key *)k0_;
+	pdf_cmap_key *k1 = (pdf_cmap_key *)k1_;
+
+	return memcmp(k0->digest, k1->digest, sizeof k0->digest);
+}
+
+#ifndef NDEBUG
+static void
+pdf_debug_cmap_key(void *key_)
+{
+	pdf_cmap_key *key = (pdf_cmap_key *)key_;
+	int i;
+
+	printf("(cmap ");
+	for (i = 0; i < 16; i++)
+		printf("%02x", key->digest[i]);
+	printf(") ");
+}
+#endif
+
+static fz_store_type pdf_cmap_store_type =
+{
+	pdf_make_hash_cmap_key,
+	pdf_keep_cmap_key,
+	pdf_drop_cmap_key,
+	pdf_cmp_cmap_key,
+#ifndef NDEBUG
+	pdf_debug_cmap_key
+#endif
+};
+
 /*
  * Load CMap stream in PDF file
  */
@@ -19,17 +103,26 @@ pdf_cmap *
 pdf_load_embedded_cmap(pdf_document *xref, pdf_obj *stmobj)
 {
 	fz_stream *file = NULL;
+	fz_buffer *buf = NULL;
 	pdf_cmap *cmap = NULL;
+	pdf_cmap *parsed = NULL;
+	pdf_cmap *existing;
 	pdf_cmap *usecmap;
+	pdf_cmap_key *key = NULL;
 	pdf_obj *wmode;
 	pdf_obj *obj = NULL;
 	fz_context *ctx = xref->ctx;
+	fz_md5 md5;
+	int extra[2];
 	int phase = 0;
 
 	fz_var(phase);
 	fz_var(obj);
 	fz_var(file);
+	fz_var(buf);
 	fz_var(cmap);
+	fz_var(parsed);
+	fz_var(key);
 
 	if ((cmap = pdf_find_item(ctx, pdf_free_cmap_imp, stmobj)))
 	{
@@ -38,37 +131,83 @@ pdf_load_embedded_cmap(pdf_document *xref, pdf_obj *stmobj)
 
 	fz_try(ctx)
 	{
-		file = pdf_open_stream(xref, pdf_to_num(stmobj), pdf_to_gen(stmobj));
+		buf = pdf_load_stream(xref, pdf_to_num(stmobj), pdf_to_gen(stmobj));
 		phase = 1;
-		cmap = pdf_load_cmap(ctx, file);
-		phase = 2;
-		fz_close(file);
-		file = NULL;
 
 		wmode = pdf_dict_gets(stmobj, "WMode");
-		if (pdf_is_int(wmode))
-			pdf_set_cmap_wmode(ctx, cmap, pdf_to_int(wmode));
 		obj = pdf_dict_gets(stmobj, "UseCMap");
-		if (pdf_is_name(obj))
+
+		/* An indirect UseCMap has no stable name to key on */
+		if (!pdf_is_indirect(obj))
 		{
-			usecmap = pdf_load_system_cmap(ctx, pdf_to_name(obj));
-			pdf_set_usecmap(ctx, cmap, usecmap);
-			pdf_drop_cmap(ctx, usecmap);
+			key = fz_malloc_struct(ctx, pdf_cmap_key);
+			key->refs = 1;
+			fz_md5_init(&md5);
+			fz_md5_update(&md5, buf->data, buf->len);
+			extra[0] = pdf_is_int(wmode);
+			extra[1] = pdf_to_int(wmode);
+			fz_md5_update(&md5, (unsigned char *)extra, sizeof extra);
+			if (pdf_is_name(obj))
+				fz_md5_update(&md5, (unsigned char *)pdf_to_name(obj), strlen(pdf_to_name(obj)) + 1);
+			fz_md5_final(&md5, key->digest);
+
+			cmap = fz_find_item(ctx, pdf_free_cmap_imp, key, &pdf_cmap_store_type);
 		}
-		else if (pdf_is_indirect(obj))
+
+		if (!cmap)
 		{
-			phase = 3;
-			usecmap = pdf_load_embedded_cmap(xref, obj);
-			pdf_set_usecmap(ctx, cmap, usecmap);
-			pdf_drop_cmap(ctx, usecmap);
+			file = fz_open_buffer(ctx, buf);
+			parsed = pdf_load_cmap(ctx, file);
+			phase = 2;
+			fz_close(file);
+			file = NULL;
+			fz_drop_buffer(ctx, buf);
+			buf = pdf_new_binary_cmap(ctx, parsed);
+			pdf_drop_cmap(ctx, parsed);
+			parsed = NULL;
+			cmap = pdf_load_binary_cmap(ctx, buf);
+
+			if (pdf_is_int(wmode))
+				pdf_set_cmap_wmode(ctx, cmap, pdf_to_int(wmode));
+			if (pdf_is_name(obj))
+			{
+				usecmap = pdf_load_system_cmap(ctx, pdf_to_name(obj));
+				pdf_set_usecmap(ctx, cmap, usecmap);
+				pdf_drop_cmap(ctx, usecmap);
+			}
+			else if (pdf_is_indirect(obj))
+			{
+				phase = 3;
+				usecmap = pdf_load_embedded_cmap(xref, obj);
+				pdf_set_usecmap(ctx, cmap, usecmap);
+				pdf_drop_cmap(ctx, usecmap);
+			}
+
+			if (key)
+			{
+				existing = fz_store_item(ctx, key, cmap, pdf_cmap_size(ctx, cmap), &pdf_cmap_store_type);
+				if (existing)
+				{
+					pdf_drop_cmap(ctx, cmap);
+					cmap = existing;
+				}
+			}
 		}
 
 		pdf_store_item(ctx, stmobj, cmap, pdf_cmap_size(ctx, cmap));
 	}
+	fz_always(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+		if (key)
+			pdf_drop_cmap_key(ctx, key);
+	}
 	fz_catch(ctx)
 	{
 		if (file)
 			fz_close(file);
+		if (parsed)
+			pdf_drop_cmap(ctx, parsed);
 		if (cmap)
 			pdf_drop_cmap(ctx, cmap);
 		if (phase < 1)
@@ -140,6 +140,20 @@ static int ft_cid_to_gid(pdf_font_desc *fontdesc, int cid)
 int
 pdf_font_cid_to_gid(fz_context *ctx, pdf_font_desc *fontdesc, int cid)
 {
+	pdf_cid_block *block;
+	int gid;
+
+	block = pdf_load_cid_block(ctx, fontdesc, cid);
+	if (block)
+		return block->gid[cid & 255];
+	if (fontdesc->font->ft_face && fontdesc->to_ttf_cmap)
+	{
+		fz_lock(ctx, FZ_LOCK_FREETYPE);
+		FT_Select_Charmap(fontdesc->font->ft_face, ft_encoding_unicode);
+		gid = ft_cid_to_gid(fontdesc, cid);
+		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		return gid;
+	}
 	if (fontdesc->font->ft_face)
 		return ft_cid_to_gid(fontdesc, cid);
 	return cid;
@@ -185,7 +199,7 @@ pdf_load_builtin_font(fz_context *ctx, pdf_font_desc *fontdesc, char *fontname)
 	if (!data)
 		fz_throw(ctx, "cannot find builtin font: '%s'", fontname);
 
-	fontdesc->font = fz_new_font_from_memory(ctx, fontname, data, len, 0, 1);
+	fontdesc->font = fz_new_builtin_font(ctx, fontname, data, len, 0, 1);
 
 	if (!strcmp(fontname, "Symbol") || !strcmp(fontname, "ZapfDingbats"))
 		fontdesc->flags |= PDF_FD_SYMBOLIC;
@@ -211,6 +225,7 @@ pdf_load_substitute_font(fz_context *ctx, pdf_font_desc *fontdesc, char *fontnam
 static void
 pdf_load_substitute_cjk_font(fz_context *ctx, pdf_font_desc *fontdesc, char *fontname, int ros, int serif)
 {
+	fz_font *base;
 	unsigned char *data;
 	unsigned int len;
 
@@ -219,7 +234,21 @@ pdf_load_substitute_cjk_font(fz_context *ctx, pdf_font_desc *fontdesc, char *fon
 		fz_throw(ctx, "cannot find builtin CJK font");
 
 	/* a glyph bbox cache is too big for droid sans fallback (51k glyphs!) */
-	fontdesc->font = fz_new_font_from_memory(ctx, fontname, data, len, 0, 0);
+	base = fz_new_builtin_font(ctx, NULL, data, len, 0, 0);
+
+	/* the face is shared, but the name and widths belong to this font */
+	fz_try(ctx)
+	{
+		fontdesc->font = fz_new_font_from_font(ctx, fontname, base);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_font(ctx, base);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
 
 	fontdesc->font->ft_substitute = 1;
 }
@@ -287,19 +316,27 @@ pdf_load_embedded_font(pdf_document *xref, pdf_font_desc *fontdesc, char *fontna
 
 	fz_try(ctx)
 	{
-		fontdesc->font = fz_new_font_from_memory(ctx, fontname, buf->data, buf->len, 0, 1);
+		fontdesc->font = fz_new_shared_font_from_memory(ctx, fontname, buf->data, buf->len, 0, 1);
 	}
 	fz_catch(ctx)
 	{
 		fz_drop_buffer(ctx, buf);
 		fz_throw(ctx, "cannot load embedded font (%d %d R)", pdf_to_num(stmref), pdf_to_gen(stmref));
 	}
-	fontdesc->size += buf->len;
 
-	/* save the buffer so we can free it later */
-	fontdesc->font->ft_data = buf->data;
-	fontdesc->font->ft_size = buf->len;
-	fz_free(ctx, buf); /* only free the fz_buffer struct, not the contained data */
+	if (fontdesc->font->ft_face_data != buf->data || fontdesc->font->ft_buffer)
+	{
+		/* the same font program is already loaded; use that one
+		 * (views of the same stream share their data pointer) */
+		fz_drop_buffer(ctx, buf);
+	}
+	else
+	{
+		/* save the buffer so we can free it later; it is only
+		 * counted against the font that loaded it */
+		fontdesc->size += buf->len;
+		fontdesc->font->ft_buffer = buf;
+	}
 
 	fontdesc->is_embedded = 1;
 }
@@ -324,6 +361,7 @@ static void
 pdf_free_font_imp(fz_context *ctx, fz_storable *fontdesc_)
 {
 	pdf_font_desc *fontdesc = (pdf_font_desc *)fontdesc_;
+	int i;
 
 	if (fontdesc->font)
 		fz_drop_font(ctx, fontdesc->font);
@@ -337,6 +375,12 @@ pdf_free_font_imp(fz_context *ctx, fz_storable *fontdesc_)
 	fz_free(ctx, fontdesc->cid_to_ucs);
 	fz_free(ctx, fontdesc->hmtx);
 	fz_free(ctx, fontdesc->vmtx);
+	if (fontdesc->cid_table)
+	{
+		for (i = 0; i < fontdesc->cid_table_len >> 8; i++)
+			fz_free(ctx, fontdesc->cid_table[i]);
+		fz_free(ctx, fontdesc->cid_table);
+	}
 	fz_free(ctx, fontdesc);
 }
 
@@ -387,6 +431,9 @@ pdf_new_font_desc(fz_context *ctx)
 	fontdesc->dvmtx.y = 880;
 	fontdesc->dvmtx.w = -1000;
 
+	fontdesc->cid_table_len = 0;
+	fontdesc->cid_table = NULL;
+
 	fontdesc->is_embedded = 0;
 
 	return fontdesc;
@@ -473,41 +520,6 @@ pdf_load_simple_font(pdf_document *xref, pdf_obj *dict)
 
 		symbolic = fontdesc->flags & 4;
 
-		if (face->num_charmaps > 0)
-			cmap = face->charmaps[0];
-		else
-			cmap = NULL;
-
-		for (i = 0; i < face->num_charmaps; i++)
-		{
-			FT_CharMap test = face->charmaps[i];
-
-			if (kind == TYPE1)
-			{
-				if (test->platform_id == 7)
-					cmap = test;
-			}
-
-			if (kind == TRUETYPE)
-			{
-				if (test->platform_id == 1 && test->encoding_id == 0)
-					cmap = test;
-				if (test->platform_id == 3 && test->encoding_id == 1)
-					cmap = test;
-				if (symbolic && test->platform_id == 3 && test->encoding_id == 0)
-					cmap = test;
-			}
-		}
-
-		if (cmap)
-		{
-			fterr = FT_Set_Charmap(face, cmap);
-			if (fterr)
-				fz_warn(ctx, "freetype could not set cmap: %s", ft_error_string(fterr));
-		}
-		else
-			fz_warn(ctx, "freetype could not find any cmaps");
-
 		etable = fz_malloc_array(ctx, 256, sizeof(unsigned short));
 		fontdesc->size += 256 * sizeof(unsigned short);
 		for (i = 0; i < 256; i++)
@@ -549,12 +561,49 @@ pdf_load_simple_font(pdf_document *xref, pdf_obj *dict)
 			}
 		}
 
+		/* The face may be shared with other documents, so hold the lock
+		 * while we set the cmap and use it. */
+		fz_lock(ctx, FZ_LOCK_FREETYPE);
+
+		if (face->num_charmaps > 0)
+			cmap = face->charmaps[0];
+		else
+			cmap = NULL;
+
+		for (i = 0; i < face->num_charmaps; i++)
+		{
+			FT_CharMap test = face->charmaps[i];
+
+			if (kind == TYPE1)
+			{
+				if (test->platform_id == 7)
+					cmap = test;
+			}
+
+			if (kind == TRUETYPE)
+			{
+				if (test->platform_id == 1 && test->encoding_id == 0)
+					cmap = test;
+				if (test->platform_id == 3 && test->encoding_id == 1)
+					cmap = test;
+				if (symbolic && test->platform_id == 3 && test->encoding_id == 0)
+					cmap = test;
+			}
+		}
+
+		if (cmap)
+		{
+			fterr = FT_Set_Charmap(face, cmap);
+			if (fterr)
+				fz_warn(ctx, "freetype could not set cmap: %s", ft_error_string(fterr));
+		}
+		else
+			fz_warn(ctx, "freetype could not find any cmaps");
+
 		/* start with the builtin encoding */
 		for (i = 0; i < 256; i++)
 			etable[i] = ft_char_index(face, i);
 
-		fz_lock(ctx, FZ_LOCK_FREETYPE);
-
 		/* built-in and substitute fonts may be a different type than what the document expects */
 		subtype = pdf_to_name(pdf_dict_gets(dict, "Subtype"));
 		if (!strcmp(subtype, "Type1"))
@@ -845,7 +894,12 @@ load_cid_font(pdf_document *xref, pdf_obj *dict, pdf_obj *encoding, pdf_obj *to_
 			/* unicode cmap to get a glyph id */
 			else if (fontdesc->font->ft_substitute)
 			{
+				/* The substitute face is shared with simple fonts,
+				 * which set charmaps of their own under the lock. The
+				 * lookups through to_ttf_cmap select it again. */
+				fz_lock(ctx, FZ_LOCK_FREETYPE);
 				fterr = FT_Select_Charmap(face, ft_encoding_unicode);
+				fz_unlock(ctx, FZ_LOCK_FREETYPE);
 				if (fterr)
 				{
 					fz_throw(ctx, "fonterror: no unicode cmap when emulating CID font: %s", ft_error_string(fterr));
@@ -1095,6 +1149,79 @@ pdf_make_width_table(fz_context *ctx, pdf_font_desc *fontdesc)
 	}
 }
 
+/*
+ * Set up a table for the gid and advance of every cid covered by the
+ * font's widths (or CIDToGIDMap, or a simple font encoding), so that
+ * showing text does not search the metrics or call into FreeType for
+ * every glyph. The table is filled 256 cids at a time, as they are
+ * used, by pdf_load_cid_block. It is only an optimisation; on
+ * allocation failure we do without.
+ */
+static void
+pdf_make_cid_table(fz_context *ctx, pdf_font_desc *fontdesc)
+{
+	int i, n;
+
+	n = fz_maxi(256, fontdesc->cid_to_gid_len);
+	for (i = 0; i < fontdesc->hmtx_len; i++)
+		n = fz_maxi(n, fontdesc->hmtx[i].hi + 1);
+	n = (n + 255) >> 8;
+
+	fontdesc->cid_table = fz_calloc_no_throw(ctx, n, sizeof(pdf_cid_block *));
+	if (!fontdesc->cid_table)
+		return;
+	fontdesc->cid_table_len = n << 8;
+	fontdesc->size += n * sizeof(pdf_cid_block *);
+}
+
+pdf_cid_block *
+pdf_load_cid_block(fz_context *ctx, pdf_font_desc *fontdesc, int cid)
+{
+	pdf_cid_block *block;
+	int i, base;
+
+	if (cid < 0 || cid >= fontdesc->cid_table_len)
+		return NULL;
+
+	block = fontdesc->cid_table[cid >> 8];
+	if (block)
+		return block;
+
+	block = fz_malloc_no_throw(ctx, sizeof(pdf_cid_block));
+	if (!block)
+		return NULL;
+
+	base = cid & ~255;
+	for (i = 0; i < 256; i++)
+		block->w[i] = pdf_search_hmtx(ctx, fontdesc, base + i).w;
+
+	if (!fontdesc->font->ft_face)
+	{
+		for (i = 0; i < 256; i++)
+			block->gid[i] = base + i;
+	}
+	else if (fontdesc->to_ttf_cmap)
+	{
+		/* The charmap lookups may use a face shared with other
+		 * fonts and contexts, so select the unicode charmap and
+		 * do the whole block under one lock */
+		fz_lock(ctx, FZ_LOCK_FREETYPE);
+		FT_Select_Charmap(fontdesc->font->ft_face, ft_encoding_unicode);
+		for (i = 0; i < 256; i++)
+			block->gid[i] = ft_cid_to_gid(fontdesc, base + i);
+		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	}
+	else
+	{
+		for (i = 0; i < 256; i++)
+			block->gid[i] = ft_cid_to_gid(fontdesc, base + i);
+	}
+
+	fontdesc->cid_table[cid >> 8] = block;
+	fontdesc->size += sizeof(pdf_cid_block);
+	return block;
+}
+
 pdf_font_desc *
 pdf_load_font(pdf_document *xref, pdf_obj *rdb, pdf_obj *dict)
 {
@@ -1143,6 +1270,8 @@ pdf_load_font(pdf_document *xref, pdf_obj *rdb, pdf_obj *dict)
 	if (fontdesc->font->ft_substitute && !fontdesc->to_ttf_cmap)
 		pdf_make_width_table(ctx, fontdesc);
 
+	pdf_make_cid_table(ctx, fontdesc);
+
 	pdf_store_item(ctx, dict, fontdesc, fontdesc->size);
 
 	return fontdesc;
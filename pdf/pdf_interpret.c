@@ -104,7 +104,7 @@ struct pdf_csi_s
 	fz_cookie *cookie;
 };
 
-static void pdf_run_contents_object(pdf_csi *csi, pdf_obj *rdb, pdf_obj *contents);
+static void pdf_run_contents_object(pdf_csi *csi, pdf_obj *rdb, pdf_obj *contents, int cache);
 static void pdf_run_xobject(pdf_csi *csi, pdf_obj *resources, pdf_xobject *xobj, fz_matrix transform);
 static void pdf_show_pattern(pdf_csi *csi, pdf_pattern *pat, fz_rect area, int what);
 
@@ -1295,7 +1295,7 @@ pdf_show_pattern(pdf_csi *csi, pdf_pattern *pat, fz_rect area, int what)
 		gstate->ctm = ptm;
 		csi->top_ctm = gstate->ctm;
 		pdf_gsave(csi);
-		pdf_run_contents_object(csi, pat->resources, pat->contents);
+		pdf_run_contents_object(csi, pat->resources, pat->contents, 1);
 		pdf_grestore(csi);
 		while (oldtop < csi->gtop)
 			pdf_grestore(csi);
@@ -1313,7 +1313,7 @@ pdf_show_pattern(pdf_csi *csi, pdf_pattern *pat, fz_rect area, int what)
 				pdf_gsave(csi);
 				fz_try(ctx)
 				{
-					pdf_run_contents_object(csi, pat->resources, pat->contents);
+					pdf_run_contents_object(csi, pat->resources, pat->contents, 1);
 				}
 				fz_always(ctx)
 				{
@@ -1409,7 +1409,7 @@ pdf_run_xobject(pdf_csi *csi, pdf_obj *resources, pdf_xobject *xobj, fz_matrix t
 		if (xobj->resources)
 			resources = xobj->resources;
 
-		pdf_run_contents_object(csi, resources, xobj->contents);
+		pdf_run_contents_object(csi, resources, xobj->contents, 1);
 	}
 	fz_always(ctx)
 	{
@@ -2402,188 +2402,314 @@ static void pdf_run_dquote(pdf_csi *csi)
 		pdf_show_text(csi, csi->obj);
 }
 
+/*
+ * Content stream programs.
+ *
+ * A content stream is lexed into a list of operations, each holding the
+ * opcode of its keyword and the operands that were pushed before it.
+ * The operations are then run without going back to the lexer. Programs
+ * for forms, patterns and type3 glyphs are compiled in one go and kept in
+ * the store, so drawing them again skips lexing and parsing altogether.
+ * Other streams, and streams with inline images (whose length depends on
+ * the resources they are run with), are compiled and run a chunk at a time.
+ */
+
+enum
+{
+	PDF_OP_UNKNOWN,
+	PDF_OP_dquote, PDF_OP_squote, PDF_OP_B, PDF_OP_Bstar, PDF_OP_BDC,
+	PDF_OP_BI, PDF_OP_BMC, PDF_OP_BT, PDF_OP_BX, PDF_OP_CS, PDF_OP_DP,
+	PDF_OP_Do, PDF_OP_EMC, PDF_OP_ET, PDF_OP_EX, PDF_OP_F, PDF_OP_G,
+	PDF_OP_J, PDF_OP_K, PDF_OP_M, PDF_OP_MP, PDF_OP_Q, PDF_OP_RG,
+	PDF_OP_S, PDF_OP_SC, PDF_OP_SCN, PDF_OP_Tstar, PDF_OP_TD, PDF_OP_TJ,
+	PDF_OP_TL, PDF_OP_Tc, PDF_OP_Td, PDF_OP_Tf, PDF_OP_Tj, PDF_OP_Tm,
+	PDF_OP_Tr, PDF_OP_Ts, PDF_OP_Tw, PDF_OP_Tz, PDF_OP_W, PDF_OP_Wstar,
+	PDF_OP_b, PDF_OP_bstar, PDF_OP_c, PDF_OP_cm, PDF_OP_cs, PDF_OP_d,
+	PDF_OP_d0, PDF_OP_d1, PDF_OP_f, PDF_OP_fstar, PDF_OP_g, PDF_OP_gs,
+	PDF_OP_h, PDF_OP_i, PDF_OP_j, PDF_OP_k, PDF_OP_l, PDF_OP_m,
+	PDF_OP_n, PDF_OP_q, PDF_OP_re, PDF_OP_rg, PDF_OP_ri, PDF_OP_s,
+	PDF_OP_sc, PDF_OP_scn, PDF_OP_sh, PDF_OP_v, PDF_OP_w, PDF_OP_y,
+	PDF_NUM_KEYWORDS,
+
+	/* elements of a text array, shown as they are read */
+	PDF_OP_SHOW_SPACE = PDF_NUM_KEYWORDS,
+	PDF_OP_SHOW_STRING,
+
+	/* syntax error while lexing */
+	PDF_OP_ERROR
+};
+
 #define A(a) (a)
 #define B(a,b) (a | b << 8)
 #define C(a,b,c) (a | b << 8 | c << 16)
 
+static const int pdf_op_key[PDF_NUM_KEYWORDS] =
+{
+	0,
+	A('"'), A('\''), A('B'), B('B','*'), C('B','D','C'),
+	B('B','I'), C('B','M','C'), B('B','T'), B('B','X'), B('C','S'), B('D','P'),
+	B('D','o'), C('E','M','C'), B('E','T'), B('E','X'), A('F'), A('G'),
+	A('J'), A('K'), A('M'), B('M','P'), A('Q'), B('R','G'),
+	A('S'), B('S','C'), C('S','C','N'), B('T','*'), B('T','D'), B('T','J'),
+	B('T','L'), B('T','c'), B('T','d'), B('T','f'), B('T','j'), B('T','m'),
+	B('T','r'), B('T','s'), B('T','w'), B('T','z'), A('W'), B('W','*'),
+	A('b'), B('b','*'), A('c'), B('c','m'), B('c','s'), A('d'),
+	B('d','0'), B('d','1'), A('f'), B('f','*'), A('g'), B('g','s'),
+	A('h'), A('i'), A('j'), A('k'), A('l'), A('m'),
+	A('n'), A('q'), B('r','e'), B('r','g'), B('r','i'), A('s'),
+	B('s','c'), C('s','c','n'), B('s','h'), A('v'), A('w'), A('y'),
+};
+
+/* Perfect hash of the packed keywords above; see pdf_keyword_op. */
+#define PDF_OP_HASH(key) (((unsigned int)(key) * 0x1edb0e3bU) >> 24)
+
+static const unsigned char pdf_op_hash[256] =
+{
+	0, 24, 0, 0, 58, 0, 0, 0, 0, 0, 19, 0, 0, 47, 0, 0,
+	27, 0, 0, 0, 0, 0, 0, 0, 10, 1, 0, 0, 0, 0, 0, 0,
+	48, 0, 0, 59, 0, 0, 0, 0, 30, 0, 62, 0, 0, 12, 0, 0,
+	0, 14, 0, 45, 0, 0, 0, 0, 69, 0, 0, 51, 0, 0, 0, 0,
+	0, 9, 60, 0, 0, 0, 0, 20, 0, 0, 0, 50, 0, 0, 0, 28,
+	0, 0, 0, 0, 0, 25, 46, 70, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 35, 0, 0, 33, 0, 0, 52, 6, 41, 0, 0, 16,
+	0, 29, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 40, 0, 0, 0,
+	0, 0, 0, 0, 39, 0, 0, 37, 54, 0, 0, 0, 0, 0, 17, 0,
+	0, 7, 66, 0, 0, 71, 64, 0, 0, 0, 0, 0, 0, 15, 61, 0,
+	0, 0, 0, 23, 0, 0, 11, 55, 0, 0, 0, 26, 36, 0, 0, 0,
+	67, 32, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 21, 0, 0, 0,
+	43, 0, 0, 22, 0, 0, 56, 0, 0, 0, 0, 0, 0, 0, 0, 42,
+	0, 53, 0, 34, 0, 8, 31, 0, 0, 0, 68, 0, 65, 5, 0, 0,
+	63, 0, 0, 0, 4, 57, 0, 0, 0, 0, 0, 18, 0, 13, 44, 0,
+	0, 0, 0, 38, 3, 0, 0, 0, 0, 0, 0, 49, 0, 0, 0, 0,
+};
+
 static int
-pdf_run_keyword(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, char *buf)
+pdf_keyword_op(char *buf)
 {
-	fz_context *ctx = csi->dev->ctx;
-	int key;
+	int key, op;
 
-	key = buf[0];
+	key = (unsigned char)buf[0];
 	if (buf[1])
 	{
-		key |= buf[1] << 8;
+		key |= (unsigned char)buf[1] << 8;
 		if (buf[2])
 		{
-			key |= buf[2] << 16;
+			key |= (unsigned char)buf[2] << 16;
 			if (buf[3])
-				key = 0;
+				return PDF_OP_UNKNOWN;
 		}
 	}
 
-	switch (key)
+	op = pdf_op_hash[PDF_OP_HASH(key)];
+	if (pdf_op_key[op] != key)
+		return PDF_OP_UNKNOWN;
+	return op;
+}
+
+typedef struct pdf_csi_op_s pdf_csi_op;
+typedef struct pdf_csi_prog_s pdf_csi_prog;
+
+struct pdf_csi_op_s
+{
+	int op;
+	int nums, count;	/* numbers, in prog->nums */
+	int name;		/* name (or unknown keyword), in prog->text */
+	int string, string_len;	/* string, in prog->text */
+	pdf_obj *obj;		/* array, dictionary or long string */
+};
+
+struct pdf_csi_prog_s
+{
+	fz_storable storable;
+	int chunk; /* ops to compile at a time, or 0 for the whole stream */
+	int more; /* stream has not been compiled to the end */
+
+	int len, cap;
+	pdf_csi_op *ops;
+	int num_len, num_cap;
+	float *nums;
+	int text_len, text_cap;
+	char *text;
+
+	/* operands read since the last keyword */
+	pdf_csi_op next;
+	float *stack;
+	int top, stack_cap;
+	int in_text;
+};
+
+#define PDF_CSI_CHUNK 1024
+
+static void
+pdf_free_csi_prog_imp(fz_context *ctx, fz_storable *prog_)
+{
+	pdf_csi_prog *prog = (pdf_csi_prog *)prog_;
+	int i;
+
+	for (i = 0; i < prog->len; i++)
+		pdf_drop_obj(prog->ops[i].obj);
+	pdf_drop_obj(prog->next.obj);
+	fz_free(ctx, prog->ops);
+	fz_free(ctx, prog->nums);
+	fz_free(ctx, prog->text);
+	fz_free(ctx, prog->stack);
+	fz_free(ctx, prog);
+}
+
+static void
+pdf_clear_csi_prog_operands(pdf_csi_prog *prog)
+{
+	pdf_drop_obj(prog->next.obj);
+	prog->next.obj = NULL;
+	prog->next.name = -1;
+	prog->next.string = -1;
+	prog->next.string_len = 0;
+	prog->top = 0;
+}
+
+static pdf_csi_prog *
+pdf_new_csi_prog(fz_context *ctx, int chunk)
+{
+	pdf_csi_prog *prog = fz_malloc_struct(ctx, pdf_csi_prog);
+
+	FZ_INIT_STORABLE(prog, 1, pdf_free_csi_prog_imp);
+	prog->chunk = chunk;
+	prog->more = 1;
+	pdf_clear_csi_prog_operands(prog);
+	return prog;
+}
+
+static void
+pdf_drop_csi_prog(fz_context *ctx, pdf_csi_prog *prog)
+{
+	fz_drop_storable(ctx, &prog->storable);
+}
+
+static unsigned int
+pdf_csi_prog_size(pdf_csi_prog *prog)
+{
+	return sizeof(*prog) + prog->cap * sizeof(pdf_csi_op) + prog->num_cap * sizeof(float) + prog->text_cap;
+}
+
+/* Forget the operations that have been run, to compile the next chunk. */
+static void
+pdf_rewind_csi_prog(pdf_csi_prog *prog)
+{
+	int i;
+
+	for (i = 0; i < prog->len; i++)
+		pdf_drop_obj(prog->ops[i].obj);
+	prog->len = 0;
+	prog->num_len = 0;
+	prog->text_len = 0;
+}
+
+static int
+pdf_csi_prog_text(fz_context *ctx, pdf_csi_prog *prog, char *s, int len)
+{
+	int ofs = prog->text_len;
+
+	if (ofs + len > prog->text_cap)
 	{
-	case A('"'): pdf_run_dquote(csi); break;
-	case A('\''): pdf_run_squote(csi); break;
-	case A('B'): pdf_run_B(csi); break;
-	case B('B','*'): pdf_run_Bstar(csi); break;
-	case C('B','D','C'): pdf_run_BDC(csi, rdb); break;
-	case B('B','I'):
-		pdf_run_BI(csi, rdb, file);
-		break;
-	case C('B','M','C'): pdf_run_BMC(csi); break;
-	case B('B','T'): pdf_run_BT(csi); break;
-	case B('B','X'): pdf_run_BX(csi); break;
-	case B('C','S'): pdf_run_CS(csi, rdb); break;
-	case B('D','P'): pdf_run_DP(csi); break;
-	case B('D','o'):
-		fz_try(ctx)
-		{
-			pdf_run_Do(csi, rdb);
-		}
-		fz_catch(ctx)
-		{
-			fz_throw(ctx, "cannot draw xobject/image");
-		}
-		break;
-	case C('E','M','C'): pdf_run_EMC(csi); break;
-	case B('E','T'): pdf_run_ET(csi); break;
-	case B('E','X'): pdf_run_EX(csi); break;
-	case A('F'): pdf_run_F(csi); break;
-	case A('G'): pdf_run_G(csi); break;
-	case A('J'): pdf_run_J(csi); break;
-	case A('K'): pdf_run_K(csi); break;
-	case A('M'): pdf_run_M(csi); break;
-	case B('M','P'): pdf_run_MP(csi); break;
-	case A('Q'): pdf_run_Q(csi); break;
-	case B('R','G'): pdf_run_RG(csi); break;
-	case A('S'): pdf_run_S(csi); break;
-	case B('S','C'): pdf_run_SC(csi, rdb); break;
-	case C('S','C','N'): pdf_run_SC(csi, rdb); break;
-	case B('T','*'): pdf_run_Tstar(csi); break;
-	case B('T','D'): pdf_run_TD(csi); break;
-	case B('T','J'): pdf_run_TJ(csi); break;
-	case B('T','L'): pdf_run_TL(csi); break;
-	case B('T','c'): pdf_run_Tc(csi); break;
-	case B('T','d'): pdf_run_Td(csi); break;
-	case B('T','f'):
-		fz_try(ctx)
-		{
-			pdf_run_Tf(csi, rdb);
-		}
-		fz_catch(ctx)
-		{
-			fz_throw(ctx, "cannot set font");
-		}
-		break;
-	case B('T','j'): pdf_run_Tj(csi); break;
-	case B('T','m'): pdf_run_Tm(csi); break;
-	case B('T','r'): pdf_run_Tr(csi); break;
-	case B('T','s'): pdf_run_Ts(csi); break;
-	case B('T','w'): pdf_run_Tw(csi); break;
-	case B('T','z'): pdf_run_Tz(csi); break;
-	case A('W'): pdf_run_W(csi); break;
-	case B('W','*'): pdf_run_Wstar(csi); break;
-	case A('b'): pdf_run_b(csi); break;
-	case B('b','*'): pdf_run_bstar(csi); break;
-	case A('c'): pdf_run_c(csi); break;
-	case B('c','m'): pdf_run_cm(csi); break;
-	case B('c','s'): pdf_run_cs(csi, rdb); break;
-	case A('d'): pdf_run_d(csi); break;
-	case B('d','0'): pdf_run_d0(csi); break;
-	case B('d','1'): pdf_run_d1(csi); break;
-	case A('f'): pdf_run_f(csi); break;
-	case B('f','*'): pdf_run_fstar(csi); break;
-	case A('g'): pdf_run_g(csi); break;
-	case B('g','s'):
-		fz_try(ctx)
-		{
-			pdf_run_gs(csi, rdb);
-		}
-		fz_catch(ctx)
-		{
-			fz_throw(ctx, "cannot set graphics state");
-		}
-		break;
-	case A('h'): pdf_run_h(csi); break;
-	case A('i'): pdf_run_i(csi); break;
-	case A('j'): pdf_run_j(csi); break;
-	case A('k'): pdf_run_k(csi); break;
-	case A('l'): pdf_run_l(csi); break;
-	case A('m'): pdf_run_m(csi); break;
-	case A('n'): pdf_run_n(csi); break;
-	case A('q'): pdf_run_q(csi); break;
-	case B('r','e'): pdf_run_re(csi); break;
-	case B('r','g'): pdf_run_rg(csi); break;
-	case B('r','i'): pdf_run_ri(csi); break;
-	case A('s'): pdf_run(csi); break;
-	case B('s','c'): pdf_run_sc(csi, rdb); break;
-	case C('s','c','n'): pdf_run_sc(csi, rdb); break;
-	case B('s','h'):
-		fz_try(ctx)
-		{
-			pdf_run_sh(csi, rdb);
-		}
-		fz_catch(ctx)
-		{
-			fz_throw(ctx, "cannot draw shading");
-		}
-		break;
-	case A('v'): pdf_run_v(csi); break;
-	case A('w'): pdf_run_w(csi); break;
-	case A('y'): pdf_run_y(csi); break;
-	default:
-		if (!csi->xbalance)
-		{
-			fz_warn(ctx, "unknown keyword: '%s'", buf);
-			return 1;
-		}
-		break;
+		int new_cap = fz_maxi(prog->text_cap * 2, ofs + len);
+		prog->text = fz_resize_array(ctx, prog->text, new_cap, 1);
+		prog->text_cap = new_cap;
 	}
-	return 0;
+	memcpy(prog->text + ofs, s, len);
+	prog->text_len += len;
+	return ofs;
 }
 
 static void
-pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
+pdf_csi_prog_push(fz_context *ctx, pdf_csi_prog *prog, float v)
 {
-	fz_context *ctx = csi->dev->ctx;
-	int tok = PDF_TOK_ERROR;
-	int in_array;
-	int ignoring_errors = 0;
+	if (prog->top == prog->stack_cap)
+	{
+		int new_cap = fz_maxi(prog->stack_cap * 2, 32);
+		prog->stack = fz_resize_array(ctx, prog->stack, new_cap, sizeof(float));
+		prog->stack_cap = new_cap;
+	}
+	prog->stack[prog->top++] = v;
+}
 
-	/* make sure we have a clean slate if we come here from flush_text */
-	pdf_clear_stack(csi);
-	in_array = 0;
+static void
+pdf_csi_prog_set_obj(pdf_csi_prog *prog, pdf_obj *obj)
+{
+	pdf_drop_obj(prog->next.obj);
+	prog->next.obj = obj;
+}
 
-	fz_var(in_array);
-	fz_var(tok);
+static pdf_csi_op *
+pdf_csi_prog_add(fz_context *ctx, pdf_csi_prog *prog, int op, float *nums, int count)
+{
+	pdf_csi_op *ins;
 
-	if (csi->cookie)
+	if (prog->len == prog->cap)
 	{
-		csi->cookie->progress_max = -1;
-		csi->cookie->progress = 0;
+		int new_cap = fz_maxi(prog->cap * 2, 64);
+		prog->ops = fz_resize_array(ctx, prog->ops, new_cap, sizeof(pdf_csi_op));
+		prog->cap = new_cap;
+	}
+	if (prog->num_len + count > prog->num_cap)
+	{
+		int new_cap = fz_maxi(prog->num_cap * 2, prog->num_len + count + 64);
+		prog->nums = fz_resize_array(ctx, prog->nums, new_cap, sizeof(float));
+		prog->num_cap = new_cap;
 	}
 
+	ins = &prog->ops[prog->len++];
+	ins->op = op;
+	ins->nums = prog->num_len;
+	ins->count = count;
+	ins->name = -1;
+	ins->string = -1;
+	ins->string_len = 0;
+	ins->obj = NULL;
+	if (count)
+		memcpy(prog->nums + prog->num_len, nums, count * sizeof(float));
+	prog->num_len += count;
+	return ins;
+}
+
+/* Append a keyword taking the pending operands, and clear them. */
+static void
+pdf_csi_prog_add_keyword(fz_context *ctx, pdf_csi_prog *prog, int op)
+{
+	pdf_csi_op *ins = pdf_csi_prog_add(ctx, prog, op, prog->stack, prog->top);
+
+	ins->name = prog->next.name;
+	ins->string = prog->next.string;
+	ins->string_len = prog->next.string_len;
+	ins->obj = prog->next.obj;
+	prog->next.obj = NULL;
+	pdf_clear_csi_prog_operands(prog);
+}
+
+/*
+ * Lex the content stream into the program, up to the end of the stream,
+ * an inline image, or a full chunk. Errors are recorded in the program
+ * and lexing carries on, the same way the operations will be run.
+ */
+static void
+pdf_compile_stream(pdf_csi *csi, pdf_csi_prog *prog, fz_stream *file, pdf_lexbuf *buf)
+{
+	fz_context *ctx = csi->dev->ctx;
+	pdf_document *xref = csi->xref;
+	int tok = PDF_TOK_ERROR;
+	int in_array = 0;
+	int stop = 0;
+	int op;
+
+	fz_var(in_array);
+	fz_var(tok);
+	fz_var(stop);
+
 	do
 	{
 		fz_try(ctx)
 		{
 			do
 			{
-				/* Check the cookie */
-				if (csi->cookie)
-				{
-					if (csi->cookie->abort)
-					{
-						tok = PDF_TOK_EOF;
-						break;
-					}
-					csi->cookie->progress++;
-				}
-
 				tok = pdf_lex(file, buf);
 
 				if (in_array)
@@ -2594,17 +2720,19 @@ pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
 					}
 					else if (tok == PDF_TOK_REAL)
 					{
-						pdf_gstate *gstate = csi->gstate + csi->gtop;
-						pdf_show_space(csi, -buf->f * gstate->size * 0.001f);
+						pdf_csi_prog_add(ctx, prog, PDF_OP_SHOW_SPACE, &buf->f, 1);
 					}
 					else if (tok == PDF_TOK_INT)
 					{
-						pdf_gstate *gstate = csi->gstate + csi->gtop;
-						pdf_show_space(csi, -buf->i * gstate->size * 0.001f);
+						float v = buf->i;
+						pdf_csi_prog_add(ctx, prog, PDF_OP_SHOW_SPACE, &v, 1);
 					}
 					else if (tok == PDF_TOK_STRING)
 					{
-						pdf_show_string(csi, (unsigned char *)buf->scratch, buf->len);
+						int string = pdf_csi_prog_text(ctx, prog, buf->scratch, buf->len);
+						pdf_csi_op *ins = pdf_csi_prog_add(ctx, prog, PDF_OP_SHOW_STRING, NULL, 0);
+						ins->string = string;
+						ins->string_len = buf->len;
 					}
 					else if (tok == PDF_TOK_KEYWORD)
 					{
@@ -2627,9 +2755,9 @@ pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
 					break;
 
 				case PDF_TOK_OPEN_ARRAY:
-					if (!csi->in_text)
+					if (!prog->in_text)
 					{
-						csi->obj = pdf_parse_array(csi->xref, file, buf);
+						pdf_csi_prog_set_obj(prog, pdf_parse_array(xref, file, buf));
 					}
 					else
 					{
@@ -2638,81 +2766,430 @@ pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
 					break;
 
 				case PDF_TOK_OPEN_DICT:
-					csi->obj = pdf_parse_dict(csi->xref, file, buf);
+					pdf_csi_prog_set_obj(prog, pdf_parse_dict(xref, file, buf));
 					break;
 
 				case PDF_TOK_NAME:
-					fz_strlcpy(csi->name, buf->scratch, sizeof(csi->name));
+					prog->next.name = pdf_csi_prog_text(ctx, prog, buf->scratch, strlen(buf->scratch) + 1);
 					break;
 
 				case PDF_TOK_INT:
-					if (csi->top < nelem(csi->stack)) {
-						csi->stack[csi->top] = buf->i;
-						csi->top ++;
-					}
-					else
-						fz_throw(ctx, "stack overflow");
+					pdf_csi_prog_push(ctx, prog, buf->i);
 					break;
 
 				case PDF_TOK_REAL:
-					if (csi->top < nelem(csi->stack)) {
-						csi->stack[csi->top] = buf->f;
-						csi->top ++;
-					}
-					else
-						fz_throw(ctx, "stack overflow");
+					pdf_csi_prog_push(ctx, prog, buf->f);
 					break;
 
 				case PDF_TOK_STRING:
 					if (buf->len <= sizeof(csi->string))
 					{
-						memcpy(csi->string, buf->scratch, buf->len);
-						csi->string_len = buf->len;
+						prog->next.string = pdf_csi_prog_text(ctx, prog, buf->scratch, buf->len);
+						prog->next.string_len = buf->len;
 					}
 					else
 					{
-						csi->obj = pdf_new_string(ctx, buf->scratch, buf->len);
+						pdf_csi_prog_set_obj(prog, pdf_new_string(ctx, buf->scratch, buf->len));
 					}
 					break;
 
 				case PDF_TOK_KEYWORD:
-					if (pdf_run_keyword(csi, rdb, file, buf->scratch))
+					op = pdf_keyword_op(buf->scratch);
+					if (op == PDF_OP_UNKNOWN)
+						prog->next.name = pdf_csi_prog_text(ctx, prog, buf->scratch, strlen(buf->scratch) + 1);
+					else if (op == PDF_OP_BT)
+						prog->in_text = 1;
+					else if (op == PDF_OP_ET)
+						prog->in_text = 0;
+					pdf_csi_prog_add_keyword(ctx, prog, op);
+
+					/* The inline image data must be read by the interpreter. */
+					if (op == PDF_OP_BI)
 					{
-						tok = PDF_TOK_EOF;
+						prog->chunk = PDF_CSI_CHUNK;
+						stop = 1;
 					}
-					pdf_clear_stack(csi);
+					else if (prog->chunk && prog->len >= prog->chunk)
+						stop = 1;
 					break;
 
 				default:
 					fz_throw(ctx, "syntax error in content stream");
 				}
 			}
-			while (tok != PDF_TOK_EOF);
+			while (tok != PDF_TOK_EOF && !stop);
 		}
 		fz_catch(ctx)
 		{
-			/* Swallow the error */
-			if (csi->cookie)
-				csi->cookie->errors++;
-			if (!ignoring_errors)
+			pdf_csi_prog_add(ctx, prog, PDF_OP_ERROR, NULL, 0);
+			in_array = 0;
+		}
+	}
+	while (tok != PDF_TOK_EOF && !stop);
+
+	if (!stop)
+		prog->more = 0;
+}
+
+static void
+pdf_run_keyword(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, int op)
+{
+	fz_context *ctx = csi->dev->ctx;
+
+	switch (op)
+	{
+	case PDF_OP_dquote: pdf_run_dquote(csi); break;
+	case PDF_OP_squote: pdf_run_squote(csi); break;
+	case PDF_OP_B: pdf_run_B(csi); break;
+	case PDF_OP_Bstar: pdf_run_Bstar(csi); break;
+	case PDF_OP_BDC: pdf_run_BDC(csi, rdb); break;
+	case PDF_OP_BI:
+		pdf_run_BI(csi, rdb, file);
+		break;
+	case PDF_OP_BMC: pdf_run_BMC(csi); break;
+	case PDF_OP_BT: pdf_run_BT(csi); break;
+	case PDF_OP_BX: pdf_run_BX(csi); break;
+	case PDF_OP_CS: pdf_run_CS(csi, rdb); break;
+	case PDF_OP_DP: pdf_run_DP(csi); break;
+	case PDF_OP_Do:
+		fz_try(ctx)
+		{
+			pdf_run_Do(csi, rdb);
+		}
+		fz_catch(ctx)
+		{
+			fz_throw(ctx, "cannot draw xobject/image");
+		}
+		break;
+	case PDF_OP_EMC: pdf_run_EMC(csi); break;
+	case PDF_OP_ET: pdf_run_ET(csi); break;
+	case PDF_OP_EX: pdf_run_EX(csi); break;
+	case PDF_OP_F: pdf_run_F(csi); break;
+	case PDF_OP_G: pdf_run_G(csi); break;
+	case PDF_OP_J: pdf_run_J(csi); break;
+	case PDF_OP_K: pdf_run_K(csi); break;
+	case PDF_OP_M: pdf_run_M(csi); break;
+	case PDF_OP_MP: pdf_run_MP(csi); break;
+	case PDF_OP_Q: pdf_run_Q(csi); break;
+	case PDF_OP_RG: pdf_run_RG(csi); break;
+	case PDF_OP_S: pdf_run_S(csi); break;
+	case PDF_OP_SC: pdf_run_SC(csi, rdb); break;
+	case PDF_OP_SCN: pdf_run_SC(csi, rdb); break;
+	case PDF_OP_Tstar: pdf_run_Tstar(csi); break;
+	case PDF_OP_TD: pdf_run_TD(csi); break;
+	case PDF_OP_TJ: pdf_run_TJ(csi); break;
+	case PDF_OP_TL: pdf_run_TL(csi); break;
+	case PDF_OP_Tc: pdf_run_Tc(csi); break;
+	case PDF_OP_Td: pdf_run_Td(csi); break;
+	case PDF_OP_Tf:
+		fz_try(ctx)
+		{
+			pdf_run_Tf(csi, rdb);
+		}
+		fz_catch(ctx)
+		{
+			fz_throw(ctx, "cannot set font");
+		}
+		break;
+	case PDF_OP_Tj: pdf_run_Tj(csi); break;
+	case PDF_OP_Tm: pdf_run_Tm(csi); break;
+	case PDF_OP_Tr: pdf_run_Tr(csi); break;
+	case PDF_OP_Ts: pdf_run_Ts(csi); break;
+	case PDF_OP_Tw: pdf_run_Tw(csi); break;
+	case PDF_OP_Tz: pdf_run_Tz(csi); break;
+	case PDF_OP_W: pdf_run_W(csi); break;
+	case PDF_OP_Wstar: pdf_run_Wstar(csi); break;
+	case PDF_OP_b: pdf_run_b(csi); break;
+	case PDF_OP_bstar: pdf_run_bstar(csi); break;
+	case PDF_OP_c: pdf_run_c(csi); break;
+	case PDF_OP_cm: pdf_run_cm(csi); break;
+	case PDF_OP_cs: pdf_run_cs(csi, rdb); break;
+	case PDF_OP_d: pdf_run_d(csi); break;
+	case PDF_OP_d0: pdf_run_d0(csi); break;
+	case PDF_OP_d1: pdf_run_d1(csi); break;
+	case PDF_OP_f: pdf_run_f(csi); break;
+	case PDF_OP_fstar: pdf_run_fstar(csi); break;
+	case PDF_OP_g: pdf_run_g(csi); break;
+	case PDF_OP_gs:
+		fz_try(ctx)
+		{
+			pdf_run_gs(csi, rdb);
+		}
+		fz_catch(ctx)
+		{
+			fz_throw(ctx, "cannot set graphics state");
+		}
+		break;
+	case PDF_OP_h: pdf_run_h(csi); break;
+	case PDF_OP_i: pdf_run_i(csi); break;
+	case PDF_OP_j: pdf_run_j(csi); break;
+	case PDF_OP_k: pdf_run_k(csi); break;
+	case PDF_OP_l: pdf_run_l(csi); break;
+	case PDF_OP_m: pdf_run_m(csi); break;
+	case PDF_OP_n: pdf_run_n(csi); break;
+	case PDF_OP_q: pdf_run_q(csi); break;
+	case PDF_OP_re: pdf_run_re(csi); break;
+	case PDF_OP_rg: pdf_run_rg(csi); break;
+	case PDF_OP_ri: pdf_run_ri(csi); break;
+	case PDF_OP_s: pdf_run(csi); break;
+	case PDF_OP_sc: pdf_run_sc(csi, rdb); break;
+	case PDF_OP_scn: pdf_run_sc(csi, rdb); break;
+	case PDF_OP_sh:
+		fz_try(ctx)
+		{
+			pdf_run_sh(csi, rdb);
+		}
+		fz_catch(ctx)
+		{
+			fz_throw(ctx, "cannot draw shading");
+		}
+		break;
+	case PDF_OP_v: pdf_run_v(csi); break;
+	case PDF_OP_w: pdf_run_w(csi); break;
+	case PDF_OP_y: pdf_run_y(csi); break;
+	}
+}
+
+
+static void
+pdf_csi_error(pdf_csi *csi, int *ignoring_errors)
+{
+	if (csi->cookie)
+		csi->cookie->errors++;
+	if (!*ignoring_errors)
+	{
+		fz_warn(csi->dev->ctx, "Ignoring errors during rendering");
+		*ignoring_errors = 1;
+	}
+}
+
+/*
+ * Run a content stream program. When the operations run out, the rest of
+ * the stream (if any) is compiled from file; for a complete program from
+ * the store file is NULL.
+ */
+static void
+pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, pdf_csi_prog *prog, fz_stream *file, pdf_lexbuf *buf)
+{
+	fz_context *ctx = csi->dev->ctx;
+	pdf_gstate *gstate;
+	pdf_csi_op *op;
+	int ignoring_errors = 0;
+	int done = 0;
+	int pc = 0;
+	int i;
+
+	/* make sure we have a clean slate if we come here from flush_text */
+	pdf_clear_stack(csi);
+
+	fz_var(ignoring_errors);
+	fz_var(done);
+	fz_var(pc);
+
+	if (csi->cookie)
+	{
+		csi->cookie->progress_max = -1;
+		csi->cookie->progress = 0;
+	}
+
+	do
+	{
+		fz_try(ctx)
+		{
+			while (!done)
 			{
-				fz_warn(ctx, "Ignoring errors during rendering");
-				ignoring_errors = 1;
+				if (pc == prog->len)
+				{
+					if (!file || !prog->more)
+					{
+						done = 1;
+						break;
+					}
+					if (prog->chunk)
+					{
+						pdf_rewind_csi_prog(prog);
+						pc = 0;
+					}
+					pdf_compile_stream(csi, prog, file, buf);
+					continue;
+				}
+
+				/* Check the cookie */
+				if (csi->cookie)
+				{
+					if (csi->cookie->abort)
+					{
+						done = 1;
+						break;
+					}
+					csi->cookie->progress++;
+				}
+
+				op = &prog->ops[pc++];
+				switch (op->op)
+				{
+				case PDF_OP_ERROR:
+					pdf_csi_error(csi, &ignoring_errors);
+					break;
+
+				case PDF_OP_SHOW_SPACE:
+					gstate = csi->gstate + csi->gtop;
+					pdf_show_space(csi, -prog->nums[op->nums] * gstate->size * 0.001f);
+					break;
+
+				case PDF_OP_SHOW_STRING:
+					pdf_show_string(csi, (unsigned char *)prog->text + op->string, op->string_len);
+					break;
+
+				default:
+					for (i = 0; i < op->count; i++)
+					{
+						if (csi->top < nelem(csi->stack))
+							csi->stack[csi->top++] = prog->nums[op->nums + i];
+						else
+							pdf_csi_error(csi, &ignoring_errors);
+					}
+					if (op->string >= 0)
+					{
+						memcpy(csi->string, prog->text + op->string, op->string_len);
+						csi->string_len = op->string_len;
+					}
+					if (op->obj)
+					{
+						pdf_drop_obj(csi->obj);
+						csi->obj = pdf_keep_obj(op->obj);
+					}
+
+					if (op->op == PDF_OP_UNKNOWN)
+					{
+						if (!csi->xbalance)
+						{
+							fz_warn(ctx, "unknown keyword: '%s'", prog->text + op->name);
+							done = 1;
+						}
+					}
+					else
+					{
+						if (op->name >= 0)
+							fz_strlcpy(csi->name, prog->text + op->name, sizeof(csi->name));
+						pdf_run_keyword(csi, rdb, file, op->op);
+					}
+					pdf_clear_stack(csi);
+					break;
+				}
 			}
-			/* If we do catch an error, then reset ourselves to a
-			 * base lexing state */
-			in_array = 0;
+		}
+		fz_catch(ctx)
+		{
+			/* Swallow the error */
+			pdf_csi_error(csi, &ignoring_errors);
 		}
 	}
-	while (tok != PDF_TOK_EOF);
+	while (!done);
 }
 
 /*
  * Entry points
  */
 
+static int
+pdf_make_hash_csi_prog_key(fz_store_hash *hash, void *key)
+{
+	hash->u.pi.ptr = key;
+	hash->u.pi.i = 0;
+	return 1;
+}
+
+static void *
+pdf_keep_csi_prog_key(fz_context *ctx, void *key)
+{
+	return fz_keep_buffer(ctx, (fz_buffer *)key);
+}
+
+static void
+pdf_drop_csi_prog_key(fz_context *ctx, void *key)
+{
+	fz_drop_buffer(ctx, (fz_buffer *)key);
+}
+
+static int
+pdf_cmp_csi_prog_key(void *k0, void *k1)
+{
+	return k0 != k1;
+}
+
+#ifndef NDEBUG
 static void
-pdf_run_contents_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file)
+pdf_debug_csi_prog_key(void *key)
+{
+	printf("(content buffer %p) ", key);
+}
+#endif
+
+/* Programs for type3 glyphs are keyed by their content buffer. */
+static fz_store_type pdf_csi_prog_store_type =
+{
+	pdf_make_hash_csi_prog_key,
+	pdf_keep_csi_prog_key,
+	pdf_drop_csi_prog_key,
+	pdf_cmp_csi_prog_key,
+#ifndef NDEBUG
+	pdf_debug_csi_prog_key
+#endif
+};
+
+/* Unlike pdf_obj_store_type, the key tells documents apart */
+static int
+pdf_make_hash_csi_obj_key(fz_store_hash *hash, void *key)
+{
+	hash->u.pi.ptr = pdf_get_indirect_document(key);
+	hash->u.pi.i = pdf_to_num(key);
+	return 1;
+}
+
+static void *
+pdf_keep_csi_obj_key(fz_context *ctx, void *key)
+{
+	return pdf_keep_obj(key);
+}
+
+static void
+pdf_drop_csi_obj_key(fz_context *ctx, void *key)
+{
+	pdf_drop_obj(key);
+}
+
+static int
+pdf_cmp_csi_obj_key(void *k0, void *k1)
+{
+	return pdf_get_indirect_document(k0) != pdf_get_indirect_document(k1) ||
+		pdf_to_num(k0) != pdf_to_num(k1) ||
+		pdf_to_gen(k0) != pdf_to_gen(k1);
+}
+
+#ifndef NDEBUG
+static void
+pdf_debug_csi_obj_key(void *key)
+{
+	printf("(content stream %d %d R of %p) ", pdf_to_num(key), pdf_to_gen(key),
+		pdf_get_indirect_document(key));
+}
+#endif
+
+/* Programs for pages, forms and patterns are keyed by their indirect object. */
+static fz_store_type pdf_csi_obj_prog_store_type =
+{
+	pdf_make_hash_csi_obj_key,
+	pdf_keep_csi_obj_key,
+	pdf_drop_csi_obj_key,
+	pdf_cmp_csi_obj_key,
+#ifndef NDEBUG
+	pdf_debug_csi_obj_key
+#endif
+};
+
+static void
+pdf_run_contents_stream(pdf_csi *csi, pdf_obj *rdb, pdf_csi_prog *prog, fz_stream *file)
 {
 	fz_context *ctx = csi->dev->ctx;
 	pdf_lexbuf *buf;
@@ -2720,16 +3197,13 @@ pdf_run_contents_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file)
 
 	fz_var(buf);
 
-	if (file == NULL)
-		return;
-
 	buf = fz_malloc(ctx, sizeof(*buf)); /* we must be re-entrant for type3 fonts */
 	pdf_lexbuf_init(ctx, buf, PDF_LEXBUF_SMALL);
 	save_in_text = csi->in_text;
 	csi->in_text = 0;
 	fz_try(ctx)
 	{
-		pdf_run_stream(csi, rdb, file, buf);
+		pdf_run_stream(csi, rdb, prog, file, buf);
 	}
 	fz_catch(ctx)
 	{
@@ -2740,22 +3214,54 @@ pdf_run_contents_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file)
 	fz_free(ctx, buf);
 }
 
+/* A program can be stored if it was compiled to the end in one go. */
+static int
+pdf_csi_prog_is_complete(pdf_csi_prog *prog)
+{
+	return !prog->more && !prog->chunk;
+}
+
 static void
-pdf_run_contents_object(pdf_csi *csi, pdf_obj *rdb, pdf_obj *contents)
+pdf_run_contents_object(pdf_csi *csi, pdf_obj *rdb, pdf_obj *contents, int cache)
 {
 	fz_context *ctx = csi->dev->ctx;
+	pdf_csi_prog *prog = NULL;
+	pdf_csi_prog *existing;
 	fz_stream *file = NULL;
 
+	fz_var(prog);
+
 	if (contents == NULL)
 		return;
 
-	file = pdf_open_contents_stream(csi->xref, contents);
+	if (cache && pdf_is_indirect(contents))
+		prog = fz_find_item(ctx, pdf_free_csi_prog_imp, contents, &pdf_csi_obj_prog_store_type);
+	else
+		cache = 0;
+
+	if (!prog)
+	{
+		file = pdf_open_contents_stream(csi->xref, contents);
+		if (file == NULL)
+			return;
+	}
+
 	fz_try(ctx)
 	{
-		pdf_run_contents_stream(csi, rdb, file);
+		if (!prog)
+			prog = pdf_new_csi_prog(ctx, cache ? 0 : PDF_CSI_CHUNK);
+		pdf_run_contents_stream(csi, rdb, prog, file);
+		if (file && cache && pdf_csi_prog_is_complete(prog))
+		{
+			existing = fz_store_item(ctx, contents, prog, pdf_csi_prog_size(prog), &pdf_csi_obj_prog_store_type);
+			if (existing)
+				pdf_drop_csi_prog(ctx, existing);
+		}
 	}
 	fz_always(ctx)
 	{
+		if (prog)
+			pdf_drop_csi_prog(ctx, prog);
 		fz_close(file);
 	}
 	fz_catch(ctx)
@@ -2768,18 +3274,37 @@ static void
 pdf_run_contents_buffer(pdf_csi *csi, pdf_obj *rdb, fz_buffer *contents)
 {
 	fz_context *ctx = csi->dev->ctx;
+	pdf_csi_prog *prog = NULL;
+	pdf_csi_prog *existing;
 	fz_stream *file = NULL;
 
+	fz_var(prog);
+
 	if (contents == NULL)
 		return;
 
-	file = fz_open_buffer(ctx, contents);
+	prog = fz_find_item(ctx, pdf_free_csi_prog_imp, contents, &pdf_csi_prog_store_type);
+	if (!prog)
+		file = fz_open_buffer(ctx, contents);
+
 	fz_try(ctx)
 	{
-		pdf_run_contents_stream(csi, rdb, file);
+		if (!prog)
+			prog = pdf_new_csi_prog(ctx, 0);
+		pdf_run_contents_stream(csi, rdb, prog, file);
+		if (file && pdf_csi_prog_is_complete(prog))
+		{
+			existing = fz_find_item(ctx, pdf_free_csi_prog_imp, contents, &pdf_csi_prog_store_type);
+			if (existing)
+				pdf_drop_csi_prog(ctx, existing);
+			else
+				fz_store_item(ctx, contents, prog, pdf_csi_prog_size(prog) + contents->cap, &pdf_csi_prog_store_type);
+		}
 	}
 	fz_always(ctx)
 	{
+		if (prog)
+			pdf_drop_csi_prog(ctx, prog);
 		fz_close(file);
 	}
 	fz_catch(ctx)
@@ -2804,7 +3329,7 @@ pdf_run_page_with_usage(pdf_document *xref, pdf_page *page, fz_device *dev, fz_m
 	csi = pdf_new_csi(xref, dev, ctm, event, cookie, NULL);
 	fz_try(ctx)
 	{
-		pdf_run_contents_object(csi, page->resources, page->contents);
+		pdf_run_contents_object(csi, page->resources, page->contents, 0);
 	}
 	fz_always(ctx)
 	{
@@ -23,6 +23,37 @@
 #define RANGE_A_F \
 	'A':case'B':case'C':case'D':case'E':case'F'
 
+/*
+ * Character classes for scanning tokens held entirely in the stream
+ * buffer. Tokens that run up to the end of the buffer are lexed again
+ * a byte at a time, so that the buffer can be refilled.
+ */
+
+#define CC_WHITE 1
+#define CC_DELIM 2
+#define CC_DIGIT 4
+#define CC_HASH 8
+
+static const unsigned char pdf_char_class[256] =
+{
+	1,0,0,0,0,0,0,0,0,1,1,0,1,1,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	1,0,0,8,0,2,0,0,2,2,0,0,0,0,0,2,
+	4,4,4,4,4,4,4,4,4,4,0,0,2,0,2,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,2,0,2,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,2,0,2,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+};
+
 static inline int iswhite(int ch)
 {
 	return
@@ -46,6 +77,10 @@ static void
 lex_white(fz_stream *f)
 {
 	int c;
+	while (f->rp < f->wp && (pdf_char_class[*f->rp] & CC_WHITE))
+		f->rp++;
+	if (f->rp < f->wp)
+		return;
 	do {
 		c = fz_read_byte(f);
 	} while ((c <= 32) && (iswhite(c)));
@@ -57,11 +92,76 @@ static void
 lex_comment(fz_stream *f)
 {
 	int c;
+	while (f->rp < f->wp)
+	{
+		c = *f->rp++;
+		if (c == '\012' || c == '\015')
+			return;
+	}
 	do {
 		c = fz_read_byte(f);
 	} while ((c != '\012') && (c != '\015') && (c != EOF));
 }
 
+/* As lex_number, or -1 if the number may continue past the buffer */
+static int
+lex_number_fast(fz_stream *f, pdf_lexbuf *buf, int c)
+{
+	unsigned char *p = f->rp;
+	unsigned char *e = f->wp;
+	int neg = 0;
+	int i = 0;
+	int n, d;
+	float v;
+
+	switch (c)
+	{
+	case '.':
+		goto after_dot;
+	case '-':
+		neg = 1;
+		break;
+	case '+':
+		break;
+	default:
+		i = c - '0';
+		break;
+	}
+
+	while (p < e && (pdf_char_class[*p] & CC_DIGIT))
+		i = 10*i + *p++ - '0';
+	if (p == e)
+		return -1;
+	if (*p != '.')
+	{
+		f->rp = p;
+		buf->i = neg ? -i : i;
+		return PDF_TOK_INT;
+	}
+	p++;
+
+after_dot:
+	n = 0;
+	d = 1;
+	while (p < e && (pdf_char_class[*p] & CC_DIGIT))
+	{
+		/* Ignore digits that are too small to matter */
+		if (d < INT_MAX/10)
+		{
+			n = n*10 + (*p - '0');
+			d *= 10;
+		}
+		p++;
+	}
+	if (p == e)
+		return -1;
+
+	v = (float)i + ((float)n / (float)d);
+	f->rp = p;
+	buf->f = neg ? -v : v;
+	return PDF_TOK_REAL;
+}
+
 static int
 lex_number(fz_stream *f, pdf_lexbuf *buf, int c)
 {
@@ -162,6 +262,20 @@ lex_name(fz_stream *f, pdf_lexbuf *buf)
 {
 	char *s = buf->scratch;
 	int n = buf->size;
+	unsigned char *p = f->rp;
+
+	/* Copy names without escapes straight out of the buffer */
+	while (p < f->wp && !(pdf_char_class[*p] & (CC_WHITE | CC_DELIM | CC_HASH)))
+		p++;
+	if (p < f->wp && *p != '#' && p - f->rp < n)
+	{
+		n = p - f->rp;
+		memcpy(s, f->rp, n);
+		s[n] = '\0';
+		buf->len = n;
+		f->rp = p;
+		return;
+	}
 
 	while (n > 1)
 	{
@@ -372,42 +486,49 @@ end:
 	return PDF_TOK_STRING;
 }
 
-static int
-pdf_token_from_keyword(char *key)
+/* Keywords by a perfect hash of their length and first character */
+static const struct { char *name; int tok; } pdf_keywords[32] =
 {
-	switch (*key)
-	{
-	case 'R':
-		if (!strcmp(key, "R")) return PDF_TOK_R;
-		break;
-	case 't':
-		if (!strcmp(key, "true")) return PDF_TOK_TRUE;
-		if (!strcmp(key, "trailer")) return PDF_TOK_TRAILER;
-		break;
-	case 'f':
-		if (!strcmp(key, "false")) return PDF_TOK_FALSE;
-		break;
-	case 'n':
-		if (!strcmp(key, "null")) return PDF_TOK_NULL;
-		break;
-	case 'o':
-		if (!strcmp(key, "obj")) return PDF_TOK_OBJ;
-		break;
-	case 'e':
-		if (!strcmp(key, "endobj")) return PDF_TOK_ENDOBJ;
-		if (!strcmp(key, "endstream")) return PDF_TOK_ENDSTREAM;
-		break;
-	case 's':
-		if (!strcmp(key, "stream")) return PDF_TOK_STREAM;
-		if (!strcmp(key, "startxref")) return PDF_TOK_STARTXREF;
-		break;
-	case 'x':
-		if (!strcmp(key, "xref")) return PDF_TOK_XREF;
-		break;
-	default:
-		break;
-	}
+	{ "xref", PDF_TOK_XREF },
+	{ NULL, 0 },
+	{ "trailer", PDF_TOK_TRAILER },
+	{ NULL, 0 },
+	{ NULL, 0 },
+	{ "startxref", PDF_TOK_STARTXREF },
+	{ NULL, 0 },
+	{ NULL, 0 },
+	{ NULL, 0 },
+	{ NULL, 0 },
+	{ NULL, 0 },
+	{ NULL, 0 },
+	{ NULL, 0 },
+	{ NULL, 0 },
+	{ NULL, 0 },
+	{ NULL, 0 },
+	{ "false", PDF_TOK_FALSE },
+	{ "endobj", PDF_TOK_ENDOBJ },
+	{ NULL, 0 },
+	{ NULL, 0 },
+	{ "R", PDF_TOK_R },
+	{ "obj", PDF_TOK_OBJ },
+	{ "null", PDF_TOK_NULL },
+	{ "endstream", PDF_TOK_ENDSTREAM },
+	{ NULL, 0 },
+	{ NULL, 0 },
+	{ NULL, 0 },
+	{ NULL, 0 },
+	{ "true", PDF_TOK_TRUE },
+	{ NULL, 0 },
+	{ NULL, 0 },
+	{ "stream", PDF_TOK_STREAM },
+};
 
+static int
+pdf_token_from_keyword(char *key, int len)
+{
+	int h = (2 * len + (unsigned char)key[0]) & 31;
+	if (pdf_keywords[h].name && !strcmp(pdf_keywords[h].name, key))
+		return pdf_keywords[h].tok;
 	return PDF_TOK_KEYWORD;
 }
 
@@ -494,11 +615,16 @@ pdf_lex(fz_stream *f, pdf_lexbuf *buf)
 		case '}':
 			return PDF_TOK_CLOSE_BRACE;
 		case IS_NUMBER:
-			return lex_number(f, buf, c);
+		{
+			int tok = lex_number_fast(f, buf, c);
+			if (tok < 0)
+				tok = lex_number(f, buf, c);
+			return tok;
+		}
 		default: /* isregular: !isdelim && !iswhite && c != EOF */
 			fz_unread_byte(f);
 			lex_name(f, buf);
-			return pdf_token_from_keyword(buf->scratch);
+			return pdf_token_from_keyword(buf->scratch, buf->len);
 		}
 	}
 }
@@ -88,6 +88,23 @@ pdf_end_vmtx(fz_context *ctx, pdf_font_desc *font)
 
 pdf_hmtx
 pdf_lookup_hmtx(fz_context *ctx, pdf_font_desc *font, int cid)
+{
+	pdf_cid_block *block;
+	pdf_hmtx h;
+
+	block = pdf_load_cid_block(ctx, font, cid);
+	if (block)
+	{
+		h.lo = h.hi = cid;
+		h.w = block->w[cid & 255];
+		return h;
+	}
+
+	return pdf_search_hmtx(ctx, font, cid);
+}
+
+pdf_hmtx
+pdf_search_hmtx(fz_context *ctx, pdf_font_desc *font, int cid)
 {
 	int l = 0;
 	int r = font->hmtx_len - 1;
@@ -43,6 +43,7 @@ struct pdf_obj_s
 		struct {
 			char sorted;
 			char marked;
+			char hashed;
 			int len;
 			int cap;
 			struct keyval *items;
@@ -55,11 +56,18 @@ struct pdf_obj_s
 	} u;
 };
 
+/* Objects of a fixed size come from a slab, see pdf_alloc_obj */
+static pdf_obj *pdf_alloc_obj(fz_context *ctx);
+static void pdf_free_obj(pdf_obj *obj);
+static pdf_obj *pdf_shared_obj(fz_context *ctx, pdf_objkind kind, int b);
+
 pdf_obj *
 pdf_new_null(fz_context *ctx)
 {
-	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(null)");
+	pdf_obj *obj = pdf_shared_obj(ctx, PDF_NULL, 0);
+	if (obj)
+		return obj;
+	obj = Memento_label(pdf_alloc_obj(ctx), "pdf_obj(null)");
 	obj->ctx = ctx;
 	obj->refs = 1;
 	obj->kind = PDF_NULL;
@@ -69,8 +77,10 @@ pdf_new_null(fz_context *ctx)
 pdf_obj *
 pdf_new_bool(fz_context *ctx, int b)
 {
-	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(bool)");
+	pdf_obj *obj = pdf_shared_obj(ctx, PDF_BOOL, b);
+	if (obj)
+		return obj;
+	obj = Memento_label(pdf_alloc_obj(ctx), "pdf_obj(bool)");
 	obj->ctx = ctx;
 	obj->refs = 1;
 	obj->kind = PDF_BOOL;
@@ -82,7 +92,7 @@ pdf_obj *
 pdf_new_int(fz_context *ctx, int i)
 {
 	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(int)");
+	obj = Memento_label(pdf_alloc_obj(ctx), "pdf_obj(int)");
 	obj->ctx = ctx;
 	obj->refs = 1;
 	obj->kind = PDF_INT;
@@ -94,7 +104,7 @@ pdf_obj *
 pdf_new_real(fz_context *ctx, float f)
 {
 	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(real)");
+	obj = Memento_label(pdf_alloc_obj(ctx), "pdf_obj(real)");
 	obj->ctx = ctx;
 	obj->refs = 1;
 	obj->kind = PDF_REAL;
@@ -116,23 +126,412 @@ pdf_new_string(fz_context *ctx, char *str, int len)
 	return obj;
 }
 
-pdf_obj *
-fz_new_name(fz_context *ctx, char *str)
+/*
+ * Name objects are interned in a table shared by a context and its
+ * clones, so that each distinct name is allocated once and dictionary
+ * keys can be compared by pointer. Interned names live as long as the
+ * table; their reference count is -1, which keep and drop leave alone,
+ * so they can be shared between threads. Their ctx is NULL, because the
+ * context that made one may be a clone that is freed long before the
+ * name is; code that warns or allocates must take its context from the
+ * caller or from an unshared object, never from an interned one.
+ *
+ * Once the table holds PDF_NAME_INTERN_MAX names (only a damaged or
+ * hostile file gets there), fz_new_name goes on to make ordinary
+ * reference counted names. Those still work as dictionary keys, which
+ * fall back to strcmp whenever either side is not interned, so the
+ * only cost is speed, and the first one made warns about it.
+ *
+ * The table also owns the null, true and false objects, which are
+ * immutable and so shared in the same way (with a NULL ctx too), and
+ * the slabs of pdf_obj headers from which the other fixed size objects
+ * are carved. All but one of the slabs are freed whenever the last
+ * object carved from them is, which happens at the latest when the last
+ * open document is closed, so the peak of one document is not kept for
+ * the life of the process.
+ */
+
+#define PDF_NAME_INTERN_MAX 65536
+#define PDF_OBJ_SLAB 256
+
+typedef struct pdf_obj_slab_s pdf_obj_slab;
+
+struct pdf_obj_slab_s
+{
+	pdf_obj_slab *next;
+	pdf_obj objs[PDF_OBJ_SLAB];
+};
+
+struct fz_name_context_s
+{
+	int refs;
+	int len;
+	int cap; /* a power of two */
+	pdf_obj **table;
+	pdf_obj *null_obj;
+	pdf_obj *true_obj;
+	pdf_obj *false_obj;
+	int warned_full;
+	pdf_obj_slab *slabs;
+	void *free_objs; /* free list threaded through unused objs */
+	int live_objs; /* objs handed out from the slabs */
+};
+
+#define IS_INTERNED(obj) ((obj)->refs < 0)
+
+/* Interned when the name context is created */
+static const char *pdf_well_known_names[] =
+{
+	"Type", "Subtype", "Length", "Filter", "DecodeParms", "Parent",
+	"Kids", "Count", "Root", "Info", "Size", "Prev", "Index", "W",
+	"XRefStm", "ObjStm", "XRef", "N", "First", "Extends", "Catalog",
+	"Pages", "Page", "Resources", "Contents", "MediaBox", "CropBox",
+	"Rotate", "Annots", "Font", "XObject", "ExtGState", "ColorSpace",
+	"Pattern", "Shading", "Properties", "ProcSet", "Image", "Form",
+	"BBox", "Matrix", "Width", "Height", "BitsPerComponent",
+	"ImageMask", "Decode", "Mask", "SMask", "Interpolate", "BaseFont",
+	"Encoding", "FontDescriptor", "FirstChar", "LastChar", "Widths",
+	"ToUnicode", "DescendantFonts", "CIDSystemInfo", "Registry",
+	"Ordering", "Supplement", "DW", "FontName", "Flags", "FontBBox",
+	"ItalicAngle", "Ascent", "Descent", "CapHeight", "StemV",
+	"FontFile", "FontFile2", "FontFile3", "Differences", "Type0",
+	"Type1", "Type3", "TrueType", "CIDFontType0", "CIDFontType2",
+	"WinAnsiEncoding", "MacRomanEncoding", "Identity-H", "Identity-V",
+	"FlateDecode", "LZWDecode", "DCTDecode", "ASCIIHexDecode",
+	"ASCII85Decode", "RunLengthDecode", "CCITTFaxDecode", "JBIG2Decode",
+	"JPXDecode", "Predictor", "Colors", "Columns", "DeviceGray",
+	"DeviceRGB", "DeviceCMYK", "ICCBased", "Indexed", "Separation",
+	"DeviceN", "CA", "ca", "BM", "Normal", "Group", "Transparency",
+	"Annot", "Link", "Widget", "Rect", "Border", "Dest", "A", "S",
+	"URI", "GoTo", "AP", "AS", "F", "D", "Outlines", "Title", "Next",
+	NULL
+};
+
+static unsigned
+pdf_name_hash(char *s)
+{
+	unsigned h = 0;
+	while (*s)
+		h = h * 31 + (unsigned char)*s++;
+	return h;
+}
+
+/* Called with FZ_LOCK_ALLOC held */
+static pdf_obj *
+pdf_find_name(fz_name_context *names, char *str, unsigned h)
+{
+	unsigned mask = names->cap - 1;
+	unsigned pos = h & mask;
+	pdf_obj *obj;
+
+	while ((obj = names->table[pos]) != NULL)
+	{
+		if (!strcmp(obj->u.n, str))
+			return obj;
+		pos = (pos + 1) & mask;
+	}
+	return NULL;
+}
+
+static void
+pdf_insert_name(pdf_obj **table, int cap, pdf_obj *obj, unsigned h)
+{
+	unsigned pos = h & (cap - 1);
+	while (table[pos])
+		pos = (pos + 1) & (cap - 1);
+	table[pos] = obj;
+}
+
+/* Called without FZ_LOCK_ALLOC held, as it allocates */
+static int
+pdf_grow_names(fz_context *ctx, fz_name_context *names, int cap)
+{
+	pdf_obj **table, **old;
+	int i;
+
+	table = fz_malloc_array_no_throw(ctx, cap * 2, sizeof(pdf_obj *));
+	if (!table)
+		return 0;
+	memset(table, 0, cap * 2 * sizeof(pdf_obj *));
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (names->cap != cap)
+	{
+		/* Another thread grew it first */
+		old = table;
+	}
+	else
+	{
+		old = names->table;
+		for (i = 0; i < cap; i++)
+			if (old[i])
+				pdf_insert_name(table, cap * 2, old[i], pdf_name_hash(old[i]->u.n));
+		names->table = table;
+		names->cap = cap * 2;
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	fz_free(ctx, old);
+	return 1;
+}
+
+static pdf_obj *
+pdf_new_name_imp(fz_context *ctx, char *str, int refs)
 {
 	pdf_obj *obj;
 	obj = Memento_label(fz_malloc(ctx, offsetof(pdf_obj, u.n) + strlen(str) + 1), "pdf_obj(name)");
-	obj->ctx = ctx;
-	obj->refs = 1;
+	obj->ctx = refs < 0 ? NULL : ctx;
+	obj->refs = refs;
 	obj->kind = PDF_NAME;
 	strcpy(obj->u.n, str);
 	return obj;
 }
 
+pdf_obj *
+fz_new_name(fz_context *ctx, char *str)
+{
+	fz_name_context *names = ctx->name;
+	pdf_obj *obj, *mine = NULL;
+	unsigned h;
+	int cap, full, warn;
+
+	if (!names)
+		return pdf_new_name_imp(ctx, str, 1);
+
+	h = pdf_name_hash(str);
+	while (1)
+	{
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		obj = pdf_find_name(names, str, h);
+		full = names->len >= PDF_NAME_INTERN_MAX;
+		warn = !obj && full && !names->warned_full;
+		if (warn)
+			names->warned_full = 1;
+		if (!obj && mine && !full && (names->len + 1) * 4 <= names->cap * 3)
+		{
+			pdf_insert_name(names->table, names->cap, mine, h);
+			names->len++;
+			obj = mine;
+			mine = NULL;
+		}
+		cap = names->cap;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+		if (obj)
+			break;
+
+		if (full)
+		{
+			if (warn)
+				fz_warn(ctx, "more than %d distinct names; no longer interning them", PDF_NAME_INTERN_MAX);
+			if (!mine)
+				return pdf_new_name_imp(ctx, str, 1);
+			mine->ctx = ctx;
+			mine->refs = 1;
+			return mine;
+		}
+
+		if (!mine)
+			mine = pdf_new_name_imp(ctx, str, -1);
+		else if (!pdf_grow_names(ctx, names, cap))
+		{
+			mine->ctx = ctx;
+			mine->refs = 1;
+			return mine;
+		}
+	}
+
+	/* Another thread interned the same name while we made ours */
+	if (mine)
+		fz_free(ctx, mine);
+
+	return obj;
+}
+
+static pdf_obj *
+pdf_alloc_obj(fz_context *ctx)
+{
+#ifdef MEMENTO
+	return fz_malloc(ctx, sizeof(pdf_obj));
+#else
+	fz_name_context *names = ctx->name;
+	pdf_obj_slab *slab;
+	void *obj;
+	int i;
+
+	if (!names)
+		return fz_malloc(ctx, sizeof(pdf_obj));
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	obj = names->free_objs;
+	if (obj)
+	{
+		names->free_objs = *(void **)obj;
+		names->live_objs++;
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (obj)
+		return obj;
+
+	/* Keep the first object of a new slab and free the rest */
+	slab = fz_malloc(ctx, sizeof(pdf_obj_slab));
+	for (i = 1; i < PDF_OBJ_SLAB - 1; i++)
+		*(void **)&slab->objs[i] = &slab->objs[i + 1];
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	*(void **)&slab->objs[PDF_OBJ_SLAB - 1] = names->free_objs;
+	names->free_objs = &slab->objs[1];
+	slab->next = names->slabs;
+	names->slabs = slab;
+	names->live_objs++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	return &slab->objs[0];
+#endif
+}
+
+static void
+pdf_free_obj(pdf_obj *obj)
+{
+#ifdef MEMENTO
+	fz_free(obj->ctx, obj);
+#else
+	fz_context *ctx = obj->ctx;
+	fz_name_context *names = ctx->name;
+	pdf_obj_slab *slab = NULL, *next;
+	int i;
+
+	if (!names)
+	{
+		fz_free(ctx, obj);
+		return;
+	}
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	*(void **)obj = names->free_objs;
+	names->free_objs = obj;
+	if (--names->live_objs == 0 && names->slabs->next)
+	{
+		/* Nothing is carved from the slabs any more; keep one for
+		 * the next document and give the rest back */
+		slab = names->slabs->next;
+		names->slabs->next = NULL;
+		for (i = 0; i < PDF_OBJ_SLAB - 1; i++)
+			*(void **)&names->slabs->objs[i] = &names->slabs->objs[i + 1];
+		*(void **)&names->slabs->objs[PDF_OBJ_SLAB - 1] = NULL;
+		names->free_objs = &names->slabs->objs[0];
+	}
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	while (slab)
+	{
+		next = slab->next;
+		fz_free(ctx, slab);
+		slab = next;
+	}
+#endif
+}
+
+/* The shared null, true or false object, or NULL without a name context */
+static pdf_obj *
+pdf_shared_obj(fz_context *ctx, pdf_objkind kind, int b)
+{
+	if (!ctx->name)
+		return NULL;
+	if (kind == PDF_NULL)
+		return ctx->name->null_obj;
+	return b ? ctx->name->true_obj : ctx->name->false_obj;
+}
+
+static pdf_obj *
+pdf_new_shared_obj(fz_context *ctx, pdf_objkind kind, int b)
+{
+	pdf_obj *obj = fz_malloc(ctx, sizeof(pdf_obj));
+	obj->ctx = NULL;
+	obj->refs = -1;
+	obj->kind = kind;
+	obj->u.b = b;
+	return obj;
+}
+
+void
+fz_new_name_context(fz_context *ctx)
+{
+	fz_name_context *names;
+	int i;
+
+	names = fz_malloc_struct(ctx, fz_name_context);
+	names->refs = 1;
+	names->len = 0;
+	names->cap = 1024;
+	fz_try(ctx)
+	{
+		names->table = fz_malloc_array(ctx, names->cap, sizeof(pdf_obj *));
+		memset(names->table, 0, names->cap * sizeof(pdf_obj *));
+		names->null_obj = pdf_new_shared_obj(ctx, PDF_NULL, 0);
+		names->true_obj = pdf_new_shared_obj(ctx, PDF_BOOL, 1);
+		names->false_obj = pdf_new_shared_obj(ctx, PDF_BOOL, 0);
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, names->null_obj);
+		fz_free(ctx, names->true_obj);
+		fz_free(ctx, names->table);
+		fz_free(ctx, names);
+		fz_rethrow(ctx);
+	}
+	ctx->name = names;
+
+	for (i = 0; pdf_well_known_names[i]; i++)
+		fz_new_name(ctx, (char *)pdf_well_known_names[i]);
+}
+
+fz_name_context *
+fz_keep_name_context(fz_context *ctx)
+{
+	if (!ctx || !ctx->name)
+		return NULL;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	ctx->name->refs++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	return ctx->name;
+}
+
+void
+fz_drop_name_context(fz_context *ctx)
+{
+	fz_name_context *names;
+	int i, drop;
+
+	if (!ctx || !ctx->name)
+		return;
+	names = ctx->name;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	drop = --names->refs;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	ctx->name = NULL;
+	if (drop == 0)
+	{
+		pdf_obj_slab *slab;
+		for (i = 0; i < names->cap; i++)
+			if (names->table[i])
+				fz_free(ctx, names->table[i]);
+		fz_free(ctx, names->table);
+		fz_free(ctx, names->null_obj);
+		fz_free(ctx, names->true_obj);
+		fz_free(ctx, names->false_obj);
+		while (names->slabs)
+		{
+			slab = names->slabs;
+			names->slabs = slab->next;
+			fz_free(ctx, slab);
+		}
+		fz_free(ctx, names);
+	}
+}
+
 pdf_obj *
 pdf_new_indirect(fz_context *ctx, int num, int gen, void *xref)
 {
 	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(indirect)");
+	obj = Memento_label(pdf_alloc_obj(ctx), "pdf_obj(indirect)");
 	obj->ctx = ctx;
 	obj->refs = 1;
 	obj->kind = PDF_INDIRECT;
@@ -145,7 +544,7 @@ pdf_new_indirect(fz_context *ctx, int num, int gen, void *xref)
 pdf_obj *
 pdf_keep_obj(pdf_obj *obj)
 {
-	if (obj)
+	if (obj && !IS_INTERNED(obj))
 		obj->refs ++;
 	return obj;
 }
@@ -360,6 +759,8 @@ pdf_objcmp(pdf_obj *a, pdf_obj *b)
 		return memcmp(a->u.s.buf, b->u.s.buf, a->u.s.len);
 
 	case PDF_NAME:
+		if (IS_INTERNED(a) && IS_INTERNED(b))
+			return 1; /* distinct interned names differ */
 		return strcmp(a->u.n, b->u.n);
 
 	case PDF_INDIRECT:
@@ -417,7 +818,7 @@ pdf_new_array(fz_context *ctx, int initialcap)
 	pdf_obj *obj;
 	int i;
 
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(array)");
+	obj = Memento_label(pdf_alloc_obj(ctx), "pdf_obj(array)");
 	obj->ctx = ctx;
 	obj->refs = 1;
 	obj->kind = PDF_ARRAY;
@@ -502,7 +903,7 @@ pdf_array_put(pdf_obj *obj, int i, pdf_obj *item)
 {
 	RESOLVE(obj);
 
-	if (!obj)
+	if (!obj || IS_INTERNED(obj))
 		return; /* Can't warn :( */
 	if (obj->kind != PDF_ARRAY)
 		fz_warn(obj->ctx, "assert: not an array (%s)", pdf_objkindstr(obj));
@@ -522,7 +923,7 @@ pdf_array_push(pdf_obj *obj, pdf_obj *item)
 {
 	RESOLVE(obj);
 
-	if (!obj)
+	if (!obj || IS_INTERNED(obj))
 		return; /* Can't warn :( */
 	if (obj->kind != PDF_ARRAY)
 		fz_warn(obj->ctx, "assert: not an array (%s)", pdf_objkindstr(obj));
@@ -540,7 +941,7 @@ pdf_array_insert(pdf_obj *obj, pdf_obj *item)
 {
 	RESOLVE(obj);
 
-	if (!obj)
+	if (!obj || IS_INTERNED(obj))
 		return; /* Can't warn :( */
 	if (obj->kind != PDF_ARRAY)
 		fz_warn(obj->ctx, "assert: not an array (%s)", pdf_objkindstr(obj));
@@ -674,13 +1075,14 @@ pdf_new_dict(fz_context *ctx, int initialcap)
 	pdf_obj *obj;
 	int i;
 
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(dict)");
+	obj = Memento_label(pdf_alloc_obj(ctx), "pdf_obj(dict)");
 	obj->ctx = ctx;
 	obj->refs = 1;
 	obj->kind = PDF_DICT;
 
 	obj->u.d.sorted = 0;
 	obj->u.d.marked = 0;
+	obj->u.d.hashed = 0;
 	obj->u.d.len = 0;
 	obj->u.d.cap = initialcap > 1 ? initialcap : 10;
 
@@ -702,20 +1104,132 @@ pdf_new_dict(fz_context *ctx, int initialcap)
 	return obj;
 }
 
+/*
+ * Dictionaries with more than PDF_DICT_HASH_MIN keys are indexed by a
+ * hash of the key names. The index is an open addressing table of item
+ * positions plus one, stored after the items in the same allocation.
+ * Keys are appended to hashed dictionaries rather than kept sorted.
+ */
+
+#define PDF_DICT_HASH_MIN 32
+#define PDF_DICT_HASH(obj) ((int *)((obj)->u.d.items + (obj)->u.d.cap))
+
+static int
+pdf_dict_hash_cap(int cap)
+{
+	int n = 64;
+	while (n < cap * 2)
+		n <<= 1;
+	return n;
+}
+
+static void
+pdf_dict_hash_insert(pdf_obj *obj, int i)
+{
+	int *hash = PDF_DICT_HASH(obj);
+	unsigned mask = pdf_dict_hash_cap(obj->u.d.cap) - 1;
+	unsigned h = pdf_name_hash(pdf_to_name(obj->u.d.items[i].k)) & mask;
+
+	while (hash[h])
+		h = (h + 1) & mask;
+	hash[h] = i + 1;
+}
+
+static unsigned
+pdf_dict_hash_slot(pdf_obj *obj, int i)
+{
+	int *hash = PDF_DICT_HASH(obj);
+	unsigned mask = pdf_dict_hash_cap(obj->u.d.cap) - 1;
+	unsigned h = pdf_name_hash(pdf_to_name(obj->u.d.items[i].k)) & mask;
+
+	while (hash[h] != i + 1)
+		h = (h + 1) & mask;
+	return h;
+}
+
+/* Called before item i is replaced by the last item */
 static void
-pdf_dict_grow(pdf_obj *obj)
+pdf_dict_hash_remove(pdf_obj *obj, int i)
+{
+	int *hash = PDF_DICT_HASH(obj);
+	unsigned mask = pdf_dict_hash_cap(obj->u.d.cap) - 1;
+	unsigned s, j, home;
+	int last = obj->u.d.len - 1;
+
+	/* Close the gap so that later probes still reach their keys */
+	s = pdf_dict_hash_slot(obj, i);
+	j = s;
+	while (1)
+	{
+		j = (j + 1) & mask;
+		if (!hash[j])
+			break;
+		home = pdf_name_hash(pdf_to_name(obj->u.d.items[hash[j] - 1].k)) & mask;
+		if (((j - home) & mask) >= ((j - s) & mask))
+		{
+			hash[s] = hash[j];
+			s = j;
+		}
+	}
+	hash[s] = 0;
+
+	if (i != last)
+		hash[pdf_dict_hash_slot(obj, last)] = i + 1;
+}
+
+static void
+pdf_dict_rehash(pdf_obj *obj)
 {
 	int i;
-	int new_cap = (obj->u.d.cap * 3) / 2;
 
-	obj->u.d.items = fz_resize_array(obj->ctx, obj->u.d.items, new_cap, sizeof(struct keyval));
+	memset(PDF_DICT_HASH(obj), 0, pdf_dict_hash_cap(obj->u.d.cap) * sizeof(int));
+	for (i = 0; i < obj->u.d.len; i++)
+		pdf_dict_hash_insert(obj, i);
+}
+
+/* keyobj, if not NULL, is the name object for key */
+static int
+pdf_dict_hash_find(pdf_obj *obj, char *key, pdf_obj *keyobj)
+{
+	int *hash = PDF_DICT_HASH(obj);
+	unsigned mask = pdf_dict_hash_cap(obj->u.d.cap) - 1;
+	unsigned h = pdf_name_hash(key) & mask;
+	pdf_obj *k;
+	int i;
+
+	while ((i = hash[h]) != 0)
+	{
+		k = obj->u.d.items[i - 1].k;
+		if (k == keyobj)
+			return i - 1;
+		if (!(keyobj && IS_INTERNED(keyobj) && IS_INTERNED(k)) && strcmp(k->u.n, key) == 0)
+			return i - 1;
+		h = (h + 1) & mask;
+	}
+
+	return -1;
+}
+
+static void
+pdf_dict_resize(pdf_obj *obj, int new_cap, int hashed)
+{
+	int i;
+	int size = new_cap * sizeof(struct keyval);
+
+	if (hashed)
+		size += pdf_dict_hash_cap(new_cap) * sizeof(int);
+	obj->u.d.items = fz_resize_array(obj->ctx, obj->u.d.items, size, 1);
 	obj->u.d.cap = new_cap;
+	obj->u.d.hashed = hashed;
 
 	for (i = obj->u.d.len; i < obj->u.d.cap; i++)
 	{
 		obj->u.d.items[i].k = NULL;
 		obj->u.d.items[i].v = NULL;
 	}
+
+	if (hashed)
+		pdf_dict_rehash(obj);
 }
 
 pdf_obj *
@@ -776,7 +1290,14 @@ pdf_dict_get_val(pdf_obj *obj, int i)
 static int
 pdf_dict_finds(pdf_obj *obj, char *key, int *location)
 {
-	if (obj->u.d.sorted && obj->u.d.len > 0)
+	if (obj->u.d.hashed)
+	{
+		if (location)
+			*location = obj->u.d.len;
+		return pdf_dict_hash_find(obj, key, NULL);
+	}
+
+	else if (obj->u.d.sorted && obj->u.d.len > 0)
 	{
 		int l = 0;
 		int r = obj->u.d.len - 1;
@@ -808,8 +1329,11 @@ pdf_dict_finds(pdf_obj *obj, char *key, int *location)
 	{
 		int i;
 		for (i = 0; i < obj->u.d.len; i++)
-			if (strcmp(pdf_to_name(obj->u.d.items[i].k), key) == 0)
+		{
+			char *k = pdf_to_name(obj->u.d.items[i].k);
+			if (k[0] == key[0] && strcmp(k, key) == 0)
 				return i;
+		}
 
 		if (location)
 			*location = obj->u.d.len;
@@ -818,6 +1342,38 @@ pdf_dict_finds(pdf_obj *obj, char *key, int *location)
 	return -1;
 }
 
+/* As pdf_dict_finds, comparing interned names by pointer */
+static int
+pdf_dict_find(pdf_obj *obj, pdf_obj *key, int *location)
+{
+	pdf_obj *k;
+	int i;
+
+	if (obj->u.d.hashed)
+	{
+		if (location)
+			*location = obj->u.d.len;
+		return pdf_dict_hash_find(obj, key->u.n, key);
+	}
+
+	if (obj->u.d.sorted || !IS_INTERNED(key))
+		return pdf_dict_finds(obj, key->u.n, location);
+
+	for (i = 0; i < obj->u.d.len; i++)
+	{
+		k = obj->u.d.items[i].k;
+		if (k == key)
+			return i;
+		if (!IS_INTERNED(k) && strcmp(k->u.n, key->u.n) == 0)
+			return i;
+	}
+
+	if (location)
+		*location = obj->u.d.len;
+
+	return -1;
+}
+
 pdf_obj *
 pdf_dict_gets(pdf_obj *obj, char *key)
 {
@@ -840,6 +1396,10 @@ pdf_dict_getp(pdf_obj *obj, char *keys)
 	char buf[256];
 	char *k, *e;
 
+	RESOLVE(obj);
+	if (!obj || IS_INTERNED(obj))
+		return NULL;
+
 	if (strlen(keys)+1 > 256)
 		fz_throw(obj->ctx, "buffer overflow in pdf_dict_getp");
 
@@ -867,9 +1427,20 @@ pdf_dict_getp(pdf_obj *obj, char *keys)
 pdf_obj *
 pdf_dict_get(pdf_obj *obj, pdf_obj *key)
 {
+	int i;
+
 	if (!key || key->kind != PDF_NAME)
 		return NULL;
-	return pdf_dict_gets(obj, pdf_to_name(key));
+
+	RESOLVE(obj);
+	if (!obj || obj->kind != PDF_DICT)
+		return NULL;
+
+	i = pdf_dict_find(obj, key, NULL);
+	if (i >= 0)
+		return obj->u.d.items[i].v;
+
+	return NULL;
 }
 
 pdf_obj *
@@ -890,7 +1461,7 @@ pdf_dict_put(pdf_obj *obj, pdf_obj *key, pdf_obj *val)
 	int i;
 
 	RESOLVE(obj);
-	if (!obj)
+	if (!obj || IS_INTERNED(obj))
 		return; /* Can't warn :( */
 	if (obj->kind != PDF_DICT)
 	{
@@ -913,10 +1484,7 @@ pdf_dict_put(pdf_obj *obj, pdf_obj *key, pdf_obj *val)
 		return;
 	}
 
-	if (obj->u.d.len > 100 && !obj->u.d.sorted)
-		pdf_sort_dict(obj);
-
-	i = pdf_dict_finds(obj, s, &location);
+	i = pdf_dict_find(obj, key, &location);
 	if (i >= 0 && i < obj->u.d.len)
 	{
 		if (obj->u.d.items[i].v != val)
@@ -927,8 +1495,18 @@ pdf_dict_put(pdf_obj *obj, pdf_obj *key, pdf_obj *val)
 	}
 	else
 	{
+		int hashed = obj->u.d.hashed || obj->u.d.len >= PDF_DICT_HASH_MIN;
+
 		if (obj->u.d.len + 1 > obj->u.d.cap)
-			pdf_dict_grow(obj);
+			pdf_dict_resize(obj, (obj->u.d.cap * 3) / 2, hashed);
+		else if (hashed != obj->u.d.hashed)
+			pdf_dict_resize(obj, obj->u.d.cap, hashed);
+
+		if (hashed)
+		{
+			obj->u.d.sorted = 0;
+			location = obj->u.d.len;
+		}
 
 		i = location;
 		if (obj->u.d.sorted && obj->u.d.len > 0)
@@ -939,13 +1517,22 @@ pdf_dict_put(pdf_obj *obj, pdf_obj *key, pdf_obj *val)
 		obj->u.d.items[i].k = pdf_keep_obj(key);
 		obj->u.d.items[i].v = pdf_keep_obj(val);
 		obj->u.d.len ++;
+
+		if (hashed)
+			pdf_dict_hash_insert(obj, i);
 	}
 }
 
 void
 pdf_dict_puts(pdf_obj *obj, char *key, pdf_obj *val)
 {
-	pdf_obj *keyobj = fz_new_name(obj->ctx, key);
+	pdf_obj *keyobj;
+
+	RESOLVE(obj);
+	if (!obj || IS_INTERNED(obj))
+		return; /* Can't warn :( */
+
+	keyobj = fz_new_name(obj->ctx, key);
 	pdf_dict_put(obj, keyobj, val);
 	pdf_drop_obj(keyobj);
 }
@@ -953,13 +1540,18 @@ pdf_dict_puts(pdf_obj *obj, char *key, pdf_obj *val)
 void
 pdf_dict_putp(pdf_obj *obj, char *keys, pdf_obj *val)
 {
-	fz_context *ctx = obj->ctx;
+	fz_context *ctx;
 	char buf[256];
 	char *k, *e;
 	pdf_obj *cobj = NULL;
 
+	RESOLVE(obj);
+	if (!obj || IS_INTERNED(obj))
+		return; /* Can't warn :( */
+	ctx = obj->ctx;
+
 	if (strlen(keys)+1 > 256)
-		fz_throw(obj->ctx, "buffer overflow in pdf_dict_getp");
+		fz_throw(ctx, "buffer overflow in pdf_dict_putp");
 
 	strcpy(buf, keys);
 
@@ -1012,7 +1604,7 @@ pdf_dict_dels(pdf_obj *obj, char *key)
 {
 	RESOLVE(obj);
 
-	if (!obj)
+	if (!obj || IS_INTERNED(obj))
 		return; /* Can't warn :( */
 	if (obj->kind != PDF_DICT)
 		fz_warn(obj->ctx, "assert: not a dict (%s)", pdf_objkindstr(obj));
@@ -1021,6 +1613,8 @@ pdf_dict_dels(pdf_obj *obj, char *key)
 		int i = pdf_dict_finds(obj, key, NULL);
 		if (i >= 0)
 		{
+			if (obj->u.d.hashed)
+				pdf_dict_hash_remove(obj, i);
 			pdf_drop_obj(obj->u.d.items[i].k);
 			pdf_drop_obj(obj->u.d.items[i].v);
 			obj->u.d.sorted = 0;
@@ -1033,9 +1627,12 @@ pdf_dict_dels(pdf_obj *obj, char *key)
 void
 pdf_dict_del(pdf_obj *obj, pdf_obj *key)
 {
+	RESOLVE(obj);
+	if (!obj || IS_INTERNED(obj))
+		return; /* Can't warn :( */
 	RESOLVE(key);
 	if (!key || key->kind != PDF_NAME)
-		fz_warn(obj->ctx, "assert: key is not a name (%s)", pdf_objkindstr(obj));
+		fz_warn(obj->ctx, "assert: key is not a name (%s)", pdf_objkindstr(key));
 	else
 		pdf_dict_dels(obj, key->u.n);
 }
@@ -1050,6 +1647,8 @@ pdf_sort_dict(pdf_obj *obj)
 	{
 		qsort(obj->u.d.items, obj->u.d.len, sizeof(struct keyval), keyvalcmp);
 		obj->u.d.sorted = 1;
+		if (obj->u.d.hashed)
+			pdf_dict_rehash(obj);
 	}
 }
 
@@ -1092,7 +1691,7 @@ pdf_free_array(pdf_obj *obj)
 		pdf_drop_obj(obj->u.a.items[i]);
 
 	fz_free(obj->ctx, obj->u.a.items);
-	fz_free(obj->ctx, obj);
+	pdf_free_obj(obj);
 }
 
 static void
@@ -1106,13 +1705,13 @@ pdf_free_dict(pdf_obj *obj)
 	}
 
 	fz_free(obj->ctx, obj->u.d.items);
-	fz_free(obj->ctx, obj);
+	pdf_free_obj(obj);
 }
 
 void
 pdf_drop_obj(pdf_obj *obj)
 {
-	if (!obj)
+	if (!obj || IS_INTERNED(obj))
 		return;
 	if (--obj->refs)
 		return;
@@ -1120,16 +1719,17 @@ pdf_drop_obj(pdf_obj *obj)
 		pdf_free_array(obj);
 	else if (obj->kind == PDF_DICT)
 		pdf_free_dict(obj);
-	else
+	else if (obj->kind == PDF_STRING || obj->kind == PDF_NAME)
 		fz_free(obj->ctx, obj);
+	else
+		pdf_free_obj(obj);
 }
 
 /* Pretty printing objects */
 
 struct fmt
 {
-	char *buf;
-	int cap;
+	FILE *fp;
 	int len;
 	int indent;
 	int tight;
@@ -1169,8 +1769,7 @@ static inline void fmt_putc(struct fmt *fmt, int c)
 	}
 	fmt->sep = 0;
 
-	if (fmt->buf && fmt->len < fmt->cap)
-		fmt->buf[fmt->len] = c;
+	putc(c, fmt->fp);
 
 	if (c == '\n')
 		fmt->col = 0;
@@ -1401,8 +2000,9 @@ static void fmt_obj(struct fmt *fmt, pdf_obj *obj)
 		fmt_puts(fmt, "<unknown object>");
 }
 
-static int
-pdf_sprint_obj(char *s, int n, pdf_obj *obj, int tight)
+/* Written straight to fp, as a shared object has no context to allocate with */
+int
+pdf_fprint_obj(FILE *fp, pdf_obj *obj, int tight)
 {
 	struct fmt fmt;
 
@@ -1412,42 +2012,14 @@ pdf_sprint_obj(char *s, int n, pdf_obj *obj, int tight)
 	fmt.last = 0;
 
 	fmt.tight = tight;
-	fmt.buf = s;
-	fmt.cap = n;
+	fmt.fp = fp;
 	fmt.len = 0;
 	fmt_obj(&fmt, obj);
-
-	if (fmt.buf && fmt.len < fmt.cap)
-		fmt.buf[fmt.len] = '\0';
+	fputc('\n', fp);
 
 	return fmt.len;
 }
 
-int
-pdf_fprint_obj(FILE *fp, pdf_obj *obj, int tight)
-{
-	char buf[1024];
-	char *ptr;
-	int n;
-
-	n = pdf_sprint_obj(NULL, 0, obj, tight);
-	if ((n + 1) < sizeof buf)
-	{
-		pdf_sprint_obj(buf, sizeof buf, obj, tight);
-		fputs(buf, fp);
-		fputc('\n', fp);
-	}
-	else
-	{
-		ptr = fz_malloc(obj->ctx, n + 1);
-		pdf_sprint_obj(ptr, n + 1, obj, tight);
-		fputs(ptr, fp);
-		fputc('\n', fp);
-		fz_free(obj->ctx, ptr);
-	}
-	return n;
-}
-
 #ifndef NDEBUG
 void
 pdf_print_obj(pdf_obj *obj)
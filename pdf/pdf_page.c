@@ -29,6 +29,58 @@ put_marker_bool(fz_context *ctx, pdf_obj *rdb, char *marker, int val)
 	}
 }
 
+static void
+pdf_inherit_page_info(pdf_obj *node, struct info *info)
+{
+	pdf_obj *obj;
+
+	obj = pdf_dict_gets(node, "Resources");
+	if (obj)
+		info->resources = obj;
+	obj = pdf_dict_gets(node, "MediaBox");
+	if (obj)
+		info->mediabox = obj;
+	obj = pdf_dict_gets(node, "CropBox");
+	if (obj)
+		info->cropbox = obj;
+	obj = pdf_dict_gets(node, "Rotate");
+	if (obj)
+		info->rotate = obj;
+}
+
+static void
+pdf_apply_page_info(pdf_obj *dict, struct info *info)
+{
+	if (info->resources && !pdf_dict_gets(dict, "Resources"))
+		pdf_dict_puts(dict, "Resources", info->resources);
+	if (info->mediabox && !pdf_dict_gets(dict, "MediaBox"))
+		pdf_dict_puts(dict, "MediaBox", info->mediabox);
+	if (info->cropbox && !pdf_dict_gets(dict, "CropBox"))
+		pdf_dict_puts(dict, "CropBox", info->cropbox);
+	if (info->rotate && !pdf_dict_gets(dict, "Rotate"))
+		pdf_dict_puts(dict, "Rotate", info->rotate);
+}
+
+static int
+pdf_is_page_tree_node(pdf_obj *node)
+{
+	return pdf_is_array(pdf_dict_gets(node, "Kids")) && pdf_is_int(pdf_dict_gets(node, "Count"));
+}
+
+/* Number of pages below a kid, counting a page as 1 and junk as 0. */
+static int
+pdf_page_tree_count(pdf_obj *node)
+{
+	int count;
+
+	if (pdf_is_page_tree_node(node))
+	{
+		count = pdf_to_int(pdf_dict_gets(node, "Count"));
+		return count < 0 ? 0 : count;
+	}
+	return pdf_is_dict(node) ? 1 : 0;
+}
+
 typedef struct pdf_page_load_s pdf_page_load;
 
 struct pdf_page_load_s
@@ -44,7 +96,6 @@ static void
 pdf_load_page_tree_node(pdf_document *xref, pdf_obj *node, struct info info)
 {
 	pdf_obj *dict, *kids, *count;
-	pdf_obj *obj;
 	fz_context *ctx = xref->ctx;
 	pdf_page_load *stack = NULL;
 	int stacklen = -1;
@@ -66,18 +117,7 @@ pdf_load_page_tree_node(pdf_document *xref, pdf_obj *node, struct info info)
 				if (pdf_is_array(kids) && pdf_is_int(count))
 				{
 					/* Push this onto the stack */
-					obj = pdf_dict_gets(node, "Resources");
-					if (obj)
-						info.resources = obj;
-					obj = pdf_dict_gets(node, "MediaBox");
-					if (obj)
-						info.mediabox = obj;
-					obj = pdf_dict_gets(node, "CropBox");
-					if (obj)
-						info.cropbox = obj;
-					obj = pdf_dict_gets(node, "Rotate");
-					if (obj)
-						info.rotate = obj;
+					pdf_inherit_page_info(node, &info);
 					stacklen++;
 					if (stacklen == stackmax)
 					{
@@ -92,14 +132,7 @@ pdf_load_page_tree_node(pdf_document *xref, pdf_obj *node, struct info info)
 				}
 				else if ((dict = pdf_to_dict(node)) != NULL)
 				{
-					if (info.resources && !pdf_dict_gets(dict, "Resources"))
-						pdf_dict_puts(dict, "Resources", info.resources);
-					if (info.mediabox && !pdf_dict_gets(dict, "MediaBox"))
-						pdf_dict_puts(dict, "MediaBox", info.mediabox);
-					if (info.cropbox && !pdf_dict_gets(dict, "CropBox"))
-						pdf_dict_puts(dict, "CropBox", info.cropbox);
-					if (info.rotate && !pdf_dict_gets(dict, "Rotate"))
-						pdf_dict_puts(dict, "Rotate", info.rotate);
+					pdf_apply_page_info(dict, &info);
 
 					if (xref->page_len == xref->page_cap)
 					{
@@ -124,9 +157,7 @@ pdf_load_page_tree_node(pdf_document *xref, pdf_obj *node, struct info info)
 				stacklen--;
 				if (stacklen < 0) /* No more to pop! */
 					break;
-				node = stack[stacklen].node;
 				info = stack[stacklen].info;
-				pdf_dict_unmark(node); /* Unmark it, cos we're about to mark it again */
 			}
 			if (stacklen >= 0)
 				node = pdf_array_get(stack[stacklen].kids, stack[stacklen].pos);
@@ -145,16 +176,21 @@ pdf_load_page_tree_node(pdf_document *xref, pdf_obj *node, struct info info)
 	}
 }
 
+static void pdf_load_page_tree(pdf_document *xref);
+
+/*
+ * The counts below the root are checked as the tree is searched. A root
+ * /Count of 0 over some kids would hide every page, so it is not trusted.
+ */
 static void
-pdf_load_page_tree(pdf_document *xref)
+pdf_load_page_tree_root(pdf_document *xref)
 {
 	fz_context *ctx = xref->ctx;
 	pdf_obj *catalog;
 	pdf_obj *pages;
 	pdf_obj *count;
-	struct info info;
 
-	if (xref->page_refs)
+	if (xref->page_depth > 0)
 		return;
 
 	catalog = pdf_dict_gets(xref->trailer, "Root");
@@ -166,24 +202,301 @@ pdf_load_page_tree(pdf_document *xref)
 	if (!pdf_is_int(count) || pdf_to_int(count) < 0)
 		fz_throw(ctx, "missing page count");
 
-	xref->page_cap = pdf_to_int(count);
+	if (!xref->page_path)
+	{
+		xref->page_path = fz_malloc_array(ctx, 8, sizeof(pdf_page_node));
+		xref->page_path_cap = 8;
+	}
+	xref->page_path[0].node = pdf_keep_obj(pages);
+	xref->page_path[0].first = 0;
+	xref->page_path[0].count = pdf_to_int(count);
+	xref->page_path[0].leaves = 0;
+	xref->page_depth = 1;
+
+	if (xref->page_path[0].count == 0 && pdf_array_len(pdf_dict_gets(pages, "Kids")) > 0)
+	{
+		fz_warn(ctx, "page count in page tree is wrong; loading all pages");
+		pdf_load_page_tree(xref);
+	}
+}
+
+/*
+ * Load every page in the tree into page_refs and page_objs. This is only
+ * needed when the counts in the tree do not add up; a well formed tree is
+ * searched lazily by pdf_lookup_page_node instead.
+ */
+static void
+pdf_load_page_tree(pdf_document *xref)
+{
+	struct info info;
+
+	if (xref->page_refs)
+		return;
+
+	pdf_load_page_tree_root(xref);
+
+	xref->page_cap = xref->page_path[0].count;
 	xref->page_len = 0;
-	xref->page_refs = fz_malloc_array(ctx, xref->page_cap, sizeof(pdf_obj*));
-	xref->page_objs = fz_malloc_array(ctx, xref->page_cap, sizeof(pdf_obj*));
+	xref->page_refs = fz_malloc_array(xref->ctx, xref->page_cap, sizeof(pdf_obj*));
+	xref->page_objs = fz_malloc_array(xref->ctx, xref->page_cap, sizeof(pdf_obj*));
 
 	info.resources = NULL;
 	info.mediabox = NULL;
 	info.cropbox = NULL;
 	info.rotate = NULL;
 
-	pdf_load_page_tree_node(xref, pages, info);
+	pdf_load_page_tree_node(xref, xref->page_path[0].node, info);
+}
+
+/*
+ * Whether kid i of a node on the path is page i below it: the node has as
+ * many kids as pages, and kids 0 to i are all pages. The kids are checked
+ * only as far as they are asked for, so finding a page in a flat tree
+ * does not walk the pages after it.
+ */
+static int
+pdf_page_node_has_leaves(pdf_page_node *pn, int i)
+{
+	pdf_obj *kids, *kid;
+
+	kids = pdf_dict_gets(pn->node, "Kids");
+	if (pdf_array_len(kids) != pn->count)
+		pn->leaves = -1;
+	while (pn->leaves >= 0 && pn->leaves <= i)
+	{
+		kid = pdf_array_get(kids, pn->leaves);
+		if (!pdf_is_dict(kid) || pdf_is_page_tree_node(kid))
+			pn->leaves = -1;
+		else
+			pn->leaves++;
+	}
+	return pn->leaves > i;
+}
+
+/*
+ * Find page number 'needle' by descending from the root, choosing at each
+ * node the kid whose /Count covers it. The nodes on the way down are
+ * remembered in page_path, and the next search starts from the deepest of
+ * them that still covers the page asked for, so walking through the pages
+ * in order touches each node only once. Returns NULL if the tree does not
+ * match its counts.
+ */
+static pdf_obj *
+pdf_lookup_page_node(pdf_document *xref, int needle, struct info *info)
+{
+	fz_context *ctx = xref->ctx;
+	pdf_page_node *path;
+	pdf_obj *node, *kids, *kid = NULL;
+	int depth = xref->page_depth;
+	int marked = 0;
+	int skip, count, total, first, hit, i, n;
+
+	fz_var(depth);
+	fz_var(marked);
+	fz_var(kid);
+
+	path = xref->page_path;
+	while (depth > 1 && (needle < path[depth-1].first || needle >= path[depth-1].first + path[depth-1].count))
+		depth--;
+	for (i = depth; i < xref->page_depth; i++)
+		pdf_drop_obj(path[i].node);
+	xref->page_depth = depth;
+
+	info->resources = NULL;
+	info->mediabox = NULL;
+	info->cropbox = NULL;
+	info->rotate = NULL;
+	for (i = 0; i < depth; i++)
+		pdf_inherit_page_info(path[i].node, info);
+
+	fz_try(ctx)
+	{
+		for (marked = 0; marked < depth; marked++)
+			if (pdf_dict_mark(path[marked].node))
+				fz_throw(ctx, "cycle in page tree");
+
+		node = path[depth-1].node;
+		skip = needle - path[depth-1].first;
+		while (1)
+		{
+			kids = pdf_dict_gets(node, "Kids");
+			n = pdf_array_len(kids);
+
+			/* When the kids up to this one are all pages it can be indexed directly */
+			if (pdf_page_node_has_leaves(&path[depth-1], skip))
+				kid = pdf_array_get(kids, skip);
+
+			/* Otherwise add up the kids, checking them against the node */
+			else
+			{
+				hit = -1;
+				total = 0;
+				for (i = 0; i < n; i++)
+				{
+					count = pdf_page_tree_count(pdf_array_get(kids, i));
+					if (hit < 0 && skip < total + count)
+					{
+						hit = i;
+						first = total;
+					}
+					total += count;
+				}
+				if (hit < 0 || total != path[depth-1].count)
+					fz_throw(ctx, "page counts do not add up in page tree");
+				kid = pdf_array_get(kids, hit);
+				skip -= first;
+			}
+
+			if (!pdf_is_page_tree_node(kid))
+				break;
+
+			if (depth == xref->page_path_cap)
+			{
+				xref->page_path = fz_resize_array(ctx, xref->page_path, depth * 2, sizeof(pdf_page_node));
+				xref->page_path_cap = depth * 2;
+				path = xref->page_path;
+			}
+			if (pdf_dict_mark(kid))
+				fz_throw(ctx, "cycle in page tree");
+			marked++;
+			path[depth].node = pdf_keep_obj(kid);
+			path[depth].first = needle - skip;
+			path[depth].count = pdf_page_tree_count(kid);
+			path[depth].leaves = 0;
+			depth++;
+			xref->page_depth = depth;
+
+			pdf_inherit_page_info(kid, info);
+			node = kid;
+		}
+	}
+	fz_always(ctx)
+	{
+		path = xref->page_path;
+		while (marked > 0)
+			pdf_dict_unmark(path[--marked].node);
+	}
+	fz_catch(ctx)
+	{
+		fz_warn(ctx, "page tree is inconsistent; loading all pages");
+		return NULL;
+	}
+
+	return kid;
+}
+
+void
+pdf_drop_page_tree(pdf_document *xref)
+{
+	fz_context *ctx = xref->ctx;
+	int i;
+
+	if (xref->page_objs)
+	{
+		for (i = 0; i < xref->page_len; i++)
+			pdf_drop_obj(xref->page_objs[i]);
+		fz_free(ctx, xref->page_objs);
+	}
+
+	if (xref->page_refs)
+	{
+		for (i = 0; i < xref->page_len; i++)
+			pdf_drop_obj(xref->page_refs[i]);
+		fz_free(ctx, xref->page_refs);
+	}
+
+	for (i = 0; i < xref->page_depth; i++)
+		pdf_drop_obj(xref->page_path[i].node);
+	fz_free(ctx, xref->page_path);
 }
 
 int
 pdf_count_pages(pdf_document *xref)
 {
-	pdf_load_page_tree(xref);
-	return xref->page_len;
+	if (!xref->page_refs)
+		pdf_load_page_tree_root(xref);
+	if (xref->page_refs)
+		return xref->page_len;
+	return xref->page_path[0].count;
+}
+
+/*
+ * Work out the number of a page by climbing its /Parent links, adding up
+ * the pages before it at each level. Returns -1 if the links do not lead
+ * back to the root.
+ */
+static int
+pdf_find_page_number(pdf_document *xref, pdf_obj *page)
+{
+	pdf_obj *node, *parent, *kids;
+	int total = 0;
+	int count, before, sum, i, k, n;
+
+	if (!pdf_is_indirect(page) || pdf_is_page_tree_node(page))
+		return -1;
+
+	node = page;
+	parent = pdf_dict_gets(node, "Parent");
+	while (parent)
+	{
+		if (pdf_dict_mark(parent))
+		{
+			total = -1;
+			break;
+		}
+
+		kids = pdf_dict_gets(parent, "Kids");
+		count = pdf_to_int(pdf_dict_gets(parent, "Count"));
+		n = pdf_array_len(kids);
+		for (i = 0; i < n; i++)
+			if (!pdf_objcmp(pdf_array_get(kids, i), node))
+				break;
+		if (i == n)
+		{
+			total = -1;
+			break;
+		}
+
+		/* A node on the page path may be known to hold only pages */
+		for (k = 0; k < xref->page_depth; k++)
+			if (!pdf_objcmp(xref->page_path[k].node, parent))
+				break;
+		if (k < xref->page_depth && pdf_page_node_has_leaves(&xref->page_path[k], i))
+			total += i;
+		else
+		{
+			/* Add up the kids before this one, checking them against the node */
+			before = 0;
+			sum = 0;
+			for (k = 0; k < n; k++)
+			{
+				if (k == i)
+					before = sum;
+				sum += pdf_page_tree_count(pdf_array_get(kids, k));
+			}
+			if (sum != count)
+			{
+				total = -1;
+				break;
+			}
+			total += before;
+		}
+
+		node = parent;
+		parent = pdf_dict_gets(node, "Parent");
+	}
+
+	if (total >= 0 && pdf_objcmp(node, xref->page_path[0].node))
+		total = -1;
+
+	parent = pdf_dict_gets(page, "Parent");
+	while (parent && pdf_dict_marked(parent))
+	{
+		pdf_dict_unmark(parent);
+		parent = pdf_dict_gets(parent, "Parent");
+	}
+
+	return total;
 }
 
 int
@@ -191,6 +504,15 @@ pdf_lookup_page_number(pdf_document *xref, pdf_obj *page)
 {
 	int i, num = pdf_to_num(page);
 
+	if (!xref->page_refs)
+		pdf_load_page_tree_root(xref);
+	if (!xref->page_refs)
+	{
+		i = pdf_find_page_number(xref, page);
+		if (i >= 0 && i < xref->page_path[0].count)
+			return i;
+	}
+
 	pdf_load_page_tree(xref);
 	for (i = 0; i < xref->page_len; i++)
 		if (num == pdf_to_num(xref->page_refs[i]))
@@ -292,16 +614,32 @@ pdf_load_page(pdf_document *xref, int number)
 	pdf_page *page;
 	pdf_annot *annot;
 	pdf_obj *pageobj, *pageref, *obj;
+	struct info info;
 	fz_rect mediabox, cropbox, realbox;
 	fz_matrix ctm;
 	float userunit;
 
-	pdf_load_page_tree(xref);
-	if (number < 0 || number >= xref->page_len)
+	pageref = NULL;
+	if (number < 0 || number >= pdf_count_pages(xref))
 		fz_throw(ctx, "cannot find page %d", number + 1);
+	if (!xref->page_refs)
+	{
+		pageref = pdf_lookup_page_node(xref, number, &info);
+		if (pageref)
+		{
+			pageobj = pdf_to_dict(pageref);
+			pdf_apply_page_info(pageobj, &info);
+		}
+	}
+	if (!pageref)
+	{
+		pdf_load_page_tree(xref);
+		if (number < 0 || number >= xref->page_len)
+			fz_throw(ctx, "cannot find page %d", number + 1);
 
-	pageobj = xref->page_objs[number];
-	pageref = xref->page_refs[number];
+		pageobj = xref->page_objs[number];
+		pageref = xref->page_refs[number];
+	}
 
 	page = fz_malloc_struct(ctx, pdf_page);
 	page->resources = NULL;
@@ -442,9 +442,21 @@ pdf_load_raw_renumbered_stream(pdf_document *xref, int num, int gen, int orig_nu
 
 	stm = pdf_open_raw_renumbered_stream(xref, num, gen, orig_num, orig_gen);
 
-	buf = fz_read_all(stm, len);
+	fz_try(xref->ctx)
+	{
+		buf = fz_null_filter_view(stm);
+		if (!buf)
+			buf = fz_read_all(stm, len);
+	}
+	fz_always(xref->ctx)
+	{
+		fz_close(stm);
+	}
+	fz_catch(xref->ctx)
+	{
+		fz_rethrow(xref->ctx);
+	}
 
-	fz_close(stm);
 	return buf;
 }
 
@@ -508,7 +520,10 @@ pdf_load_image_stream(pdf_document *xref, int num, int gen, int orig_num, int or
 
 	fz_try(ctx)
 	{
-		buf = fz_read_all(stm, len);
+		/* Unfiltered data, or data left for an image decoder, can be shared with a mapped file */
+		buf = fz_null_filter_view(stm);
+		if (!buf)
+			buf = fz_read_all(stm, len);
 	}
 	fz_always(ctx)
 	{
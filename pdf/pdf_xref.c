@@ -824,19 +824,7 @@ pdf_close_document(pdf_document *xref)
 		fz_free(xref->ctx, xref->table);
 	}
 
-	if (xref->page_objs)
-	{
-		for (i = 0; i < xref->page_len; i++)
-			pdf_drop_obj(xref->page_objs[i]);
-		fz_free(ctx, xref->page_objs);
-	}
-
-	if (xref->page_refs)
-	{
-		for (i = 0; i < xref->page_len; i++)
-			pdf_drop_obj(xref->page_refs[i]);
-		fz_free(ctx, xref->page_refs);
-	}
+	pdf_drop_page_tree(xref);
 
 	if (xref->file)
 		fz_close(xref->file);
@@ -871,89 +859,245 @@ pdf_print_xref(pdf_document *xref)
 
 /*
  * compressed object streams
+ *
+ * The decompressed data and offset table of an object stream are kept
+ * in the store, and objects are parsed from it one at a time as they
+ * are asked for. When the index cannot be kept, every object in the
+ * stream is parsed at once instead, so that the stream is not inflated
+ * again for each of them.
  */
 
+typedef struct pdf_obj_stm_s pdf_obj_stm;
+
+struct pdf_obj_stm_s
+{
+	fz_storable storable;
+	fz_buffer *data;
+	int first;
+	int count;
+	int *nums;
+	int *ofs;
+};
+
 static void
-pdf_load_obj_stm(pdf_document *xref, int num, int gen, pdf_lexbuf *buf)
+pdf_free_obj_stm_imp(fz_context *ctx, fz_storable *stm_)
+{
+	pdf_obj_stm *stm = (pdf_obj_stm *)stm_;
+
+	fz_drop_buffer(ctx, stm->data);
+	fz_free(ctx, stm->nums);
+	fz_free(ctx, stm->ofs);
+	fz_free(ctx, stm);
+}
+
+/* Unlike pdf_obj_store_type, the key tells documents apart */
+static int
+pdf_make_hash_obj_stm_key(fz_store_hash *hash, void *key)
+{
+	hash->u.pi.ptr = pdf_get_indirect_document(key);
+	hash->u.pi.i = pdf_to_num(key);
+	return 1;
+}
+
+static void *
+pdf_keep_obj_stm_key(fz_context *ctx, void *key)
+{
+	return pdf_keep_obj(key);
+}
+
+static void
+pdf_drop_obj_stm_key(fz_context *ctx, void *key)
+{
+	pdf_drop_obj(key);
+}
+
+static int
+pdf_cmp_obj_stm_key(void *k0, void *k1)
 {
+	return pdf_get_indirect_document(k0) != pdf_get_indirect_document(k1) ||
+		pdf_to_num(k0) != pdf_to_num(k1) ||
+		pdf_to_gen(k0) != pdf_to_gen(k1);
+}
+
+#ifndef NDEBUG
+static void
+pdf_debug_obj_stm_key(void *key)
+{
+	printf("(object stream %d %d R of %p) ", pdf_to_num(key), pdf_to_gen(key),
+		pdf_get_indirect_document(key));
+}
+#endif
+
+static fz_store_type pdf_obj_stm_store_type =
+{
+	pdf_make_hash_obj_stm_key,
+	pdf_keep_obj_stm_key,
+	pdf_drop_obj_stm_key,
+	pdf_cmp_obj_stm_key,
+#ifndef NDEBUG
+	pdf_debug_obj_stm_key
+#endif
+};
+
+static pdf_obj_stm *
+pdf_load_obj_stm_index(pdf_document *xref, int num, int gen, pdf_lexbuf *buf, int *stored)
+{
+	fz_context *ctx = xref->ctx;
 	fz_stream *stm = NULL;
 	pdf_obj *objstm = NULL;
-	int *numbuf = NULL;
-	int *ofsbuf = NULL;
+	pdf_obj *key;
+	pdf_obj_stm *index = NULL;
+	pdf_obj_stm *existing;
+	int i, tok;
 
-	pdf_obj *obj;
-	int first;
-	int count;
-	int i;
-	int tok;
-	fz_context *ctx = xref->ctx;
+	key = pdf_new_indirect(ctx, num, gen, xref);
+	if ((index = fz_find_item(ctx, pdf_free_obj_stm_imp, key, &pdf_obj_stm_store_type)))
+	{
+		pdf_drop_obj(key);
+		*stored = 1;
+		return index;
+	}
 
-	fz_var(numbuf);
-	fz_var(ofsbuf);
 	fz_var(objstm);
 	fz_var(stm);
+	fz_var(index);
 
 	fz_try(ctx)
 	{
 		objstm = pdf_load_object(xref, num, gen);
 
-		count = pdf_to_int(pdf_dict_gets(objstm, "N"));
-		first = pdf_to_int(pdf_dict_gets(objstm, "First"));
+		index = fz_malloc_struct(ctx, pdf_obj_stm);
+		FZ_INIT_STORABLE(index, 1, pdf_free_obj_stm_imp);
+		index->count = pdf_to_int(pdf_dict_gets(objstm, "N"));
+		index->first = pdf_to_int(pdf_dict_gets(objstm, "First"));
 
-		if (count < 0)
+		if (index->count < 0)
 			fz_throw(ctx, "negative number of objects in object stream");
-		if (first < 0)
+		if (index->first < 0)
 			fz_throw(ctx, "first object in object stream resides outside stream");
 
-		numbuf = fz_calloc(ctx, count, sizeof(int));
-		ofsbuf = fz_calloc(ctx, count, sizeof(int));
+		index->nums = fz_calloc(ctx, index->count, sizeof(int));
+		index->ofs = fz_calloc(ctx, index->count, sizeof(int));
+		index->data = pdf_load_stream(xref, num, gen);
 
-		stm = pdf_open_stream(xref, num, gen);
-		for (i = 0; i < count; i++)
+		stm = fz_open_buffer(ctx, index->data);
+		for (i = 0; i < index->count; i++)
 		{
 			tok = pdf_lex(stm, buf);
 			if (tok != PDF_TOK_INT)
 				fz_throw(ctx, "corrupt object stream (%d %d R)", num, gen);
-			numbuf[i] = buf->i;
+			index->nums[i] = buf->i;
 
 			tok = pdf_lex(stm, buf);
 			if (tok != PDF_TOK_INT)
 				fz_throw(ctx, "corrupt object stream (%d %d R)", num, gen);
-			ofsbuf[i] = buf->i;
+			index->ofs[i] = buf->i;
 		}
 
-		fz_seek(stm, first, 0);
-
-		for (i = 0; i < count; i++)
+		/* The store takes a reference when it keeps the item, or
+		 * hands back the index another thread stored first */
+		existing = fz_store_item(ctx, key, index, index->data->len + index->count * 2 * sizeof(int), &pdf_obj_stm_store_type);
+		if (existing)
 		{
-			fz_seek(stm, first + ofsbuf[i], 0);
+			pdf_free_obj_stm_imp(ctx, &index->storable);
+			index = existing;
+			*stored = 1;
+		}
+		else
+		{
+			fz_lock(ctx, FZ_LOCK_ALLOC);
+			*stored = index->storable.refs > 1;
+			fz_unlock(ctx, FZ_LOCK_ALLOC);
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_close(stm);
+		pdf_drop_obj(objstm);
+		pdf_drop_obj(key);
+	}
+	fz_catch(ctx)
+	{
+		if (index)
+			pdf_free_obj_stm_imp(ctx, &index->storable);
+		fz_throw(ctx, "cannot open object stream (%d %d R)", num, gen);
+	}
 
-			obj = pdf_parse_stm_obj(xref, stm, buf);
+	return index;
+}
 
-			if (numbuf[i] < 1 || numbuf[i] >= xref->len)
-			{
-				pdf_drop_obj(obj);
-				fz_throw(ctx, "object id (%d 0 R) out of range (0..%d)", numbuf[i], xref->len - 1);
-			}
+/* Parse the objects of an unstored stream that are not loaded yet; the last entry for an object wins */
+static void
+pdf_load_obj_stm_rest(pdf_document *xref, int num, pdf_obj_stm *index, fz_stream *stm, pdf_lexbuf *buf)
+{
+	fz_context *ctx = xref->ctx;
+	pdf_xref_entry *x;
+	int i, n;
 
-			if (xref->table[numbuf[i]].type == 'o' && xref->table[numbuf[i]].ofs == num)
-			{
-				if (xref->table[numbuf[i]].obj)
-					pdf_drop_obj(xref->table[numbuf[i]].obj);
-				xref->table[numbuf[i]].obj = obj;
-			}
-			else
-			{
-				pdf_drop_obj(obj);
-			}
+	for (i = index->count - 1; i >= 0; i--)
+	{
+		n = index->nums[i];
+		if (n < 1 || n >= xref->len)
+			continue;
+		x = &xref->table[n];
+		if (x->type != 'o' || x->ofs != num || x->obj)
+			continue;
+
+		fz_try(ctx)
+		{
+			fz_seek(stm, index->first + index->ofs[i], 0);
+			x->obj = pdf_parse_stm_obj(xref, stm, buf);
 		}
+		fz_catch(ctx)
+		{
+			/* Leave it to be parsed, and the error reported, on demand */
+		}
+	}
+}
+
+/* Parse object target, whose xref entry gives its position in the stream as a hint */
+static void
+pdf_load_obj_stm(pdf_document *xref, int num, int gen, pdf_lexbuf *buf, int target)
+{
+	fz_context *ctx = xref->ctx;
+	fz_stream *stm = NULL;
+	pdf_obj_stm *index;
+	pdf_obj *obj;
+	int i, stored;
+
+	index = pdf_load_obj_stm_index(xref, num, gen, buf, &stored);
+
+	/* Fall back to the last entry for the object, as loading the whole stream would */
+	i = xref->table[target].gen;
+	if (i < 0 || i >= index->count || index->nums[i] != target)
+	{
+		for (i = index->count - 1; i >= 0; i--)
+			if (index->nums[i] == target)
+				break;
+	}
+
+	fz_var(stm);
+
+	fz_try(ctx)
+	{
+		if (i < 0)
+			fz_throw(ctx, "object (%d 0 R) is not in object stream (%d %d R)", target, num, gen);
+
+		stm = fz_open_buffer(ctx, index->data);
+		fz_seek(stm, index->first + index->ofs[i], 0);
+		obj = pdf_parse_stm_obj(xref, stm, buf);
+
+		if (xref->table[target].obj)
+			pdf_drop_obj(xref->table[target].obj);
+		xref->table[target].obj = obj;
+
+		if (!stored)
+			pdf_load_obj_stm_rest(xref, num, index, stm, buf);
 	}
 	fz_always(ctx)
 	{
 		fz_close(stm);
-		fz_free(xref->ctx, ofsbuf);
-		fz_free(xref->ctx, numbuf);
-		pdf_drop_obj(objstm);
+		fz_drop_storable(ctx, &index->storable);
 	}
 	fz_catch(ctx)
 	{
@@ -1015,7 +1159,7 @@ pdf_cache_object(pdf_document *xref, int num, int gen)
 		{
 			fz_try(ctx)
 			{
-				pdf_load_obj_stm(xref, x->ofs, 0, &xref->lexbuf.base);
+				pdf_load_obj_stm(xref, x->ofs, 0, &xref->lexbuf.base, num);
 			}
 			fz_catch(ctx)
 			{
@@ -1349,7 +1493,7 @@ pdf_open_document_no_run(fz_context *ctx, const char *filename)
 
 	fz_try(ctx)
 	{
-		file = fz_open_file(ctx, filename);
+		file = fz_open_mapped_file(ctx, filename);
 		doc = pdf_new_document(file);
 		pdf_init_document(doc);
 	}
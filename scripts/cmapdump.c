@@ -1,4 +1,5 @@
 /* cmapdump.c -- parse a CMap file and dump it as a c-struct */
+/* or, with -b, as a binary cmap file (see pdf_new_binary_cmap) */
 
 #include <stdio.h>
 #include <string.h>
@@ -32,6 +33,59 @@ clean(char *p)
 	}
 }
 
+static int
+dump_binary(fz_context *ctx, char *dir, int argc, char **argv)
+{
+	pdf_cmap *cmap;
+	fz_stream *fi;
+	fz_buffer *buf;
+	FILE *fo;
+	char path[1024];
+	char *realname;
+	int i, n;
+
+	for (i = 0; i < argc; i++)
+	{
+		realname = strrchr(argv[i], '/');
+		if (!realname)
+			realname = strrchr(argv[i], '\\');
+		if (realname)
+			realname ++;
+		else
+			realname = argv[i];
+
+		if (strlen(dir) + strlen(realname) + 2 > sizeof path)
+		{
+			fprintf(stderr, "cmapdump: file name too long\n");
+			return 1;
+		}
+		sprintf(path, "%s/%s", dir, realname);
+
+		fi = fz_open_file(ctx, argv[i]);
+		cmap = pdf_load_cmap(ctx, fi);
+		fz_close(fi);
+		buf = pdf_new_binary_cmap(ctx, cmap);
+
+		fo = fopen(path, "wb");
+		if (!fo)
+		{
+			fprintf(stderr, "cmapdump: could not open output file '%s'\n", path);
+			return 1;
+		}
+		n = fwrite(buf->data, 1, buf->len, fo);
+		if (fclose(fo) || n != buf->len)
+		{
+			fprintf(stderr, "cmapdump: could not write output file '%s'\n", path);
+			return 1;
+		}
+
+		fz_drop_buffer(ctx, buf);
+		pdf_drop_cmap(ctx, cmap);
+	}
+
+	return 0;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -43,9 +97,10 @@ main(int argc, char **argv)
 	int i, k;
 	fz_context *ctx;
 
-	if (argc < 3)
+	if (argc < 3 || (!strcmp(argv[1], "-b") && argc < 4))
 	{
 		fprintf(stderr, "usage: cmapdump output.c lots of cmap files\n");
+		fprintf(stderr, "       cmapdump -b outputdir lots of cmap files\n");
 		return 1;
 	}
 
@@ -56,6 +111,13 @@ main(int argc, char **argv)
 		return 1;
 	}
 
+	if (!strcmp(argv[1], "-b"))
+	{
+		i = dump_binary(ctx, argv[2], argc - 3, argv + 3);
+		fz_free_context(ctx);
+		return i;
+	}
+
 	fo = fopen(argv[1], "wb");
 	if (!fo)
 	{
@@ -178,6 +240,27 @@ fz_font_context *fz_keep_font_context(fz_context *ctx)
 	return NULL;
 }
 
+void fz_new_name_context(fz_context *ctx)
+{
+}
+
+void fz_drop_name_context(fz_context *ctx)
+{
+}
+
+fz_name_context *fz_keep_name_context(fz_context *ctx)
+{
+	return NULL;
+}
+
+void fz_new_ft_context(fz_context *ctx)
+{
+}
+
+void fz_free_ft_context(fz_context *ctx)
+{
+}
+
 void fz_new_aa_context(fz_context *ctx)
 {
 }
@@ -0,0 +1,175 @@
+/*
+ * mtbench -- render a document from several threads at once
+ *
+ * Usage: mtbench file nthreads [npages]
+ *
+ * The pages are recorded into display lists once, and then every thread
+ * renders every list in a context cloned from the first, each at a zoom
+ * of its own so that the threads do not share glyph cache entries. The
+ * time each lock was held for is reported along with the wall clock
+ * time, which shows how much of the work is serialized by the locks
+ * (mostly FZ_LOCK_FREETYPE and FZ_LOCK_GLYPHCACHE) even on machines
+ * with fewer cores than threads.
+ */
+
+#include "fitz.h"
+
+#include <pthread.h>
+#include <sys/time.h>
+
+#define MAX_THREADS 64
+
+static pthread_mutex_t mutexes[FZ_LOCK_MAX];
+static double held[FZ_LOCK_MAX];
+static double since[FZ_LOCK_MAX];
+
+static double
+now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+lock(void *user, int lock)
+{
+	pthread_mutex_lock(&mutexes[lock]);
+	since[lock] = now();
+}
+
+static void
+unlock(void *user, int lock)
+{
+	held[lock] += now() - since[lock];
+	pthread_mutex_unlock(&mutexes[lock]);
+}
+
+static fz_locks_context locks = { NULL, lock, unlock };
+
+static fz_context *base_ctx;
+static fz_display_list **lists;
+static fz_rect *bounds;
+static int npages;
+
+static void *
+worker(void *arg)
+{
+	int id = (int)(long)arg;
+	fz_context *ctx;
+	fz_pixmap *pix;
+	fz_device *dev;
+	fz_matrix ctm;
+	fz_bbox bbox;
+	int i;
+
+	ctx = fz_clone_context(base_ctx);
+	if (!ctx)
+	{
+		fprintf(stderr, "mtbench: cannot clone context\n");
+		return NULL;
+	}
+
+	ctm = fz_scale(2.0f + id * 0.013f, 2.0f + id * 0.013f);
+
+	fz_try(ctx)
+	{
+		for (i = 0; i < npages; i++)
+		{
+			bbox = fz_round_rect(fz_transform_rect(ctm, bounds[i]));
+			pix = fz_new_pixmap_with_bbox(ctx, fz_device_gray, bbox);
+			fz_clear_pixmap_with_value(ctx, pix, 255);
+			dev = fz_new_draw_device(ctx, pix);
+			fz_run_display_list(lists[i], dev, ctm, fz_infinite_bbox, NULL);
+			fz_free_device(dev);
+			fz_drop_pixmap(ctx, pix);
+		}
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "mtbench: thread %d failed\n", id);
+	}
+
+	fz_free_context(ctx);
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	pthread_t threads[MAX_THREADS];
+	fz_document *doc;
+	fz_page *page;
+	fz_device *dev;
+	double start, end;
+	int i, n;
+
+	if (argc < 3)
+	{
+		fprintf(stderr, "usage: mtbench file nthreads [npages]\n");
+		return 1;
+	}
+
+	n = atoi(argv[2]);
+	if (n < 1 || n > MAX_THREADS)
+	{
+		fprintf(stderr, "mtbench: between 1 and %d threads\n", MAX_THREADS);
+		return 1;
+	}
+
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		pthread_mutex_init(&mutexes[i], NULL);
+
+	base_ctx = fz_new_context(NULL, &locks, FZ_STORE_DEFAULT);
+	if (!base_ctx)
+	{
+		fprintf(stderr, "mtbench: cannot create context\n");
+		return 1;
+	}
+
+	fz_try(base_ctx)
+	{
+		doc = fz_open_document(base_ctx, argv[1]);
+		npages = fz_count_pages(doc);
+		if (argc > 3 && atoi(argv[3]) < npages)
+			npages = atoi(argv[3]);
+
+		lists = fz_malloc_array(base_ctx, npages, sizeof *lists);
+		bounds = fz_malloc_array(base_ctx, npages, sizeof *bounds);
+		for (i = 0; i < npages; i++)
+		{
+			page = fz_load_page(doc, i);
+			lists[i] = fz_new_display_list(base_ctx);
+			dev = fz_new_list_device(base_ctx, lists[i]);
+			fz_run_page(doc, page, dev, fz_identity, NULL);
+			fz_free_device(dev);
+			bounds[i] = fz_bound_page(doc, page);
+			fz_free_page(doc, page);
+		}
+	}
+	fz_catch(base_ctx)
+	{
+		fprintf(stderr, "mtbench: cannot load '%s'\n", argv[1]);
+		return 1;
+	}
+
+	memset(held, 0, sizeof held);
+	start = now();
+	for (i = 0; i < n; i++)
+		pthread_create(&threads[i], NULL, worker, (void *)(long)i);
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	end = now();
+
+	printf("%d threads, %d pages: %.3fs\n", n, npages, end - start);
+	printf("freetype lock held %.3fs, glyph cache lock held %.3fs\n",
+		held[FZ_LOCK_FREETYPE], held[FZ_LOCK_GLYPHCACHE]);
+
+	for (i = 0; i < npages; i++)
+		fz_free_display_list(base_ctx, lists[i]);
+	fz_free(base_ctx, lists);
+	fz_free(base_ctx, bounds);
+	fz_close_document(doc);
+	fz_free_context(base_ctx);
+	return 0;
+}
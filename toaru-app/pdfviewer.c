@@ -65,6 +65,12 @@ static int current_epage = 0;
 static fz_document * current_doc = NULL;
 static fz_context  * current_ctx = NULL;
 
+#define MAX_HITS 512
+
+static char * search_text = NULL;
+static fz_text_index * current_index = NULL;
+static fz_text_hit hits[MAX_HITS];
+
 void draw_decors(int page, int epage) {
 	if (toggle_decors) {
 		char title[512] = {0};
@@ -93,6 +99,60 @@ static void draw_menu(void) {
 	menu_bar_render(&menu_bar, gfx_ctx);
 }
 
+static void index_page(fz_context *ctx, fz_document *doc, fz_page *page, int pagenum) {
+	fz_text_sheet *sheet = NULL;
+	fz_text_page *text = NULL;
+	fz_device *dev = NULL;
+
+	if (!current_index || fz_text_index_has_page(current_index, pagenum - 1))
+		return;
+
+	fz_var(sheet);
+	fz_var(text);
+	fz_var(dev);
+
+	fz_try(ctx)
+	{
+		sheet = fz_new_text_sheet(ctx);
+		text = fz_new_text_page(ctx, fz_bound_page(doc, page));
+		dev = fz_new_text_device(ctx, sheet, text);
+		fz_run_page(doc, page, dev, fz_identity, NULL);
+		fz_free_device(dev);
+		dev = NULL;
+		fz_text_index_add_page(ctx, current_index, pagenum - 1, text);
+	}
+	fz_always(ctx)
+	{
+		fz_free_device(dev);
+		fz_free_text_page(ctx, text);
+		if (sheet)
+			fz_free_text_sheet(ctx, sheet);
+	}
+	fz_catch(ctx)
+	{
+		fprintf(stderr, "Failed to index page %d.\n", pagenum);
+	}
+}
+
+/* Tint the words of the search hits on this page */
+static void highlight_hits(fz_context *ctx, int pagenum, fz_matrix ctm, fz_bbox clip, int x_offset, int y_offset) {
+	int i, n, x, y;
+
+	if (!current_index)
+		return;
+
+	n = fz_search_text_index(ctx, current_index, search_text, pagenum - 1, hits, MAX_HITS);
+	for (i = 0; i < n && hits[i].page == pagenum - 1; i++) {
+		fz_bbox b;
+		b = fz_intersect_bbox(fz_round_rect(fz_transform_rect(ctm, hits[i].bbox)), clip);
+		for (y = b.y0; y < b.y1; ++y) {
+			for (x = b.x0; x < b.x1; ++x) {
+				GFX(gfx_ctx, x_offset + x - clip.x0, y_offset + y - clip.y0) &= 0xFFFFFF00;
+			}
+		}
+	}
+}
+
 static void drawpage(fz_context *ctx, fz_document *doc, int pagenum) {
 	fz_page *page;
 	fz_display_list *list = NULL;
@@ -112,6 +172,8 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum) {
 		fz_throw(ctx, "cannot load page %d in file", pagenum);
 	}
 
+	index_page(ctx, doc, page, pagenum);
+
 	float zoom;
 	fz_matrix ctm;
 	fz_rect bounds, bounds2;
@@ -201,6 +263,7 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum) {
 		for (int i = 0; i < fz_pixmap_height(ctx, pix); ++i) {
 			memcpy(&GFX(gfx_ctx, x_offset, y_offset + i), &fz_pixmap_samples(ctx, pix)[fz_pixmap_width(ctx, pix) * i * 4], fz_pixmap_width(ctx, pix) * 4);
 		}
+		highlight_hits(ctx, pagenum, ctm, bbox, x_offset, y_offset);
 
 	}
 	fz_always(ctx)
@@ -225,6 +288,10 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum) {
 }
 
 static void fitz_load_file(char * filename) {
+	if (current_index) {
+		fz_free_text_index(current_ctx, current_index);
+		current_index = NULL;
+	}
 	if (current_doc) {
 		fz_close_document(current_doc);
 		current_doc = NULL;
@@ -252,6 +319,17 @@ static void fitz_load_file(char * filename) {
 
 		current_page = 1;
 		end_page = fz_count_pages(current_doc);
+
+		if (search_text) {
+			unsigned char digest[16];
+			fz_try(current_ctx) {
+				fz_md5_file(current_ctx, filename, digest);
+				current_index = fz_new_text_index(current_ctx, digest, end_page);
+			} fz_catch(current_ctx) {
+				fprintf(stderr, "Failed to create search index.\n");
+				current_index = NULL;
+			}
+		}
 	}
 }
 
@@ -362,6 +440,35 @@ static void _menu_action_about(struct MenuEntry * entry) {
 	redraw_window();
 }
 
+/* Go to the next page (wrapping around) with a hit for the search text,
+ * adding pages to the index as they are passed over. */
+static void find_next(void) {
+	int i, n, pagenum;
+	fz_page *page;
+
+	if (!current_doc || !current_index)
+		return;
+
+	for (i = 1; i <= end_page; i++) {
+		pagenum = (current_page - 1 + i) % end_page + 1;
+		if (!fz_text_index_has_page(current_index, pagenum - 1)) {
+			fz_try(current_ctx) {
+				page = fz_load_page(current_doc, pagenum - 1);
+			} fz_catch(current_ctx) {
+				continue;
+			}
+			index_page(current_ctx, current_doc, page, pagenum);
+			fz_free_page(current_doc, page);
+		}
+		n = fz_search_text_index(current_ctx, current_index, search_text, pagenum - 1, hits, 1);
+		if (n > 0 && hits[0].page == pagenum - 1) {
+			current_page = pagenum;
+			redraw_window();
+			return;
+		}
+	}
+}
+
 static void previous_page(void) {
 	current_page--;
 	if (current_page == 0) current_page = 1;
@@ -414,7 +521,12 @@ int main(int argc, char **argv) {
 	current_ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
 	fz_set_aa_level(current_ctx, 8);
 
-	/* Load a file */
+	/* Load a file, optionally with text to search for */
+	if (argc > 2 && !strcmp(argv[1], "-f")) {
+		search_text = argv[2];
+		argv += 2;
+		argc -= 2;
+	}
 	if (argc > 1) {
 		fitz_load_file(argv[1]);
 	}
@@ -450,6 +562,9 @@ int main(int argc, char **argv) {
 								case KEY_F12:
 									toggle_decorations();
 									break;
+								case 'n':
+									find_next();
+									break;
 								default:
 									break;
 							}
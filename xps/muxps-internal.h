@@ -85,20 +85,25 @@ void xps_add_link(xps_document *doc, fz_rect area, char *base_uri, char *target_
  * Images, fonts, and colorspaces.
  */
 
-typedef struct xps_font_cache_s xps_font_cache;
+typedef struct xps_glyph_metrics_s xps_glyph_metrics;
 
-struct xps_font_cache_s
+struct xps_glyph_metrics_s
 {
-	char *name;
-	fz_font *font;
-	xps_font_cache *next;
+	float hadv, vadv, vorg;
 };
 
-typedef struct xps_glyph_metrics_s xps_glyph_metrics;
+typedef struct xps_font_cache_s xps_font_cache;
 
-struct xps_glyph_metrics_s
+struct xps_font_cache_s
 {
-	float hadv, vadv, vorg;
+	char *name;
+	fz_font *font;
+	/* glyph ids for BMP characters, in lazily allocated pages of 256 */
+	unsigned short *encoding[256];
+	/* advances for each glyph in the font, measured on first use */
+	int glyph_count;
+	xps_glyph_metrics *metrics;
+	unsigned char *measured;
 };
 
 int xps_count_font_encodings(fz_font *font);
@@ -127,6 +132,7 @@ struct xps_resource_s
 	xml_element *data;
 	xps_resource *next;
 	xps_resource *parent; /* up to the previous dict in the stack */
+	fz_hash_table *hash; /* only used in the head nodes of large dicts */
 };
 
 xps_resource * xps_parse_resource_dictionary(xps_document *doc, char *base_uri, xml_element *root);
@@ -203,8 +209,9 @@ struct xps_document_s
 	char *base_uri; /* base uri for parsing XML and resolving relative paths */
 	char *part_uri; /* part uri for parsing metadata relations */
 
-	/* We cache font resources */
-	xps_font_cache *font_table;
+	/* We cache font resources, by MD5 of the lower-cased name */
+	fz_hash_table *font_table; /* by part name with style simulation suffix */
+	fz_hash_table *font_part_table; /* by part name, for the deobfuscated data */
 
 	/* Opacity attribute stack */
 	float opacity[64];
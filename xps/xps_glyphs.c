@@ -70,24 +70,138 @@ xps_measure_font_glyph(xps_document *doc, fz_font *font, int gid, xps_glyph_metr
 	mtx->vorg = face->ascender / (float) face->units_per_EM;
 }
 
-static fz_font *
-xps_lookup_font(xps_document *doc, char *name)
+/*
+ * Glyph ids and metrics are looked up through the font cache entry, so
+ * that FreeType is only asked once per character and once per glyph.
+ */
+static int
+xps_lookup_font_char(xps_document *doc, xps_font_cache *cache, int code)
 {
-	xps_font_cache *cache;
-	for (cache = doc->font_table; cache; cache = cache->next)
-		if (!xps_strcasecmp(cache->name, name))
-			return fz_keep_font(doc->ctx, cache->font);
-	return NULL;
+	unsigned short *page;
+	int gid;
+
+	if (code < 0 || code > 0xFFFF)
+		return xps_encode_font_char(cache->font, code);
+
+	page = cache->encoding[code >> 8];
+	if (!page)
+	{
+		page = fz_malloc_array(doc->ctx, 256, sizeof(unsigned short));
+		memset(page, 0xFF, 256 * sizeof(unsigned short));
+		cache->encoding[code >> 8] = page;
+	}
+
+	gid = page[code & 0xFF];
+	if (gid == 0xFFFF)
+	{
+		gid = xps_encode_font_char(cache->font, code);
+		if (gid >= 0xFFFF)
+			return gid;
+		page[code & 0xFF] = gid;
+	}
+	return gid;
 }
 
 static void
-xps_insert_font(xps_document *doc, char *name, fz_font *font)
+xps_lookup_font_glyph(xps_document *doc, xps_font_cache *cache, int gid, xps_glyph_metrics *mtx)
 {
+	if (gid < 0 || gid >= cache->glyph_count)
+	{
+		xps_measure_font_glyph(doc, cache->font, gid, mtx);
+		return;
+	}
+
+	if (!cache->metrics)
+	{
+		cache->metrics = fz_malloc_array(doc->ctx, cache->glyph_count, sizeof(xps_glyph_metrics));
+		cache->measured = fz_malloc_array(doc->ctx, cache->glyph_count, 1);
+		memset(cache->measured, 0, cache->glyph_count);
+	}
+
+	if (!cache->measured[gid])
+	{
+		xps_measure_font_glyph(doc, cache->font, gid, &cache->metrics[gid]);
+		cache->measured[gid] = 1;
+	}
+	*mtx = cache->metrics[gid];
+}
+
+/*
+ * Font tables are keyed by the MD5 digest of the lower-cased name, since
+ * part names are compared case insensitively and can be long.
+ */
+static void
+xps_font_key(char *name, unsigned char key[16])
+{
+	unsigned char buf[256];
+	fz_md5 md5;
+	int n;
+
+	fz_md5_init(&md5);
+	while (*name)
+	{
+		for (n = 0; n < sizeof buf && name[n]; n++)
+			buf[n] = (name[n] >= 'A' && name[n] <= 'Z') ? name[n] + 32 : name[n];
+		fz_md5_update(&md5, buf, n);
+		name += n;
+	}
+	fz_md5_final(&md5, key);
+}
+
+static xps_font_cache *
+xps_lookup_font(xps_document *doc, fz_hash_table *table, char *name)
+{
+	unsigned char key[16];
+
+	if (!table)
+		return NULL;
+	xps_font_key(name, key);
+	return fz_hash_find(doc->ctx, table, key);
+}
+
+static void
+xps_hash_font(xps_document *doc, fz_hash_table **tablep, char *name, xps_font_cache *cache)
+{
+	unsigned char key[16];
+
+	if (!*tablep)
+		*tablep = fz_new_hash_table(doc->ctx, 61, sizeof key, -1);
+	xps_font_key(name, key);
+	fz_hash_insert(doc->ctx, *tablep, key, cache);
+}
+
+static xps_font_cache *
+xps_insert_font(xps_document *doc, char *name, char *partname, fz_font *font)
+{
+	FT_Face face = font->ft_face;
 	xps_font_cache *cache = fz_malloc_struct(doc->ctx, xps_font_cache);
-	cache->name = fz_strdup(doc->ctx, name);
+
+	fz_try(doc->ctx)
+	{
+		cache->name = fz_strdup(doc->ctx, name);
+		xps_hash_font(doc, &doc->font_table, name, cache);
+	}
+	fz_catch(doc->ctx)
+	{
+		fz_free(doc->ctx, cache->name);
+		fz_free(doc->ctx, cache);
+		fz_rethrow(doc->ctx);
+	}
 	cache->font = fz_keep_font(doc->ctx, font);
-	cache->next = doc->font_table;
-	doc->font_table = cache;
+	cache->glyph_count = face->num_glyphs;
+
+	/* Other style simulations of the part copy the font data from here */
+	fz_try(doc->ctx)
+	{
+		if (!xps_lookup_font(doc, doc->font_part_table, partname))
+			xps_hash_font(doc, &doc->font_part_table, partname, cache);
+	}
+	fz_catch(doc->ctx)
+	{
+		fz_warn(doc->ctx, "cannot cache font resource '%s'", partname);
+	}
+
+	return cache;
 }
 
 /*
@@ -202,17 +316,87 @@ static inline int is_real_num_char(int c)
 		c == 'e' || c == 'E' || c == '+' || c == '-' || c == '.';
 }
 
+/*
+ * The numbers in Indices are nearly always short decimals, which are
+ * converted here directly: with at most 15 digits and a power of ten no
+ * larger than 1e22 both are exact doubles, so the one multiply or divide
+ * rounds the same way strtod does. Anything else (long mantissas, large
+ * exponents, malformed numbers) goes through fz_atof, so the result is
+ * always what fz_atof gives, including 1.0 for out of range numbers.
+ */
 static char *
 xps_parse_real_num(char *s, float *number)
 {
+	static const double exp10[] = {
+		1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
 	char buf[64];
-	char *p = buf;
-	while (is_real_num_char(*s))
-		*p++ = *s++;
-	*p = 0;
-	if (buf[0])
-		*number = fz_atof(buf);
-	return s;
+	char *start = s;
+	char *end = s;
+	double v = 0;
+	int neg = 0;
+	int digits = 0;
+	int scale = 0;
+	int e, eneg, n;
+
+	while (is_real_num_char(*end))
+		end++;
+	if (end == s)
+		return s;
+
+	if (*s == '+' || *s == '-')
+		neg = (*s++ == '-');
+	while (*s >= '0' && *s <= '9')
+	{
+		v = v * 10 + (*s++ - '0');
+		digits++;
+	}
+	if (*s == '.')
+	{
+		s++;
+		while (*s >= '0' && *s <= '9')
+		{
+			v = v * 10 + (*s++ - '0');
+			digits++;
+			scale--;
+		}
+	}
+	if (digits && (*s == 'e' || *s == 'E'))
+	{
+		s++;
+		eneg = 0;
+		if (*s == '+' || *s == '-')
+			eneg = (*s++ == '-');
+		e = 0;
+		n = 0;
+		while (*s >= '0' && *s <= '9')
+		{
+			if (e < 1000)
+				e = e * 10 + (*s - '0');
+			s++;
+			n++;
+		}
+		if (!n)
+			digits = 0;
+		scale += eneg ? -e : e;
+	}
+
+	if (s == end && digits > 0 && digits <= 15 && scale >= -22 && scale <= 22)
+	{
+		if (scale < 0)
+			v /= exp10[-scale];
+		else
+			v *= exp10[scale];
+		*number = neg ? -v : v;
+		return end;
+	}
+
+	n = fz_mini(end - start, sizeof buf - 1);
+	memcpy(buf, start, n);
+	buf[n] = 0;
+	*number = fz_atof(buf);
+	return end;
 }
 
 static char *
@@ -253,10 +437,11 @@ xps_parse_glyph_metrics(char *s, float *advance, float *uofs, float *vofs)
  */
 static fz_text *
 xps_parse_glyphs_imp(xps_document *doc, fz_matrix ctm,
-	fz_font *font, float size, float originx, float originy,
+	xps_font_cache *cache, float size, float originx, float originy,
 	int is_sideways, int bidi_level,
 	char *indices, char *unicode)
 {
+	fz_font *font = cache->font;
 	xps_glyph_metrics mtx;
 	fz_text *text;
 	fz_matrix tm;
@@ -322,9 +507,9 @@ xps_parse_glyphs_imp(xps_document *doc, fz_matrix ctm,
 				is = xps_parse_glyph_index(is, &glyph_index);
 
 			if (glyph_index == -1)
-				glyph_index = xps_encode_font_char(font, char_code);
+				glyph_index = xps_lookup_font_char(doc, cache, char_code);
 
-			xps_measure_font_glyph(doc, font, glyph_index, &mtx);
+			xps_lookup_font_glyph(doc, cache, glyph_index, &mtx);
 			if (is_sideways)
 				advance = mtx.vadv * 100;
 			else if (bidi_level & 1)
@@ -402,7 +587,10 @@ xps_parse_glyphs(xps_document *doc, fz_matrix ctm,
 	char *fill_opacity_att = NULL;
 
 	xps_part *part;
+	xps_font_cache *cache, *base;
 	fz_font *font;
+	unsigned char *data;
+	int size;
 
 	char partname[1024];
 	char fakename[1024];
@@ -499,36 +687,58 @@ xps_parse_glyphs(xps_document *doc, fz_matrix ctm,
 			fz_strlcat(fakename, "#BoldItalic", sizeof fakename);
 	}
 
-	font = xps_lookup_font(doc, fakename);
-	if (!font)
+	cache = xps_lookup_font(doc, doc->font_table, fakename);
+	if (cache)
+		font = fz_keep_font(doc->ctx, cache->font);
+	else
 	{
-		fz_try(doc->ctx)
+		/* Another style simulation of the same part may be loaded */
+		base = xps_lookup_font(doc, doc->font_part_table, partname);
+		if (base)
 		{
-			part = xps_read_part(doc, partname);
+			size = base->font->ft_size;
+			data = fz_malloc(doc->ctx, size);
+			memcpy(data, base->font->ft_data, size);
 		}
-		fz_catch(doc->ctx)
+		else
 		{
-			fz_warn(doc->ctx, "cannot find font resource part '%s'", partname);
-			return;
-		}
+			fz_try(doc->ctx)
+			{
+				part = xps_read_part(doc, partname);
+			}
+			fz_catch(doc->ctx)
+			{
+				fz_warn(doc->ctx, "cannot find font resource part '%s'", partname);
+				return;
+			}
+
+			/* deobfuscate if necessary */
+			if (strstr(part->name, ".odttf"))
+				xps_deobfuscate_font_resource(doc, part);
+			if (strstr(part->name, ".ODTTF"))
+				xps_deobfuscate_font_resource(doc, part);
 
-		/* deobfuscate if necessary */
-		if (strstr(part->name, ".odttf"))
-			xps_deobfuscate_font_resource(doc, part);
-		if (strstr(part->name, ".ODTTF"))
-			xps_deobfuscate_font_resource(doc, part);
+			data = part->data;
+			size = part->size;
+			fz_free(doc->ctx, part->name);
+			fz_free(doc->ctx, part);
+		}
 
 		fz_try(doc->ctx)
 		{
-			font = fz_new_font_from_memory(doc->ctx, NULL, part->data, part->size, subfontid, 1);
+			font = fz_new_font_from_memory(doc->ctx, NULL, data, size, subfontid, 1);
 		}
 		fz_catch(doc->ctx)
 		{
 			fz_warn(doc->ctx, "cannot load font resource '%s'", partname);
-			xps_free_part(doc, part);
+			fz_free(doc->ctx, data);
 			return;
 		}
 
+		/* NOTE: we keep the data in the font */
+		font->ft_data = data;
+		font->ft_size = size;
+
 		if (style_att)
 		{
 			font->ft_bold = !!strstr(style_att, "Bold");
@@ -537,13 +747,7 @@ xps_parse_glyphs(xps_document *doc, fz_matrix ctm,
 
 		xps_select_best_font_encoding(doc, font);
 
-		xps_insert_font(doc, fakename, font);
-
-		/* NOTE: we keep part->data in the font */
-		font->ft_data = part->data;
-		font->ft_size = part->size;
-		fz_free(doc->ctx, part->name);
-		fz_free(doc->ctx, part);
+		cache = xps_insert_font(doc, fakename, partname, font);
 	}
 
 	/*
@@ -565,7 +769,7 @@ xps_parse_glyphs(xps_document *doc, fz_matrix ctm,
 
 	font_size = fz_atof(font_size_att);
 
-	text = xps_parse_glyphs_imp(doc, ctm, font, font_size,
+	text = xps_parse_glyphs_imp(doc, ctm, cache, font_size,
 			fz_atof(origin_x_att), fz_atof(origin_y_att),
 			is_sideways, bidi_level, indices_att, unicode_att);
 
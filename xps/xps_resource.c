@@ -1,11 +1,43 @@
 #include "muxps-internal.h"
 
+/* Dictionaries with more entries than this are also hashed by key name */
+#define XPS_RESOURCE_HASH_MIN 16
+
+static void
+xps_resource_key(char *name, unsigned char key[16])
+{
+	fz_md5 md5;
+	fz_md5_init(&md5);
+	fz_md5_update(&md5, (unsigned char *)name, strlen(name));
+	fz_md5_final(&md5, key);
+}
+
 static xml_element *
 xps_find_resource(xps_document *doc, xps_resource *dict, char *name, char **urip)
 {
 	xps_resource *head, *node;
+	unsigned char key[16];
+	int have_key = 0;
+
 	for (head = dict; head; head = head->parent)
 	{
+		if (head->hash)
+		{
+			if (!have_key)
+			{
+				xps_resource_key(name, key);
+				have_key = 1;
+			}
+			node = fz_hash_find(doc->ctx, head->hash, key);
+			if (node)
+			{
+				if (urip && head->base_uri)
+					*urip = head->base_uri;
+				return node->data;
+			}
+			continue;
+		}
+
 		for (node = head; node; node = node->next)
 		{
 			if (!strcmp(node->name, name))
@@ -94,14 +126,17 @@ xps_parse_resource_dictionary(xps_document *doc, char *base_uri, xml_element *ro
 	xps_resource *head;
 	xps_resource *entry;
 	xml_element *node;
+	unsigned char digest[16];
 	char *source;
 	char *key;
+	int count;
 
 	source = xml_att(root, "Source");
 	if (source)
 		return xps_parse_remote_resource_dictionary(doc, base_uri, source);
 
 	head = NULL;
+	count = 0;
 
 	for (node = xml_down(root); node; node = xml_next(node))
 	{
@@ -115,7 +150,31 @@ xps_parse_resource_dictionary(xps_document *doc, char *base_uri, xml_element *ro
 			entry->data = node;
 			entry->next = head;
 			entry->parent = NULL;
+			entry->hash = NULL;
 			head = entry;
+			count++;
+		}
+	}
+
+	/* The first entry in the list wins for duplicate keys, as in the linear search */
+	if (count > XPS_RESOURCE_HASH_MIN)
+	{
+		fz_try(doc->ctx)
+		{
+			head->hash = fz_new_hash_table(doc->ctx, count * 2 + 1, sizeof digest, -1);
+			for (entry = head; entry; entry = entry->next)
+			{
+				xps_resource_key(entry->name, digest);
+				if (!fz_hash_find(doc->ctx, head->hash, digest))
+					fz_hash_insert(doc->ctx, head->hash, digest, entry);
+			}
+		}
+		fz_catch(doc->ctx)
+		{
+			if (head->hash)
+				fz_free_hash(doc->ctx, head->hash);
+			head->hash = NULL;
+			fz_warn(doc->ctx, "cannot hash resource dictionary");
 		}
 	}
 
@@ -136,6 +195,8 @@ xps_free_resource_dictionary(xps_document *doc, xps_resource *dict)
 			xml_free_element(doc->ctx, dict->base_xml);
 		if (dict->base_uri)
 			fz_free(doc->ctx, dict->base_uri);
+		if (dict->hash)
+			fz_free_hash(doc->ctx, dict->hash);
 		fz_free(doc->ctx, dict);
 		dict = next;
 	}
@@ -135,15 +135,25 @@ xps_read_zip_entry(xps_document *doc, xps_entry *ent, unsigned char *outbuf)
 	}
 	else if (method == 8)
 	{
-		inbuf = fz_malloc(ctx, ent->csize);
+		memset(&stream, 0, sizeof(z_stream));
 
-		fz_read(doc->file, inbuf, ent->csize);
+		/* Inflate in place when the stream buffers the whole entry, as mapped files do */
+		if (ent->csize >= 0 && doc->file->wp - doc->file->rp >= ent->csize)
+		{
+			inbuf = NULL;
+			stream.next_in = doc->file->rp;
+			doc->file->rp += ent->csize;
+		}
+		else
+		{
+			inbuf = fz_malloc(ctx, ent->csize);
+			fz_read(doc->file, inbuf, ent->csize);
+			stream.next_in = inbuf;
+		}
 
-		memset(&stream, 0, sizeof(z_stream));
 		stream.zalloc = (alloc_func) xps_zip_alloc_items;
 		stream.zfree = (free_func) xps_zip_free;
 		stream.opaque = doc;
-		stream.next_in = inbuf;
 		stream.avail_in = ent->csize;
 		stream.next_out = outbuf;
 		stream.avail_out = ent->usize;
@@ -618,7 +628,7 @@ xps_open_document(fz_context *ctx, char *filename)
 		return xps_open_document_with_directory(ctx, buf);
 	}
 
-	file = fz_open_file(ctx, filename);
+	file = fz_open_mapped_file(ctx, filename);
 	if (!file)
 		fz_throw(ctx, "cannot open file '%s': %s", filename, strerror(errno));
 
@@ -640,8 +650,8 @@ xps_open_document(fz_context *ctx, char *filename)
 void
 xps_close_document(xps_document *doc)
 {
-	xps_font_cache *font, *next;
-	int i;
+	xps_font_cache *font;
+	int i, k;
 
 	if (!doc)
 		return;
@@ -653,15 +663,25 @@ xps_close_document(xps_document *doc)
 		fz_free(doc->ctx, doc->zip_table[i].name);
 	fz_free(doc->ctx, doc->zip_table);
 
-	font = doc->font_table;
-	while (font)
+	if (doc->font_table)
 	{
-		next = font->next;
-		fz_drop_font(doc->ctx, font->font);
-		fz_free(doc->ctx, font->name);
-		fz_free(doc->ctx, font);
-		font = next;
+		for (i = 0; i < fz_hash_len(doc->ctx, doc->font_table); i++)
+		{
+			font = fz_hash_get_val(doc->ctx, doc->font_table, i);
+			if (!font)
+				continue;
+			fz_drop_font(doc->ctx, font->font);
+			for (k = 0; k < 256; k++)
+				fz_free(doc->ctx, font->encoding[k]);
+			fz_free(doc->ctx, font->metrics);
+			fz_free(doc->ctx, font->measured);
+			fz_free(doc->ctx, font->name);
+			fz_free(doc->ctx, font);
+		}
+		fz_free_hash(doc->ctx, doc->font_table);
 	}
+	if (doc->font_part_table)
+		fz_free_hash(doc->ctx, doc->font_part_table);
 
 	xps_free_page_list(doc);
 